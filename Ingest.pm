@@ -0,0 +1,246 @@
+package Ingest;
+
+# Buffered ingestion of what the master reports into the database.
+#
+# Values go into device_log in batches: they are collected in memory, and
+# written all at once, in one transaction, when MAX_ROWS have come in or
+# the oldest has waited MAX_MS milliseconds, whichever is first. With
+# PostgreSQL they are written with COPY, otherwise with multi-row INSERTs
+# of up to INSERT_ROWS rows, prepared once for each row count.
+#
+# The current status of each device is read from device_status once, at
+# startup, and kept here, so a device_history row is only written when
+# the status really changes, without a query for every ACTIVE or INACTIVE
+# line. Those rows go out in the same transaction as the values, along with
+# the updates of the tables of current state, device_status,
+# device_last_active_status and device_last_value (see schema.txt); the
+# last only once per device and batch, adding the number of its values in
+# the batch to the count of writes. A new active row of a device also
+# ends the time the one before it was valid, by setting its valid_to.
+# The values are added to the rollups for graphs too (see Rollup.pm).
+
+use strict;
+use warnings;
+
+use Time::HiRes;
+
+use Rollup;
+
+use constant MAX_ROWS => 1000;
+use constant MAX_MS => 1000;
+use constant INSERT_ROWS => 100;
+# valid_to of the active row valid now, the largest BIGINT.
+use constant VALID_OPEN => 9223372036854775807;
+
+
+sub getstamp {
+  my $sec_float = Time::HiRes::time();
+  return int(0.5 + $sec_float*1000);
+}
+
+
+sub new {
+  my ($class, $dbh) = @_;
+  my $self = bless {
+    dbh => $dbh,
+    # device id => [active, description, unit, poll interval]
+    status => {},
+    history => [],
+    log => [],
+    # When the first row not yet written came in.
+    since => undef,
+    copy => $dbh->{Driver}{Name} eq 'Pg',
+    rollup => Rollup->new($dbh),
+    # Statistics: rows written, and transactions.
+    rows => 0,
+    commits => 0,
+  }, $class;
+
+  $dbh->{AutoCommit} = 0;
+  $dbh->{RaiseError} = 1;
+  my $res = $dbh->selectall_arrayref(<<SQL);
+SELECT id, active, description, unit, poll_interval
+  FROM device_status
+SQL
+  $self->{status}{$_->[0]} = [@$_[1 .. 4]] for (@$res);
+  $dbh->commit;
+  $self->{insert_history} = $dbh->prepare(<<SQL);
+INSERT INTO device_history
+       (id, stamp, active, description, unit, poll_interval, valid_to)
+VALUES (?, ?, ?, ?, ?, ?, ?)
+SQL
+  $self->{end_valid} = $dbh->prepare(<<SQL);
+UPDATE device_history SET valid_to = ?
+ WHERE id = ? AND active = TRUE AND valid_to > ? AND stamp < ?
+SQL
+  $self->{update_status} = $dbh->prepare(<<SQL);
+INSERT INTO device_status VALUES (?, ?, ?, ?, ?, ?)
+    ON CONFLICT (id) DO UPDATE
+   SET stamp = excluded.stamp, active = excluded.active,
+       description = excluded.description, unit = excluded.unit,
+       poll_interval = excluded.poll_interval
+ WHERE excluded.stamp >= device_status.stamp
+SQL
+  $self->{update_last_active} = $dbh->prepare(<<SQL);
+INSERT INTO device_last_active_status VALUES (?, ?, TRUE, ?, ?, ?)
+    ON CONFLICT (id) DO UPDATE
+   SET stamp = excluded.stamp, active = TRUE,
+       description = excluded.description, unit = excluded.unit,
+       poll_interval = excluded.poll_interval
+SQL
+  $self->{update_inactive} = $dbh->prepare(<<SQL);
+UPDATE device_last_active_status SET active = FALSE WHERE id = ?
+SQL
+  $self->{update_last_value} = $dbh->prepare(<<SQL);
+INSERT INTO device_last_value VALUES (?, ?, ?, ?)
+    ON CONFLICT (id) DO UPDATE
+   SET stamp = CASE WHEN excluded.stamp > device_last_value.stamp
+                    THEN excluded.stamp ELSE device_last_value.stamp END,
+       value = CASE WHEN excluded.stamp > device_last_value.stamp
+                    THEN excluded.value ELSE device_last_value.value END,
+       writes = device_last_value.writes + excluded.writes
+SQL
+  return $self;
+}
+
+
+sub queue {
+  my ($self, $list, $row) = @_;
+
+  $self->{since} //= getstamp();
+  push @{$self->{$list}}, $row;
+}
+
+
+sub device_active {
+  my ($self, $dev, $poll_interval, $description, $unit, $stamp) = @_;
+  my $s = $self->{status}{$dev};
+
+  # Insert a row if new status differs from existing.
+  return if $s && $s->[0] && $s->[1] eq $description && $s->[2] eq $unit &&
+      $s->[3] == $poll_interval;
+  $self->{status}{$dev} = [1, $description, $unit, $poll_interval];
+  $self->queue('history',
+               [$dev, $stamp, 1, $description, $unit, $poll_interval]);
+}
+
+
+sub device_inactive {
+  my ($self, $dev, $stamp) = @_;
+  my $s = $self->{status}{$dev};
+
+  # Insert an inactive row only if the device is currently listed active.
+  return if !$s || !$s->[0];
+  $s->[0] = 0;
+  $self->queue('history', [$dev, $stamp, 0, undef, undef, undef]);
+}
+
+
+sub device_value {
+  my ($self, $dev, $stamp, $val) = @_;
+
+  $self->queue('log', [$dev, $stamp, $val]);
+  $self->flush if @{$self->{log}} >= MAX_ROWS;
+}
+
+
+# Milliseconds until the rows waiting must be written, or undef if none
+# are.
+sub flush_timeout {
+  my ($self) = @_;
+
+  return undef if !defined($self->{since});
+  my $left = $self->{since} + MAX_MS - getstamp();
+  return $left > 0 ? $left : 0;
+}
+
+
+sub write_log {
+  my ($self, $rows) = @_;
+  my $dbh = $self->{dbh};
+
+  if ($self->{copy}) {
+    $dbh->do("COPY device_log FROM STDIN");
+    $dbh->pg_putcopydata(join("\t", @$_) . "\n") for (@$rows);
+    $dbh->pg_putcopyend();
+    return;
+  }
+  for (my $i = 0; $i < @$rows; $i += INSERT_ROWS) {
+    my $n = @$rows - $i < INSERT_ROWS ? @$rows - $i : INSERT_ROWS;
+    my $sth = $dbh->prepare_cached("INSERT INTO device_log VALUES " .
+                                   join(', ', ('(?, ?, ?)') x $n));
+    $sth->execute(map { @$_ } @$rows[$i .. $i + $n - 1]);
+  }
+}
+
+
+sub write_history {
+  my ($self, $row) = @_;
+  my ($dev, $stamp, $active, @status) = @$row;
+
+  $self->{end_valid}->execute($stamp, $dev, $stamp, $stamp) if $active;
+  $self->{insert_history}->execute(@$row, $active ? VALID_OPEN : undef);
+  $self->{update_status}->execute(@$row);
+  if ($active) {
+    $self->{update_last_active}->execute($dev, $stamp, @status);
+  } else {
+    $self->{update_inactive}->execute($dev);
+  }
+}
+
+
+sub write_last_values {
+  my ($self, $rows) = @_;
+  my (%last, %writes);
+
+  for (@$rows) {
+    $last{$_->[0]} = $_ if !$last{$_->[0]} || $_->[1] > $last{$_->[0]}[1];
+    ++$writes{$_->[0]};
+  }
+  $self->{update_last_value}->execute(@$_, $writes{$_->[0]})
+      for (values %last);
+}
+
+
+# Write all rows waiting, in one transaction. Should that fail, say on a
+# duplicate value, write them one by one, leaving out those that fail.
+sub flush {
+  my ($self) = @_;
+  my $dbh = $self->{dbh};
+  my ($history, $log) = ($self->{history}, $self->{log});
+
+  return if !@$history && !@$log;
+  $self->{history} = [];
+  $self->{log} = [];
+  $self->{since} = undef;
+  $self->{rows} += @$history + @$log;
+  ++$self->{commits};
+
+  eval {
+    $self->write_history($_) for (@$history);
+    $self->write_log($log);
+    $self->write_last_values($log);
+    $self->{rollup}->add($log);
+    $dbh->commit;
+    1;
+  } and return;
+
+  print "Batch write failed, writing rows one by one: $@";
+  $dbh->rollback;
+  for my $row (@$history) {
+    eval { $self->write_history($row); $dbh->commit; 1 }
+        or do { print "Dropped history row: $@"; $dbh->rollback; };
+  }
+  for my $row (@$log) {
+    eval {
+      $self->write_log([$row]);
+      $self->write_last_values([$row]);
+      $self->{rollup}->add([$row]);
+      $dbh->commit;
+      1;
+    } or do { print "Dropped log row: $@"; $dbh->rollback; };
+  }
+}
+
+
+1;
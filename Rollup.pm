@@ -0,0 +1,107 @@
+package Rollup;
+
+# Rollups of device_log, for graphs.
+#
+# For every device, the count, minimum, maximum and sum of its values in
+# each minute, hour and day go into device_log_minute, device_log_hour and
+# device_log_day (see schema.txt), keyed by the start of the bucket in
+# milliseconds (UTC days). Ingest.pm calls add() with every batch of
+# values it writes, in the same transaction, so the rollups stay in step
+# with device_log without ever scanning it again.
+#
+# query() then reads a graph of a device from the coarsest of them that
+# still gives the points asked for, a few hundred rows instead of the
+# months of raw values behind them.
+
+use strict;
+use warnings;
+
+# Tables and their bucket sizes in milliseconds, finest first.
+our @LEVELS = (
+  ['device_log_minute', 60_000],
+  ['device_log_hour', 3_600_000],
+  ['device_log_day', 86_400_000],
+);
+
+
+sub new {
+  my ($class, $dbh) = @_;
+  my $self = bless { dbh => $dbh, upsert => {} }, $class;
+
+  for (@LEVELS) {
+    my ($table) = @$_;
+    $self->{upsert}{$table} = $dbh->prepare(<<SQL);
+INSERT INTO $table VALUES (?, ?, ?, ?, ?, ?)
+    ON CONFLICT (id, stamp) DO UPDATE
+   SET value_count = $table.value_count + excluded.value_count,
+       value_min = CASE WHEN excluded.value_min < $table.value_min
+                        THEN excluded.value_min ELSE $table.value_min END,
+       value_max = CASE WHEN excluded.value_max > $table.value_max
+                        THEN excluded.value_max ELSE $table.value_max END,
+       value_sum = $table.value_sum + excluded.value_sum
+SQL
+  }
+  return $self;
+}
+
+
+# Add rows [id, stamp, value] of device_log to the rollups: summed up
+# here first, then one upsert per device and bucket of each table.
+sub add {
+  my ($self, $rows) = @_;
+
+  for (@LEVELS) {
+    my ($table, $size) = @$_;
+    my %bucket;
+    for my $row (@$rows) {
+      my ($dev, $stamp, $val) = @$row;
+      my $b = $bucket{$dev}{$stamp - $stamp % $size} //=
+          [0, $val, $val, 0];
+      ++$b->[0];
+      $b->[1] = $val if $val < $b->[1];
+      $b->[2] = $val if $val > $b->[2];
+      $b->[3] += $val;
+    }
+    for my $dev (keys %bucket) {
+      $self->{upsert}{$table}->execute($dev, $_, @{$bucket{$dev}{$_}})
+          for (keys %{$bucket{$dev}});
+    }
+  }
+}
+
+
+# Graph of device $dev from $from to $to (milliseconds), of at least
+# $points points where there are values enough: rows [stamp, count, min,
+# max, average], oldest first, from the coarsest table with buckets small
+# enough, or the values themselves from device_log if even minutes are too
+# coarse. Returns the rows and the bucket size, 0 for values. The first
+# bucket is the one $from falls in, so it may start before $from.
+sub query {
+  my ($dbh, $dev, $from, $to, $points) = @_;
+  my $span = $to - $from;
+  my ($table, $size);
+
+  for (reverse @LEVELS) {
+    ($table, $size) = @$_;
+    last if $span / $size >= $points;
+    $table = undef;
+  }
+  if (!defined($table)) {
+    return ($dbh->selectall_arrayref(<<SQL, undef, $dev, $from, $to), 0);
+SELECT stamp, 1, value, value, value
+  FROM device_log
+ WHERE id = ? AND stamp >= ? AND stamp < ?
+ ORDER BY stamp
+SQL
+  }
+  $from -= $from % $size;
+  return ($dbh->selectall_arrayref(<<SQL, undef, $dev, $from, $to), $size);
+SELECT stamp, value_count, value_min, value_max, value_sum / value_count
+  FROM $table
+ WHERE id = ? AND stamp >= ? AND stamp < ?
+ ORDER BY stamp
+SQL
+}
+
+
+1;
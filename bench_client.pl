@@ -0,0 +1,172 @@
+#! /usr/bin/perl
+
+# Test of client.pl with a pseudo terminal standing in for the serial port
+# of the master.
+#
+# Starts client.pl on the pty, and plays the master: -n devices go
+# active, then report values at -r lines per second, for -t seconds. A
+# third of the way in, the database is locked for -S seconds, as a long
+# query or a slow commit would; the reader of client.pl should go on
+# reading all the same, while its queue grows, and the writer catch up
+# after. At the end, client.pl is stopped with SIGTERM, and has to write
+# everything queued before it exits.
+#
+# Reports the longest a write to the pty blocked, which is how long
+# client.pl did not read it, and the figures client.pl printed; fails if
+# the stall was as long as half the lock, or not all values got into
+# device_log.
+#
+# It needs a database with the tables of schema.txt, like the one left by
+# ./bench_ingest.pl; the devices are numbered from 1000 on, to keep clear
+# of those there.
+#
+#   ./bench_ingest.pl
+#   ./bench_client.pl -n 64 -r 2000 -t 15 -S 4
+
+use strict;
+use warnings;
+
+use DBI;
+use FindBin;
+use Getopt::Std;
+use IO::Handle;
+use POSIX;
+use Time::HiRes;
+
+# ioctls of Linux for the pty: unlock the other end, and get its number.
+use constant TIOCSPTLCK => 0x40045431;
+use constant TIOCGPTN => 0x80045430;
+# First device number.
+use constant FIRST_DEV => 1000;
+
+
+my %opt;
+getopts('d:u:n:r:t:S:', \%opt) or die <<USAGE;
+Usage: $0 [options]
+  -d DSN   data source (default DBI:SQLite:dbname=/tmp/bench_ingest.db)
+  -u USER  database user
+  -n N     number of devices (default 64)
+  -r N     POLL lines per second (default 2000)
+  -t SEC   seconds of lines (default 15)
+  -S SEC   seconds the database is locked (default 4)
+USAGE
+my $dsn = $opt{d} // "DBI:SQLite:dbname=/tmp/bench_ingest.db";
+my $devices = $opt{n} // 64;
+my $rate = $opt{r} // 2000;
+my $seconds = $opt{t} // 15;
+my $lock_s = $opt{S} // 4;
+my $log = "/tmp/bench_client.log";
+
+
+# Open a pty; returns our end, and the name of the other.
+sub open_pty {
+  sysopen(my $pty, "/dev/ptmx", O_RDWR | O_NOCTTY)
+      or die "Failed to open /dev/ptmx: $!\n";
+  my $n = pack('i', 0);
+  ioctl($pty, TIOCSPTLCK, $n) or die "Failed to unlock pty: $!\n";
+  ioctl($pty, TIOCGPTN, $n) or die "Failed to get pty number: $!\n";
+  return ($pty, "/dev/pts/" . unpack('i', $n));
+}
+
+
+# Lock the database against the writer of client.pl, or let it go.
+sub lock_db {
+  my ($dbh, $lock) = @_;
+
+  if (!$lock) {
+    $dbh->commit;
+  } elsif ($dbh->{Driver}{Name} eq 'SQLite') {
+    $dbh->do("BEGIN EXCLUSIVE");
+  } else {
+    $dbh->begin_work;
+    $dbh->do("LOCK TABLE device_log IN ACCESS EXCLUSIVE MODE");
+  }
+}
+
+
+my $dbh = DBI->connect($dsn, $opt{u}, undef,
+                       {RaiseError => 1, AutoCommit => 1, PrintError => 0});
+my ($pty, $pts) = open_pty();
+# The other end stays open here, so the raw mode stays set.
+open(my $keep, '+<', $pts) or die "Failed to open $pts: $!\n";
+system('stty', '-F', $pts, 'raw', '-echo') == 0
+    or die "Failed to set $pts raw\n";
+$pty->autoflush(1);
+
+my $client = fork();
+die "fork: $!\n" if !defined($client);
+if (!$client) {
+  open(STDOUT, '>', $log) or die "Failed to open $log: $!\n";
+  exec($^X, "$FindBin::Bin/client.pl", '-s', $pts, '-d', $dsn, '-m', 1,
+       defined($opt{u}) ? ('-u', $opt{u}) : ());
+  die "exec: $!\n";
+}
+
+# Whatever client.pl says to the master is read and thrown away.
+sub drain {
+  my $rin = '';
+  vec($rin, fileno($pty), 1) = 1;
+  while (select(my $rout = $rin, undef, undef, 0) > 0) {
+    last if !sysread($pty, my $junk, 4096);
+  }
+}
+
+# Write a line to client.pl; returns how long the write blocked.
+sub put {
+  my ($line) = @_;
+  my $start = Time::HiRes::time();
+
+  syswrite($pty, $line) == length($line) or die "Write to pty: $!\n";
+  return Time::HiRes::time() - $start;
+}
+
+my $start = Time::HiRes::time();
+# Stamps of the values are about the time client.pl got them.
+my $since = int($start * 1000) - 1000;
+put("ACTIVE $_|10|Bench sensor $_|C\n")
+    for (FIRST_DEV .. FIRST_DEV + $devices - 1);
+my ($lines, $stall, $locked, $unlocked) = (0, 0, 0, 0);
+my $lock_at = $start + $seconds / 3;
+my $lock_dbh;
+while ((my $now = Time::HiRes::time()) < $start + $seconds) {
+  if (!$locked && $now >= $lock_at) {
+    $lock_dbh = DBI->connect($dsn, $opt{u}, undef,
+                             {RaiseError => 1, AutoCommit => 1});
+    lock_db($lock_dbh, 1);
+    $locked = 1;
+  } elsif ($locked && !$unlocked && $now >= $lock_at + $lock_s) {
+    lock_db($lock_dbh, 0);
+    $lock_dbh->disconnect;
+    $unlocked = 1;
+  }
+  # Catch up with the rate, a few lines at a time.
+  while ($lines < ($now - $start) * $rate) {
+    my $dev = FIRST_DEV + $lines % $devices;
+    my $stamp = int(($now - $start) * 1000);
+    my $t = put("POLL $dev " . (20 + $lines % 100 / 10) . " $stamp\n");
+    $stall = $t if $t > $stall;
+    ++$lines;
+  }
+  drain();
+  Time::HiRes::sleep(0.005);
+}
+if ($locked && !$unlocked) {
+  lock_db($lock_dbh, 0);
+  $lock_dbh->disconnect;
+}
+Time::HiRes::sleep(1);
+drain();
+kill('TERM', $client);
+waitpid($client, 0);
+
+my ($written) = $dbh->selectrow_array(<<SQL, undef, $since);
+SELECT COUNT(*) FROM device_log
+ WHERE id >= @{[FIRST_DEV]} AND id < @{[FIRST_DEV + $devices]} AND stamp >= ?
+SQL
+open(my $out, '<', $log) or die "Failed to read $log: $!\n";
+print grep { /^(Queue|Writer|Stopping)/ } <$out>;
+printf("%d lines, longest write stall %.1f ms, database locked %d s, " .
+       "%d values written\n", $lines, $stall * 1000, $lock_s, $written);
+my $ok = $stall < $lock_s / 2 && $written == $lines;
+print "client:   ", ($ok ? "ok" : "FAIL"), "\n";
+exit($ok ? 0 : 1);
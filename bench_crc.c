@@ -0,0 +1,277 @@
+/*
+  CRC-16 check and micro-benchmark, run on a Linux host.
+
+  First checks that all the variants in crc16.c agree with a bit-at-a-time
+  reference for random buffers, split at random points to also exercise
+  continuing a CRC, and that the bus receive interrupt (bus_rx.c, frame.c)
+  accepts random frames with a CRC from the reference. Then times each
+  variant over buffers of a few sizes, to choose CRC16_SLICE for a target.
+  Frames on the bus are short, so the small sizes matter most.
+
+  Speeds are given in bytes per cycle, from the clock frequency of the
+  machine given with -f or else the x86 time stamp counter; elsewhere in
+  bytes per nanosecond. Run it on a machine similar to the target to be
+  meaningful, as the table variants trade memory accesses for fewer
+  dependent steps.
+
+  Example:
+
+    ./bench_crc -n 1000000
+*/
+
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bus_rx.h"
+#include "crc16.h"
+
+
+#define MAX_LEN 300
+
+struct variant {
+  const char *name;
+  uint32_t (*update)(const uint8_t *buf, uint32_t len, uint32_t crc_val);
+};
+
+static const struct variant variants[] = {
+  { "slice-by-1", crc16_update_1 },
+  { "slice-by-4", crc16_update_4 },
+  { "slice-by-8", crc16_update_8 }
+};
+#define NUM_VARIANTS (sizeof(variants)/sizeof(variants[0]))
+
+static double cpu_mhz;
+static const char *speed_unit = "bytes/ns";
+static volatile uint32_t sink;
+
+
+static uint32_t
+ref_crc16(const uint8_t *buf, uint32_t len, uint32_t crc)
+{
+  uint32_t i, j;
+
+  for (i = 0; i < len; ++i)
+  {
+    crc ^= buf[i];
+    for (j = 0; j < 8; ++j)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+  }
+  return crc;
+}
+
+
+/* Current time in cycles, or in nanoseconds if we cannot tell cycles. */
+static uint64_t
+cycles(void)
+{
+  struct timespec ts;
+  uint64_t ns;
+
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+
+  if (!cpu_mhz)
+  {
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+  }
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  return cpu_mhz ? ns * cpu_mhz / 1000 : ns;
+}
+
+
+/*
+  Feed a frame to the receive interrupt, and check that it comes out
+  whole, stored_len bytes of it, with a good CRC.
+*/
+static uint32_t
+check_rx(const uint8_t *frame, uint32_t len, uint32_t stored_len)
+{
+  const struct frame *f;
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+    bus_rx_byte(0, frame[i]);
+  if (!(f = bus_rx_get_frame(0)))
+    return 0;
+  return f->status == FRAME_OK && f->len == stored_len &&
+    !memcmp(f->data, frame, stored_len);
+}
+
+
+/*
+  Random ASCII response "!xx:P<text>|CRC\r\n", with text that cannot be
+  mistaken for framing. Returns its length, and the length kept by the
+  receive interrupt, without the "\r\n", in *stored_len.
+*/
+static uint32_t
+random_ascii(uint8_t *frame, uint32_t *stored_len)
+{
+  uint32_t len, i, n = rand() % (BUS_RX_MAX_FRAME - 12);
+
+  len = sprintf((char *)frame, "!%02x:P", (unsigned)(rand() % 128));
+  for (i = 0; i < n; ++i)
+  {
+    uint8_t c;
+    do
+      c = ' ' + rand() % 95;
+    while (c == '!' || c == '|');
+    frame[len++] = c;
+  }
+  frame[len++] = '|';
+  len += sprintf((char *)frame + len, "%04x\r\n",
+                 (unsigned)ref_crc16(frame, len, 0));
+  *stored_len = len - 2;
+  return len;
+}
+
+
+/* Random binary response, with any byte values in the payload. */
+static uint32_t
+random_binary(uint8_t *frame, uint32_t *stored_len)
+{
+  uint32_t n = 2 + rand() % (BUS_RX_MAX_FRAME - 8);
+  uint32_t i, crc;
+
+  frame[0] = BUS_RX_BINARY;
+  frame[1] = n;
+  for (i = 0; i < n; ++i)
+    frame[2 + i] = rand();
+  *stored_len = n + 4;
+  crc = ref_crc16(frame, n + 2, 0);
+  frame[n + 2] = crc & 0xff;
+  frame[n + 3] = crc >> 8;
+  return n + 4;
+}
+
+
+static uint32_t
+verify(uint32_t count)
+{
+  uint8_t buf[MAX_LEN + 8], frame[BUS_RX_MAX_FRAME + 8];
+  uint32_t errors = 0, rx_errors = 0;
+  uint32_t i, j, k, len, off, split, ref, crc, stored_len;
+
+  for (i = 0; i < 256; ++i)
+  {
+    buf[0] = i;
+    if (crc16_tab[i] != ref_crc16(buf, 1, 0))
+      ++errors;
+  }
+
+  for (i = 0; i < count; ++i)
+  {
+    len = rand() % MAX_LEN;
+    off = rand() % 8;
+    for (j = 0; j < len; ++j)
+      buf[off + j] = rand();
+    ref = ref_crc16(buf + off, len, 0);
+    split = len ? rand() % len : 0;
+    for (k = 0; k < NUM_VARIANTS; ++k)
+    {
+      crc = variants[k].update(buf + off, split, 0);
+      if (variants[k].update(buf + off + split, len - split, crc) != ref)
+        ++errors;
+    }
+    crc = 0;
+    for (j = 0; j < len; ++j)
+      crc = crc16(buf[off + j], crc);
+    if (crc != ref || crc16_buf(buf + off, len) != ref)
+      ++errors;
+
+    len = (i & 1) ? random_binary(frame, &stored_len) :
+      random_ascii(frame, &stored_len);
+    if (!check_rx(frame, len, stored_len))
+      ++rx_errors;
+  }
+
+  printf("verify:        %s (%u buffers, %u errors; %u frames received, "
+         "%u errors)\n", errors || rx_errors ? "FAIL" : "ok",
+         (unsigned)count, (unsigned)errors, (unsigned)count,
+         (unsigned)rx_errors);
+  return errors + rx_errors;
+}
+
+
+static void
+timing(void)
+{
+  static const uint32_t sizes[] = { 8, 16, 32, 64, 256, 4096 };
+  static uint8_t buf[4096];
+  uint32_t i, k, s, reps;
+  uint64_t start, used;
+
+  for (i = 0; i < sizeof(buf); ++i)
+    buf[i] = rand();
+  printf("%-14s", speed_unit);
+  for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+    printf(" %7u", (unsigned)sizes[s]);
+  printf("\n");
+  for (k = 0; k < NUM_VARIANTS; ++k)
+  {
+    printf("%-14s", variants[k].name);
+    for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); ++s)
+    {
+      reps = (16u << 20) / sizes[s];
+      start = cycles();
+      for (i = 0; i < reps; ++i)
+        sink += variants[k].update(buf, sizes[s], sink & 1);
+      used = cycles() - start;
+      printf(" %7.3f", used ? (double)reps * sizes[s] / used : 0);
+    }
+    printf("\n");
+  }
+}
+
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n N    random buffers and frames to verify (default 100000)\n"
+          "  -s N    random seed (default 1)\n"
+          "  -f MHZ  clock frequency, to give speeds in bytes per cycle\n"
+          "          without a time stamp counter\n"
+          "  -V      verify only, no timing\n", prog);
+  exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t count = 100000, seed = 1, do_timing = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:f:V")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n': count = strtoul(optarg, NULL, 0); break;
+    case 's': seed = strtoul(optarg, NULL, 0); break;
+    case 'f': cpu_mhz = strtod(optarg, NULL); break;
+    case 'V': do_timing = 0; break;
+    default: usage(argv[0]);
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  speed_unit = "bytes/cycle";
+#endif
+  if (cpu_mhz)
+    speed_unit = "bytes/cycle";
+
+  srand(seed);
+  if (verify(count))
+    return 1;
+  if (do_timing)
+    timing();
+  return 0;
+}
@@ -0,0 +1,390 @@
+/*
+  Check and micro-benchmark of the printf-free formatting in fmt.c, run on
+  a Linux host.
+
+  First checks that every fmt_* function gives the same text as the printf
+  format it replaces, for edge cases and random values; floats are checked
+  against "%.7g" both for random bit patterns and for short decimals, which
+  are what devices send and where halfway cases hide. With -x all 2^32 float
+  bit patterns are checked, which takes a while.
+
+  Then times building the lines master.c sends, each with snprintf() the
+  way it used to and with fmt.c, in cycles per line from the clock
+  frequency given with -f or else the x86 time stamp counter; elsewhere in
+  nanoseconds. Newlib's printf on the target is slower than glibc's, so the
+  gain there is larger still.
+
+  Example:
+
+    ./bench_fmt -n 1000000
+*/
+
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fmt.h"
+
+
+#define DESCRIPTION "\"Temperature, living room (north wall)\""
+#define UNIT "\"C\""
+
+static double cpu_mhz;
+static const char *time_unit = "ns";
+static volatile uint32_t sink;
+
+
+/* Current time in cycles, or in nanoseconds if we cannot tell cycles. */
+static uint64_t
+cycles(void)
+{
+  struct timespec ts;
+  uint64_t ns;
+
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t lo, hi;
+
+  if (!cpu_mhz)
+  {
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+  }
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  return cpu_mhz ? ns * cpu_mhz / 1000 : ns;
+}
+
+
+static uint32_t
+rand32(void)
+{
+  return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+
+static uint64_t
+rand64(void)
+{
+  return ((uint64_t)rand32() << 32) | rand32();
+}
+
+
+static uint32_t
+check(const char *what, const char *got, const char *want)
+{
+  static uint32_t reported;
+
+  if (!strcmp(got, want))
+    return 0;
+  if (reported++ < 10)
+    printf("mismatch %s: got \"%s\", want \"%s\"\n", what, got, want);
+  return 1;
+}
+
+
+static uint32_t
+check_float(float f)
+{
+  char got[FMT_FLOAT_MAX], want[40];
+  uint32_t len;
+
+  len = fmt_float(got, f) - got;
+  snprintf(want, sizeof(want), "%.7g", (double)f);
+  return check("%.7g", got, want) + (len != strlen(got));
+}
+
+
+static uint32_t
+verify(uint32_t count)
+{
+  static const uint32_t edge32[] = {
+    0, 1, 9, 10, 99, 100, 999999999, 1000000000, 0x7fffffff, 0x80000000,
+    0xffffffff
+  };
+  static const float edge_float[] = {
+    0.0f, -0.0f, 1.0f, -1.0f, 0.1f, 0.5f, 1e-4f, 9.999999e-5f, 0.0001f,
+    999999.9f, 9999999.0f, 1e7f, 12345675.0f, 12345665.0f, 1234567.5f,
+    123456.75f, 3.4028235e38f, 1.1754944e-38f, 1e-45f, 1.4e-45f,
+    16777216.0f, 23.45f, -40.0f
+  };
+  char got[40], want[40];
+  uint32_t errors = 0, floats = 0;
+  uint32_t i, u;
+  uint64_t u64;
+  float f;
+
+  for (i = 0; i < sizeof(edge32)/sizeof(edge32[0]) + count; ++i)
+  {
+    u = i < sizeof(edge32)/sizeof(edge32[0]) ? edge32[i] : rand32();
+    fmt_uint32(got, u);
+    sprintf(want, "%u", (unsigned)u);
+    errors += check("%u", got, want);
+    fmt_int32(got, (int32_t)u);
+    sprintf(want, "%ld", (long)(int32_t)u);
+    errors += check("%ld", got, want);
+    fmt_hex8(got, u & 0xff);
+    sprintf(want, "%02x", (unsigned)(u & 0xff));
+    errors += check("%02x", got, want);
+    u64 = (i & 1) ? rand64() : rand64() >> (rand() % 64);
+    fmt_uint64(got, u64);
+    sprintf(want, "%" PRIu64, u64);
+    errors += check("%" PRIu64, got, want);
+  }
+
+  for (i = 0; i < sizeof(edge_float)/sizeof(edge_float[0]); ++i, ++floats)
+    errors += check_float(edge_float[i]);
+  f = __builtin_inff();
+  errors += check_float(f) + check_float(-f);
+  errors += check_float(__builtin_nanf(""));
+  floats += 3;
+  for (i = 0; i < count; ++i, floats += 2)
+  {
+    u = rand32();
+    memcpy(&f, &u, sizeof(f));
+    errors += check_float(f);
+    /* A short decimal, like "%.2f" or an integer reading. */
+    f = (float)((int32_t)rand32() >> (rand() % 32)) /
+      (float)(i % 4 == 0 ? 1 : (i % 4 == 1 ? 10 : (i % 4 == 2 ? 100 : 1e4)));
+    errors += check_float(f);
+  }
+
+  printf("verify:        %s (%u integers of each kind, %u floats, "
+         "%u errors)\n", errors ? "FAIL" : "ok",
+         (unsigned)(count + sizeof(edge32)/sizeof(edge32[0])),
+         (unsigned)floats, (unsigned)errors);
+  return errors;
+}
+
+
+static uint32_t
+verify_all_floats(void)
+{
+  uint64_t u;
+  uint32_t errors = 0, u32;
+  float f;
+
+  for (u = 0; u <= 0xffffffffULL; ++u)
+  {
+    u32 = (uint32_t)u;
+    memcpy(&f, &u32, sizeof(f));
+    errors += check_float(f);
+  }
+  printf("all floats:    %s (%u errors)\n", errors ? "FAIL" : "ok",
+         (unsigned)errors);
+  return errors;
+}
+
+
+/*
+  The lines, each built the old way and the new way. The arguments vary
+  with i, so the work cannot be hoisted out of the timing loop.
+*/
+
+static void
+old_request(char *buf, uint32_t i)
+{
+  sprintf(buf, "?%02x:%c|", (unsigned)(i & 0x7f), (int)'P');
+}
+
+static void
+new_request(char *buf, uint32_t i)
+{
+  char *p;
+
+  buf[0] = '?';
+  p = fmt_str(fmt_hex8(buf + 1, i & 0x7f), ":");
+  *p++ = 'P';
+  fmt_str(p, "|");
+}
+
+static void
+old_discover(char *buf, uint32_t i)
+{
+  sprintf(buf, "?%02x:Db%u|", (unsigned)(i & 0x7f), 1u);
+}
+
+static void
+new_discover(char *buf, uint32_t i)
+{
+  buf[0] = '?';
+  fmt_str(fmt_uint32(fmt_str(fmt_hex8(buf + 1, i & 0x7f), ":Db"), 1), "|");
+}
+
+static void
+old_active(char *buf, uint32_t i)
+{
+  snprintf(buf, 199, "ACTIVE %u|%u|%s|%s\n", (unsigned)(i & 0x7f),
+           (unsigned)(i & 0xffff), DESCRIPTION, UNIT);
+}
+
+static void
+new_active(char *buf, uint32_t i)
+{
+  char *p;
+
+  p = fmt_uint32(fmt_str(buf, "ACTIVE "), i & 0x7f);
+  p = fmt_uint32(fmt_str(p, "|"), i & 0xffff);
+  p = fmt_str(fmt_str(p, "|"), DESCRIPTION);
+  p = fmt_str(fmt_str(p, "|"), UNIT);
+  fmt_str(p, "\n");
+}
+
+static void
+old_poll(char *buf, uint32_t i)
+{
+  snprintf(buf, 199, "POLL %u %s %" PRIu64 "\n", (unsigned)(i & 0x7f),
+           "23.45", (uint64_t)86400000*30 + i);
+}
+
+static void
+new_poll(char *buf, uint32_t i)
+{
+  char *p;
+
+  p = fmt_uint32(fmt_str(buf, "POLL "), i & 0x7f);
+  p = fmt_str(fmt_str(p, " "), "23.45");
+  p = fmt_uint64(fmt_str(p, " "), (uint64_t)86400000*30 + i);
+  fmt_str(p, "\n");
+}
+
+static void
+old_int(char *buf, uint32_t i)
+{
+  sprintf(buf, "%ld", (long)(int32_t)(i * 2654435761u) >> (i & 31));
+}
+
+static void
+new_int(char *buf, uint32_t i)
+{
+  fmt_int32(buf, (int32_t)(i * 2654435761u) >> (i & 31));
+}
+
+static void
+old_float(char *buf, uint32_t i)
+{
+  sprintf(buf, "%.7g", (double)((float)(int32_t)(i * 2654435761u) / 1e4f));
+}
+
+static void
+new_float(char *buf, uint32_t i)
+{
+  fmt_float(buf, (float)(int32_t)(i * 2654435761u) / 1e4f);
+}
+
+struct line {
+  const char *name;
+  void (*old_fmt)(char *buf, uint32_t i);
+  void (*new_fmt)(char *buf, uint32_t i);
+};
+
+static const struct line lines[] = {
+  { "request", old_request, new_request },
+  { "discover", old_discover, new_discover },
+  { "ACTIVE", old_active, new_active },
+  { "POLL", old_poll, new_poll },
+  { "int value", old_int, new_int },
+  { "float value", old_float, new_float }
+};
+#define NUM_LINES (sizeof(lines)/sizeof(lines[0]))
+
+
+static uint64_t
+time_fmt(void (*fmt)(char *buf, uint32_t i), uint32_t reps)
+{
+  char buf[200];
+  uint64_t start;
+  uint32_t i;
+
+  start = cycles();
+  for (i = 0; i < reps; ++i)
+  {
+    fmt(buf, i);
+    sink += buf[0];
+  }
+  return cycles() - start;
+}
+
+
+static uint32_t
+timing(uint32_t reps)
+{
+  char old_buf[200], new_buf[200];
+  uint32_t errors = 0, k, i;
+  uint64_t used_old, used_new;
+
+  printf("%-14s %10s %10s %8s\n", time_unit, "snprintf", "fmt", "speedup");
+  for (k = 0; k < NUM_LINES; ++k)
+  {
+    /* The two ways must agree, or the timing means nothing. */
+    for (i = 0; i < 1000; ++i)
+    {
+      lines[k].old_fmt(old_buf, i);
+      lines[k].new_fmt(new_buf, i);
+      errors += check(lines[k].name, new_buf, old_buf);
+    }
+    used_old = time_fmt(lines[k].old_fmt, reps);
+    used_new = time_fmt(lines[k].new_fmt, reps);
+    printf("%-14s %10.1f %10.1f %7.1fx\n", lines[k].name,
+           (double)used_old / reps, (double)used_new / reps,
+           used_new ? (double)used_old / used_new : 0);
+  }
+  return errors;
+}
+
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n N    random values to verify (default 200000)\n"
+          "  -r N    repetitions of each line to time (default 1000000)\n"
+          "  -s N    random seed (default 1)\n"
+          "  -f MHZ  clock frequency, to give times in cycles without a\n"
+          "          time stamp counter\n"
+          "  -x      also verify all 2^32 floats\n"
+          "  -V      verify only, no timing\n", prog);
+  exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t count = 200000, reps = 1000000, seed = 1, do_timing = 1;
+  uint32_t all_floats = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:r:s:f:xV")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n': count = strtoul(optarg, NULL, 0); break;
+    case 'r': reps = strtoul(optarg, NULL, 0); break;
+    case 's': seed = strtoul(optarg, NULL, 0); break;
+    case 'f': cpu_mhz = strtod(optarg, NULL); break;
+    case 'x': all_floats = 1; break;
+    case 'V': do_timing = 0; break;
+    default: usage(argv[0]);
+    }
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  time_unit = "cycles/line";
+#endif
+  if (cpu_mhz)
+    time_unit = "cycles/line";
+
+  srand(seed);
+  if (verify(count))
+    return 1;
+  if (all_floats && verify_all_floats())
+    return 1;
+  if (do_timing && timing(reps ? reps : 1))
+    return 1;
+  return 0;
+}
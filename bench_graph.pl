@@ -0,0 +1,186 @@
+#! /usr/bin/perl
+
+# Load test of graph_server.pl.
+#
+# Starts the server on the database, then has -k clients ask it for
+# graphs, as fast as they can for -t seconds, of ranges picked at random
+# from -r made up ones: a device, and anything from all of its values down
+# to 1/4096 of them. A quarter of the ranges reach past the newest value,
+# as a graph of the last hours would, and with -i, values are written
+# (through Ingest.pm) while the clients run, so the cache keeps losing
+# those. Reports the requests per second and the size of the answers, first
+# with the cache off, then on, and checks every answer has at most -g
+# points.
+#
+# It needs a database with values and rollups, like the one made by
+#
+#   ./bench_ingest.pl -H 200000
+#   ./bench_graph.pl -k 4 -t 10 -i 10
+
+use strict;
+use warnings;
+
+use DBI;
+use FindBin;
+use Getopt::Std;
+use HTTP::Tiny;
+use IO::Socket::INET;
+use JSON::PP;
+use POSIX;
+use Time::HiRes;
+
+use lib $FindBin::Bin;
+use Ingest;
+
+
+my %opt;
+getopts('d:u:p:k:t:g:c:r:i:', \%opt) or die <<USAGE;
+Usage: $0 [options]
+  -d DSN   data source (default DBI:SQLite:dbname=/tmp/bench_ingest.db)
+  -u USER  database user
+  -p PORT  port of the server (default 8081)
+  -k N     number of clients (default 4)
+  -t SEC   seconds of load, with the cache off and on (default 10)
+  -g N     points of a graph (default 500)
+  -c N     answers to cache (default 256)
+  -r N     number of ranges asked for (default 64)
+  -i N     values written per second while loading (default 0)
+USAGE
+my $dsn = $opt{d} // "DBI:SQLite:dbname=/tmp/bench_ingest.db";
+my $port = $opt{p} // 8081;
+my $clients = $opt{k} // 4;
+my $seconds = $opt{t} // 10;
+my $points = $opt{g} // 500;
+my $cache_size = $opt{c} // 256;
+my $range_count = $opt{r} // 64;
+my $insert_rate = $opt{i} // 0;
+
+my $dbh = DBI->connect($dsn, $opt{u}, undef,
+                       {RaiseError => 1, AutoCommit => 1, PrintError => 0});
+$dbh->sqlite_busy_timeout(5000) if $dbh->{Driver}{Name} eq 'SQLite';
+my ($first, $last) = $dbh->selectrow_array(
+    "SELECT MIN(stamp), MAX(stamp) FROM device_log_day");
+my $devices =
+    $dbh->selectcol_arrayref("SELECT DISTINCT id FROM device_log_day");
+die "No values in the database, see ./bench_ingest.pl -H\n" if !@$devices;
+my ($newest) =
+    $dbh->selectrow_array("SELECT MAX(stamp) FROM device_last_value");
+$last += 86_400_000;
+
+srand(1);
+my @ranges;
+for (1 .. $range_count) {
+  my $len = int(($last - $first) / 2 ** int(rand(13)));
+  my $to = rand() < 0.25 ? $newest + 3_600_000 :
+      $first + $len + int(rand($last - $first - $len));
+  push @ranges, "id=$devices->[rand(@$devices)]&from=" . ($to - $len) .
+      "&to=$to&points=$points";
+}
+
+
+# Start the server, and wait until it takes connections.
+sub start_server {
+  my ($cache) = @_;
+  my $pid = fork();
+
+  die "fork: $!\n" if !defined($pid);
+  if (!$pid) {
+    exec($^X, "$FindBin::Bin/graph_server.pl", '-d', $dsn, '-p', $port,
+         '-c', $cache, defined($opt{u}) ? ('-u', $opt{u}) : ());
+    die "exec: $!\n";
+  }
+  for (1 .. 100) {
+    return $pid if IO::Socket::INET->new(PeerAddr => '127.0.0.1',
+                                         PeerPort => $port);
+    Time::HiRes::sleep(0.1);
+  }
+  kill('TERM', $pid);
+  die "Server did not start\n";
+}
+
+
+# One client: requests, bytes, errors, and seconds waited for answers.
+sub client {
+  my ($deadline) = @_;
+  my $http = HTTP::Tiny->new(timeout => 30);
+  my ($requests, $bytes, $errors, $wait) = (0, 0, 0, 0);
+
+  while (Time::HiRes::time() < $deadline) {
+    my $start = Time::HiRes::time();
+    my $res = $http->get("http://127.0.0.1:$port/graph?" .
+                         $ranges[rand(@ranges)]);
+    $wait += Time::HiRes::time() - $start;
+    ++$requests;
+    # Decoding the JSON would take longer than the server; count the
+    # points by their brackets.
+    if (!$res->{success} || $res->{content} !~ /"points":\[/ ||
+        ($res->{content} =~ tr/[//) - 1 > $points) {
+      ++$errors;
+      next;
+    }
+    $bytes += length($res->{content});
+  }
+  return ($requests, $bytes, $errors, $wait);
+}
+
+
+# Write values of random devices, after the newest, until the deadline.
+sub write_values {
+  my ($deadline) = @_;
+  my $ingest = Ingest->new($dbh);
+
+  while (Time::HiRes::time() < $deadline) {
+    $newest += 1000;
+    $ingest->device_value($devices->[rand(@$devices)], $newest, rand(100));
+    $ingest->flush() if !$ingest->flush_timeout();
+    Time::HiRes::sleep(1 / $insert_rate);
+  }
+  $ingest->flush();
+  $dbh->{AutoCommit} = 1;
+}
+
+
+my $ok = 1;
+for my $cache (0, $cache_size) {
+  my $server = start_server($cache);
+  my $deadline = Time::HiRes::time() + $seconds;
+  my (@pipes, @pids);
+
+  for (1 .. $clients) {
+    pipe(my $r, my $w) or die "pipe: $!\n";
+    my $pid = fork();
+    die "fork: $!\n" if !defined($pid);
+    if (!$pid) {
+      close($r);
+      print $w join(' ', client($deadline)), "\n";
+      close($w);
+      POSIX::_exit(0);
+    }
+    close($w);
+    push @pipes, $r;
+    push @pids, $pid;
+  }
+  write_values($deadline) if $insert_rate;
+  my ($requests, $bytes, $errors, $wait) = (0, 0, 0, 0);
+  for my $r (@pipes) {
+    my @res = split(' ', <$r> // '0 0 1 0');
+    $requests += $res[0];
+    $bytes += $res[1];
+    $errors += $res[2];
+    $wait += $res[3];
+  }
+  waitpid($_, 0) for (@pids);
+  my $stats = JSON::PP->new->decode(
+      HTTP::Tiny->new->get("http://127.0.0.1:$port/stats")->{content});
+  kill('TERM', $server);
+  waitpid($server, 0);
+
+  printf("cache %-4d %8.1f requests/s, %6.2f ms each, %6.0f bytes, " .
+         "%d hits, %d stale, %d misses, %d errors\n", $cache,
+         $requests / $seconds, $requests ? $wait * 1000 / $requests : 0,
+         $requests ? $bytes / ($requests - $errors || 1) : 0,
+         @$stats{'hits', 'stale', 'misses'}, $errors);
+  $ok &&= $requests && !$errors;
+}
+print "graphs:   ", ($ok ? "ok" : "FAIL"), "\n";
+exit($ok ? 0 : 1);
@@ -0,0 +1,552 @@
+#! /usr/bin/perl
+
+# Benchmark of writing what the master reports into the database.
+#
+# Feeds the same made-up stream of ACTIVE, INACTIVE and POLL lines to the
+# way client.pl used to write them, a query of device_status for every
+# ACTIVE or INACTIVE line and an INSERT, committed by itself, for every
+# value, and to the batched writes of Ingest.pm. Reports the values
+# written per second by each, and checks that both wrote the same rows.
+#
+# The stream has a full report of all devices every ten rounds of values,
+# as the master sent every 5 minutes at a poll interval of 30 s, and a
+# device changes unit every fifth report.
+#
+# Ingest.pm also keeps the tables of current state up to date; these are
+# checked against the views over the history they replace (as
+# device_status_view and device_last_active_status_view). With -H, that
+# many history rows are made up for the devices, and the benchmark times
+# looking up the status of a device, and the overview of all devices, in
+# the tables and in the views.
+#
+# The history rows are an hour apart, and every device has -L values
+# between two of them, so two million rows of 64 devices are some three
+# and a half years. The page of the last 100 values of a device, with
+# their descriptions, is then timed with device_log_full, the range join
+# over valid_to, and with the view before it (device_log_full_view), and
+# the plans of both printed.
+#
+# The rollups of Rollup.pm are checked against device_log after the
+# batched run, and with -H, a graph of -g points over all the values of a
+# device is timed from the rollups and from device_log.
+#
+# The database defaults to SQLite, in a scratch file; -d gives another
+# data source, eg. "DBI:Pg:dbname=scratch". The tables of schema.txt are
+# dropped and created again there, so never point it at real data.
+#
+#   ./bench_ingest.pl -n 64 -v 20000 -H 2000000 -L 4 -g 500
+
+use strict;
+use warnings;
+
+use DBI;
+use FindBin;
+use Getopt::Std;
+use Time::HiRes;
+
+use lib $FindBin::Bin;
+use Ingest;
+use Rollup;
+
+
+my %opt;
+getopts('d:u:n:v:H:L:g:', \%opt) or die <<USAGE;
+Usage: $0 [options]
+  -d DSN   data source (default DBI:SQLite:dbname=/tmp/bench_ingest.db)
+  -u USER  database user
+  -n N     number of devices (default 64)
+  -v N     number of values (default 20000)
+  -H N     time status lookups with N history rows (default 0, none)
+  -L N     with -H, values of each device per history row (default 4)
+  -g N     with -H, points of the graph (default 500)
+USAGE
+my $dsn = $opt{d} // "DBI:SQLite:dbname=/tmp/bench_ingest.db";
+my $devices = $opt{n} // 64;
+my $values = $opt{v} // 20000;
+my $history_rows = $opt{H} // 0;
+my $history_values = $opt{L} // 4;
+my $graph_points = $opt{g} // 500;
+# Stamp of the first history row of -H.
+my $history_start = 1_000_000_000_000;
+my $default_db = "/tmp/bench_ingest.db";
+
+
+sub create_schema {
+  my ($dbh) = @_;
+
+  $dbh->do("DROP VIEW IF EXISTS $_")
+      for ('device_log_full_view', 'device_log_full',
+           'device_last_active_status_view', 'device_status_view');
+  $dbh->do("DROP TABLE IF EXISTS $_")
+      for ('device_last_value', 'device_last_active_status', 'device_status',
+           'device_history', 'device_log', map { $_->[0] } @Rollup::LEVELS);
+  $dbh->do(<<SQL);
+CREATE TABLE device_history (
+  id INTEGER NOT NULL,
+  stamp BIGINT NOT NULL,
+  active BOOLEAN NOT NULL,
+  description VARCHAR(140),
+  unit VARCHAR(20),
+  poll_interval INTEGER,
+  valid_to BIGINT,
+  PRIMARY KEY (id, stamp)
+)
+SQL
+  for my $table ('device_status', 'device_last_active_status') {
+    $dbh->do(<<SQL);
+CREATE TABLE $table (
+  id INTEGER PRIMARY KEY,
+  stamp BIGINT NOT NULL,
+  active BOOLEAN NOT NULL,
+  description VARCHAR(140),
+  unit VARCHAR(20),
+  poll_interval INTEGER
+)
+SQL
+  }
+  $dbh->do(<<SQL);
+CREATE TABLE device_log (
+  id INTEGER NOT NULL,
+  stamp BIGINT NOT NULL,
+  value FLOAT(24) NOT NULL,
+  PRIMARY KEY (id, stamp))
+SQL
+  $dbh->do(<<SQL);
+CREATE TABLE device_last_value (
+  id INTEGER PRIMARY KEY,
+  stamp BIGINT NOT NULL,
+  value FLOAT(24) NOT NULL,
+  writes BIGINT NOT NULL
+)
+SQL
+  for (@Rollup::LEVELS) {
+    $dbh->do(<<SQL);
+CREATE TABLE $_->[0] (
+  id INTEGER NOT NULL,
+  stamp BIGINT NOT NULL,
+  value_count INTEGER NOT NULL,
+  value_min FLOAT(24) NOT NULL,
+  value_max FLOAT(24) NOT NULL,
+  value_sum DOUBLE PRECISION NOT NULL,
+  PRIMARY KEY (id, stamp))
+SQL
+  }
+  my $valid_at = $dbh->{Driver}{Name} eq 'Pg' ?
+      "int8range(H.stamp, H.valid_to) @> L.stamp" :
+      "H.valid_to > L.stamp AND H.stamp <= L.stamp";
+  $dbh->do(<<SQL);
+CREATE VIEW device_log_full AS
+SELECT L.id, L.stamp, L.value, H.description, H.unit
+  FROM device_log L
+  LEFT JOIN device_history H
+    ON (H.id = L.id
+    AND H.active = TRUE
+    AND $valid_at)
+SQL
+
+  # The views the tables replace.
+  $dbh->do(<<SQL);
+CREATE VIEW device_status_view AS
+SELECT id, stamp, active, description, unit, poll_interval
+  FROM (SELECT id AS max_id, MAX(stamp) AS max_stamp
+          FROM device_history AS dh1
+         GROUP BY id) find_newest
+ INNER JOIN device_history AS dh2
+    ON (max_id = id AND max_stamp = stamp)
+SQL
+  $dbh->do(<<SQL);
+CREATE VIEW device_last_active_status_view AS
+SELECT max_active_id AS id, active_history.stamp, newest_history.active,
+       active_history.description, active_history.unit,
+       active_history.poll_interval
+  FROM (SELECT id AS max_active_id, MAX(stamp) AS max_active_stamp
+          FROM device_history AS dh1
+         WHERE active = TRUE
+         GROUP BY id) newest_active
+ INNER JOIN device_history AS active_history
+    ON (max_active_id = active_history.id
+    AND max_active_stamp = active_history.stamp)
+ INNER JOIN device_history AS newest_history
+    ON (newest_history.id = max_active_id
+    AND newest_history.stamp = (SELECT MAX(stamp)
+                                  FROM device_history AS dh3
+                                 WHERE dh3.id = max_active_id))
+SQL
+  $dbh->do(<<SQL);
+CREATE VIEW device_log_full_view AS
+SELECT L.id, L.stamp, L.value, H.description, H.unit
+  FROM device_log L
+  LEFT JOIN device_history H
+    ON (L.id = H.id
+    AND H.stamp = (SELECT MAX(H2.stamp)
+                     FROM device_history H2
+                    WHERE H2.id = L.id
+                      AND L.stamp >= H2.stamp
+                      AND H2.active = TRUE))
+SQL
+}
+
+
+# The index of valid_to (schema.txt), once it is filled in.
+sub valid_index {
+  my ($dbh) = @_;
+
+  if ($dbh->{Driver}{Name} eq 'Pg') {
+    $dbh->do("CREATE EXTENSION IF NOT EXISTS btree_gist");
+    $dbh->do(<<SQL);
+ALTER TABLE device_history ADD CONSTRAINT device_history_valid
+  EXCLUDE USING gist (id WITH =, int8range(stamp, valid_to) WITH &&)
+  WHERE (active)
+SQL
+    return;
+  }
+  $dbh->do(<<SQL);
+CREATE INDEX device_history_valid
+    ON device_history (id, valid_to)
+ WHERE active = TRUE
+SQL
+}
+
+
+# Rows of the query, in one string, for comparing.
+sub rows {
+  my ($dbh, $sql, @bind) = @_;
+
+  return join("\n", map { join('|', map { $_ // 'NULL' } @$_) }
+              @{$dbh->selectall_arrayref($sql, undef, @bind)});
+}
+
+
+# Check device_log_full against the view it replaces, for the values of
+# the query.
+sub check_log_full {
+  my ($dbh, $where, @bind) = @_;
+
+  return rows($dbh, "SELECT * FROM device_log_full $where", @bind) eq
+      rows($dbh, "SELECT * FROM device_log_full_view $where", @bind);
+}
+
+
+# The page of the last values of a device.
+my $page = "WHERE id = ? ORDER BY stamp DESC LIMIT 100";
+
+
+# Query of the buckets of device_log of $size milliseconds, as in the
+# rollups.
+sub buckets {
+  my ($size, $where) = @_;
+
+  return <<SQL;
+SELECT id, stamp / $size * $size AS bucket, COUNT(*), MIN(value), MAX(value),
+       SUM(value)
+  FROM device_log
+$where
+ GROUP BY id, stamp / $size * $size
+ ORDER BY id, bucket
+SQL
+}
+
+
+# Check the rollups against device_log. The sums are added up in another
+# order, so they may differ in the last bits.
+sub check_rollups {
+  my ($dbh) = @_;
+
+  for (@Rollup::LEVELS) {
+    my ($table, $size) = @$_;
+    my $want = $dbh->selectall_arrayref(buckets($size, ''));
+    my $got =
+        $dbh->selectall_arrayref("SELECT * FROM $table ORDER BY id, stamp");
+    return 0 if @$got != @$want;
+    for my $i (0 .. $#$got) {
+      my ($g, $w) = ($got->[$i], $want->[$i]);
+      return 0 if join('|', @$g[0 .. 4]) ne join('|', @$w[0 .. 4]) ||
+          abs($g->[5] - $w->[5]) > 1e-9 * (1 + abs($w->[5]));
+    }
+  }
+  return 1;
+}
+
+
+# Check the tables of current state against what they replace.
+sub check_state {
+  my ($dbh) = @_;
+  my $ok = 1;
+
+  for my $table ('device_status', 'device_last_active_status') {
+    $ok &&= rows($dbh, "SELECT * FROM $table ORDER BY id") eq
+        rows($dbh, "SELECT * FROM ${table}_view ORDER BY id");
+  }
+  $ok &&= rows($dbh, "SELECT * FROM device_last_value ORDER BY id") eq
+      rows($dbh, <<SQL);
+SELECT L.id, L.stamp, L.value, newest.writes
+  FROM device_log L
+ INNER JOIN (SELECT id, MAX(stamp) AS max_stamp, COUNT(*) AS writes
+               FROM device_log
+              GROUP BY id) newest
+    ON (L.id = newest.id AND L.stamp = newest.max_stamp)
+ ORDER BY L.id
+SQL
+  return $ok;
+}
+
+
+# The stream of lines, as calls of $out->{active}, {inactive} and {value}.
+sub stream {
+  my ($out) = @_;
+  my $stamp = 1_500_000_000_000;
+  my $reports = 0;
+
+  for (my $i = 0; $i < $values; ++$i) {
+    my $dev = $i % $devices;
+    if ($dev == 0 && ($i / $devices) % 10 == 0) {
+      ++$reports;
+      for my $d (0 .. $devices - 1) {
+        my $unit = $d == $reports % $devices && $reports % 5 == 0 ?
+            "unit $reports" : "C";
+        $out->{active}($d, 30, "Sensor $d", $unit, $stamp);
+      }
+      # One device goes away for a while now and then.
+      $out->{inactive}($reports % $devices, $stamp + 1) if $reports % 7 == 0;
+    }
+    $out->{value}($dev, $stamp, 20 + ($i % 1000) / 100);
+    ++$stamp;
+  }
+}
+
+
+# As client.pl used to do it.
+sub per_row {
+  my ($dbh) = @_;
+  my $status = sub {
+    my ($dev) = @_;
+    return $dbh->selectall_arrayref(<<SQL, undef, $dev);
+SELECT active, description, unit, poll_interval
+  FROM device_status_view
+ WHERE id = ?
+SQL
+  };
+
+  stream({
+    active => sub {
+      my ($dev, $poll_interval, $description, $unit, $stamp) = @_;
+      my $res = $status->($dev);
+      if (!scalar(@$res) || !$res->[0][0] || $res->[0][1] ne $description ||
+          $res->[0][2] ne $unit || $res->[0][3] != $poll_interval) {
+        my @row = ($dev, $stamp, $description, $unit, $poll_interval);
+        $dbh->do(<<SQL, undef, @row);
+INSERT INTO device_history
+       (id, stamp, active, description, unit, poll_interval)
+VALUES (?, ?, TRUE, ?, ?, ?)
+SQL
+      }
+    },
+    inactive => sub {
+      my ($dev, $stamp) = @_;
+      my $res = $status->($dev);
+      if (scalar(@$res) && $res->[0][0]) {
+        $dbh->do(<<SQL, undef, $dev, $stamp);
+INSERT INTO device_history
+       (id, stamp, active, description, unit, poll_interval)
+VALUES (?, ?, FALSE, NULL, NULL, NULL)
+SQL
+      }
+    },
+    value => sub {
+      my ($dev, $stamp, $val) = @_;
+      $dbh->do(<<SQL, undef, $dev, $stamp, $val);
+INSERT INTO device_log VALUES (?, ?, ?)
+SQL
+    },
+  });
+  return undef;
+}
+
+
+sub batched {
+  my ($dbh) = @_;
+  my $ingest = Ingest->new($dbh);
+
+  stream({
+    active => sub { $ingest->device_active(@_) },
+    inactive => sub { $ingest->device_inactive(@_) },
+    value => sub { $ingest->device_value(@_) },
+  });
+  $ingest->flush();
+  return $ingest;
+}
+
+
+# Made-up history of the devices, an hour apart: on and off, and a new
+# description now and then, with values in between. Then valid_to and the
+# tables of current state, filled as for an existing database (schema.txt).
+sub make_history {
+  my ($dbh) = @_;
+  my $sth = $dbh->prepare(
+      "INSERT INTO device_history " .
+      "(id, stamp, active, description, unit, poll_interval) VALUES " .
+      join(', ', ('(?, ?, ?, ?, ?, ?)') x $devices));
+  my $log = $dbh->prepare("INSERT INTO device_log VALUES " .
+                          join(', ', ('(?, ?, ?)') x $devices));
+  my $stamp = $history_start;
+
+  $dbh->begin_work;
+  for (my $i = 0; $i < $history_rows; $i += $devices) {
+    my $on = ($i / $devices) % 2 == 0;
+    my $descr = "Sensor, version " . int($i / $devices / 100);
+    $sth->execute(map { $on ? ($_, $stamp, 1, "$descr $_", 'C', 30) :
+                            ($_, $stamp, 0, undef, undef, undef) }
+                  (0 .. $devices - 1));
+    for my $j (0 .. $history_values - 1) {
+      my $t = $stamp + 1 + int($j * 3_600_000 / $history_values);
+      $log->execute(map { ($_, $t, $i % 1000 + $j) } (0 .. $devices - 1));
+    }
+    $stamp += 3_600_000;
+  }
+  $dbh->do(<<SQL);
+UPDATE device_history
+   SET valid_to = COALESCE((SELECT MIN(H2.stamp)
+                              FROM device_history H2
+                             WHERE H2.id = device_history.id
+                               AND H2.stamp > device_history.stamp
+                               AND H2.active = TRUE),
+                           9223372036854775807)
+ WHERE active = TRUE
+SQL
+  valid_index($dbh);
+  $dbh->do(<<SQL);
+INSERT INTO device_status
+SELECT * FROM device_status_view
+SQL
+  $dbh->do(<<SQL);
+INSERT INTO device_last_active_status
+SELECT H.id, H.stamp, S.active, H.description, H.unit, H.poll_interval
+  FROM device_history H
+ INNER JOIN device_status S ON (S.id = H.id)
+ WHERE H.stamp = (SELECT MAX(H2.stamp)
+                    FROM device_history H2
+                   WHERE H2.id = H.id
+                     AND H2.active = TRUE)
+SQL
+  $dbh->do(<<SQL);
+INSERT INTO device_last_value
+SELECT L.id, L.stamp, L.value, newest.writes
+  FROM device_log L
+ INNER JOIN (SELECT id, MAX(stamp) AS max_stamp, COUNT(*) AS writes
+               FROM device_log
+              GROUP BY id) newest
+    ON (L.id = newest.id AND L.stamp = newest.max_stamp)
+SQL
+  my $from = 'device_log';
+  my ($count, $min, $max, $sum) = ('COUNT(*)', 'MIN(value)', 'MAX(value)',
+                                   'SUM(value)');
+  for (@Rollup::LEVELS) {
+    my ($table, $size) = @$_;
+    $dbh->do(<<SQL);
+INSERT INTO $table
+SELECT id, stamp / $size * $size, $count, $min, $max, $sum
+  FROM $from
+ GROUP BY id, stamp / $size * $size
+SQL
+    $from = $table;
+    ($count, $min, $max, $sum) = ('SUM(value_count)', 'MIN(value_min)',
+                                  'MAX(value_max)', 'SUM(value_sum)');
+  }
+  $dbh->commit;
+}
+
+
+# The plan of the query for device 0, as the database explains it.
+sub explain {
+  my ($dbh, $sql) = @_;
+  my $explain = $dbh->{Driver}{Name} eq 'SQLite' ?
+      "EXPLAIN QUERY PLAN" : "EXPLAIN ANALYZE";
+
+  return join('', map { "    $_->[-1]\n" }
+              @{$dbh->selectall_arrayref("$explain $sql", undef, 0)});
+}
+
+
+# Milliseconds per run of the query, for each device if it takes one.
+sub time_query {
+  my ($dbh, $sql, $per_device) = @_;
+  my $runs = $per_device ? $devices : 5;
+  my $start = Time::HiRes::time();
+
+  for my $i (1 .. $runs) {
+    $dbh->selectall_arrayref($sql, undef, $per_device ? ($i - 1) : ());
+  }
+  return (Time::HiRes::time() - $start) * 1000 / $runs;
+}
+
+
+unlink($default_db) if !$opt{d};
+my %rows;
+for my $mode ('per row', 'batched') {
+  my $dbh = DBI->connect($dsn, $opt{u}, undef,
+                         {RaiseError => 1, AutoCommit => 1, PrintError => 0});
+  create_schema($dbh);
+  valid_index($dbh);
+  my $start = Time::HiRes::time();
+  my $ingest = $mode eq 'batched' ? batched($dbh) : per_row($dbh);
+  my $t = Time::HiRes::time() - $start;
+  $dbh->commit if !$dbh->{AutoCommit};
+  $dbh->{AutoCommit} = 1;
+  my ($log) = $dbh->selectrow_array("SELECT COUNT(*) FROM device_log");
+  my ($history) =
+      $dbh->selectrow_array("SELECT COUNT(*) FROM device_history");
+  printf("%-8s %8.3f s, %9.0f values/s, %d log rows, %d history rows%s\n",
+         $mode, $t, $values / $t, $log, $history,
+         $ingest ? ", $ingest->{commits} commits" : "");
+  $rows{$mode} = "$log $history";
+  $rows{state} = check_state($dbh) && check_rollups($dbh) &&
+      check_log_full($dbh, "ORDER BY id, stamp") if $ingest;
+  $dbh->disconnect;
+}
+my $ok = $rows{'per row'} eq $rows{batched};
+print "rows:     ", ($ok ? "ok" : "FAIL"), "\n";
+print "state:    ", ($rows{state} ? "ok" : "FAIL"), "\n";
+$ok &&= $rows{state};
+
+if ($history_rows) {
+  my $dbh = DBI->connect($dsn, $opt{u}, undef,
+                         {RaiseError => 1, AutoCommit => 1, PrintError => 0});
+  create_schema($dbh);
+  my $start = Time::HiRes::time();
+  make_history($dbh);
+  printf("%d history rows, %d values made in %.1f s\n", $history_rows,
+         $history_rows * $history_values, Time::HiRes::time() - $start);
+  for my $table ('device_status', 'device_last_active_status') {
+    printf("%-26s %10.3f ms per device, %10.3f ms all, view %10.3f ms, " .
+           "%10.3f ms\n", $table,
+           time_query($dbh, "SELECT * FROM $table WHERE id = ?", 1),
+           time_query($dbh, "SELECT * FROM $table"),
+           time_query($dbh, "SELECT * FROM ${table}_view WHERE id = ?", 1),
+           time_query($dbh, "SELECT * FROM ${table}_view"));
+  }
+  for my $view ('device_log_full', 'device_log_full_view') {
+    printf("%-26s %10.3f ms per page\n%s", $view,
+           time_query($dbh, "SELECT * FROM $view $page", 1),
+           explain($dbh, "SELECT * FROM $view $page"));
+  }
+  my $to = $history_start + $history_rows / $devices * 3_600_000;
+  my ($graph, $size) =
+      Rollup::query($dbh, 0, $history_start, $to, $graph_points);
+  $start = Time::HiRes::time();
+  Rollup::query($dbh, $_, $history_start, $to, $graph_points)
+      for (0 .. $devices - 1);
+  printf("graph of %d points      %10.3f ms from rollups, ", scalar(@$graph),
+         (Time::HiRes::time() - $start) * 1000 / $devices);
+  $start = Time::HiRes::time();
+  $dbh->selectall_arrayref(
+      buckets($size || 1, " WHERE id = ? AND stamp >= ? AND stamp < ?"), undef,
+      $_, $history_start, $to) for (0 .. $devices - 1);
+  printf("%10.3f ms from device_log\n",
+         (Time::HiRes::time() - $start) * 1000 / $devices);
+  my $same = check_state($dbh);
+  $same &&= check_log_full($dbh, $page, $_) for (0 .. $devices - 1);
+  print "lookups:  ", ($same ? "ok" : "FAIL"), "\n";
+  $ok &&= $same;
+  $dbh->disconnect;
+}
+exit($ok ? 0 : 1);
@@ -0,0 +1,876 @@
+/*
+  Throughput benchmark for the master, run on a Linux host.
+
+  Runs the unmodified master core (master.c) against the simulated bus in
+  sim_bus.c for a given amount of virtual time, and reports achieved poll
+  rate, discover sweep time, per-device poll lateness and jitter, and how
+  long it takes to discover devices plugged in while running, and the bus
+  time lost waiting for responses that never came.
+
+  Example:
+
+    ./bench_master -n 16 -i 1 -l 2000 -j 500 -d 0.01 -t 600
+
+  With -B, the slaves support faster bus speeds, which the master should
+  negotiate; -C limits the speed the cable can carry, so the master has to
+  fall back.
+
+  With -L, the slaves support latched polling, and -m gives them a time to
+  take a sample; the benchmark then also reports how far apart in time the
+  devices take their samples, and how well the time stamps in the POLL
+  lines match the time of sampling. With -T they also support slotted
+  read-out; use -j to make answers overlap the next slot now and then, and
+  -d to make them miss their slots.
+
+  With -b, the slaves support binary frames; compare the bus bytes per
+  value, and the poll rate a busy bus manages, with and without. The
+  benchmark checks every value in the POLL lines against the value the
+  slave sent, and fails on a mismatch; -E makes the slaves send extremes of
+  float and integer values, to test how they are passed on.
+
+  With -F, the host requests a full report every second and all slaves have
+  maximum length descriptions, flooding the host link (use -H to slow the
+  link down further). Slaves then return
+  increasing sequence numbers as poll values, and the benchmark fails if any
+  device's POLL lines arrive out of order or if polls get delayed, ie. if
+  reporting stalls the bus.
+
+  With -X, that many more slaves have extended addresses, random ids of
+  four hex digits, which the master has to find by enumeration; the
+  benchmark reports how long it took to find them. The host build of the
+  master has room for 3968 of them.
+
+  The description and unit in every ACTIVE line are checked against those
+  of the slave. With -D, each slave has a description of its own, of
+  varying length, and one of a few units, to fill the master's string pool.
+
+  With -R, the client stops reading for a tenth of the run, from 30% in,
+  missing every line the master sends meanwhile; like client.pl, it then
+  asks for a replay of the missed values from the sample log as soon as it
+  sees a gap in their sequence numbers. The benchmark fails if any value
+  is missing at the end, other than those the master says it no longer
+  has.
+
+  With -N, the master runs that many buses at once, each with the slaves
+  given by -n, -A and -X; the benchmark reports the poll rate of each bus
+  alongside the total.
+
+  With -Y, the client keeps a copy of the device table, and checks it
+  against the checksum in every SYNC line; with -F, it then asks for the
+  devices changed since the last SYNC line, rather than a full report.
+  Compare the host bytes with and without. The benchmark fails on a
+  checksum mismatch not explained by dropped lines.
+
+  With -P, the client asks the master for the framed or binary host
+  protocol; the benchmark checks the CRC and sequence number of every
+  frame, unpacks the batches of POLL values, and reports the host bytes per
+  value. It fails on a CRC error, or on a gap in the sequence numbers not
+  explained by dropped lines or a -R outage.
+*/
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "host_tx.h"
+#include "master.h"
+#include "sample_log.h"
+#include "sim_bus.h"
+
+
+/*
+  In flood mode, a poll this late counts as a bus stall. The slowest normal
+  transaction is a discover with a full length description (about 15 ms on
+  the wire), plus turnaround and the 2 ms release delay.
+*/
+#define STALL_LIMIT_US 25000
+/*
+  With batched POLL values, a value stamped this much before the last
+  sample of its slave is for an earlier sample.
+*/
+#define STAMP_SLACK_US 10000
+
+static uint64_t poll_lines, active_lines, inactive_lines, other_lines;
+static uint64_t order_errors;
+static double last_value[NUM_BUS][SIM_MAX_ID];
+static int verbose, check_order;
+/*
+  Plug-in time of hot-plugged devices, and when they, and devices with
+  extended addresses, were reported active.
+*/
+static uint64_t plug_time[NUM_BUS][SIM_MAX_ID];
+static uint64_t found_time[NUM_BUS][SIM_MAX_ID];
+static uint8_t ext_slave[NUM_BUS][SIM_MAX_ID];
+/* Largest difference between POLL time stamp and actual sample time. */
+static uint64_t stamp_err_max;
+/* POLL values checked against the value sent, and how many differed. */
+static uint64_t values_checked, value_errors;
+/* ACTIVE lines checked against the slave's strings, and how many differed. */
+static uint64_t strings_checked, string_errors;
+/*
+  With -R: when the client misses lines; which sequence numbers it got, and
+  the next one expected; the first value and the end of the replay asked
+  for, the end 0 if none is under way; and the lines missed, replayed, and
+  lost for good.
+*/
+#define MAX_SEQ (1 << 22)
+static int replay_client;
+static uint64_t outage_start, outage_end;
+static uint8_t seq_seen[MAX_SEQ];
+static uint32_t next_seq, replay_from, replay_end;
+static uint64_t outage_lines, replay_lines, replay_requests, replay_lost;
+static char replay_cmd[32];
+/*
+  With -P: frames received, with a bad CRC, and missing by their sequence
+  numbers; frames skipped in a -R outage; and the next sequence number
+  expected, -1 before the first frame.
+*/
+static uint64_t text_frames, binary_frames, crc_errors, frame_gaps;
+static uint64_t outage_frames;
+static int32_t next_frame = -1;
+static int batched;
+/*
+  With -Y: the client's copy of the device table, whether each device is
+  active and the CRC of the state reported for it; the devices reported
+  since a full report started, and whether one is under way; the
+  generation of the table it is at; and the SYNC lines checked, and how
+  many did not match.
+*/
+static int sync_client;
+static uint8_t dev_active[NUM_BUS][SIM_MAX_ID];
+static uint16_t dev_crc[NUM_BUS][SIM_MAX_ID];
+static uint8_t dev_seen[NUM_BUS][SIM_MAX_ID];
+static int full_sync = 1;
+static uint32_t sync_gen;
+static uint64_t sync_checks, sync_mismatches;
+static char sync_cmd[32];
+
+
+/* Like client.pl, on a gap in the POLL sequence numbers ask for a replay. */
+static int
+replay_check(uint32_t seq)
+{
+  int replayed = seq < next_seq;
+
+  if (seq < MAX_SEQ)
+    seq_seen[seq] = 1;
+  if (replayed)
+  {
+    ++replay_lines;
+    if (seq + 1 == replay_end)
+      replay_end = 0;
+  }
+  else
+  {
+    if (seq > next_seq && !replay_end)
+    {
+      replay_from = next_seq;
+      sprintf(replay_cmd, "REPLAY %u\n", (unsigned)replay_from);
+      sim_host_input(replay_cmd);
+      ++replay_requests;
+      replay_end = ~(uint32_t)0;
+    }
+    next_seq = seq + 1;
+  }
+  return replayed;
+}
+
+
+/*
+  "SYNC <gen> <active> <checksum>": compare with our copy of the device
+  table, and ask for a full report if it differs.
+*/
+static void
+sync_check(const char *line)
+{
+  char *p, *q;
+  uint32_t gen = strtoul(line + 5, &p, 10);
+  uint32_t active = strtoul(p, &q, 10);
+  uint32_t sum = strtoul(q, NULL, 10);
+  uint32_t b, id, n = 0, s = 0;
+
+  for (b = 0; b < NUM_BUS; ++b)
+    for (id = 0; id < SIM_MAX_ID; ++id)
+    {
+      /* Devices not in a full report are gone. */
+      if (full_sync && !dev_seen[b][id])
+        dev_active[b][id] = 0;
+      dev_seen[b][id] = 0;
+      if (dev_active[b][id])
+      {
+        ++n;
+        s += dev_crc[b][id];
+      }
+    }
+  ++sync_checks;
+  full_sync = 0;
+  sync_gen = gen;
+  if (n != active || s != sum)
+  {
+    ++sync_mismatches;
+    if (verbose)
+      printf("sync mismatch: %s, have %u %u\n", line, (unsigned)n,
+             (unsigned)s);
+    full_sync = 1;
+    sim_host_input("SYNC\n");
+  }
+}
+
+
+static void
+handle_line(const char *line)
+{
+  if (!strncmp(line, "POLL ", 5))
+  {
+    char *p, *q, *r;
+    uint32_t dev = strtoul(line + 5, &p, 10);
+    double val = strtod(p, &q);
+    uint64_t stamp_us = strtoull(q, &r, 10) * 1000;
+    uint32_t seq = strtoul(r, NULL, 10);
+    /* Devices on bus b are reported as b*65536 + id. */
+    uint32_t bus = dev >> 16, id = dev & 0xffff;
+    struct sim_slave *s = sim_find_slave(bus, id);
+
+    ++poll_lines;
+    /* A replayed value is an old one, so there is nothing to check. */
+    if (replay_client && replay_check(seq))
+      s = NULL;
+    /*
+      Nor is one that waited in a batch while the slave took a newer
+      sample.
+    */
+    if (s && batched && stamp_us + STAMP_SLACK_US < s->sample_time)
+      s = NULL;
+    if (s)
+    {
+      uint64_t err = stamp_us > s->sample_time ?
+        stamp_us - s->sample_time : s->sample_time - stamp_us;
+      if (err > stamp_err_max)
+        stamp_err_max = err;
+      /*
+        Allow for the two decimals ASCII values are sent with, and the
+        seven digits floats are passed on with. With the host link flooded,
+        the line may be for an older sample.
+      */
+      if (!check_order)
+      {
+        ++values_checked;
+        if (fabs(val - s->sample_value) > 0.006 + 1e-6*fabs(s->sample_value))
+        {
+          ++value_errors;
+          if (verbose)
+            printf("value mismatch: %s, sent %.9g\n", line, s->sample_value);
+        }
+      }
+    }
+    if (s && check_order)
+    {
+      if (val <= last_value[bus][id])
+        ++order_errors;
+      last_value[bus][id] = val;
+    }
+  }
+  else if (!strncmp(line, "ACTIVE ", 7))
+  {
+    char *p;
+    uint32_t dev = strtoul(line + 7, &p, 10);
+    uint32_t bus = dev >> 16, id = dev & 0xffff;
+    struct sim_slave *s = sim_find_slave(bus, id);
+    size_t len;
+
+    ++active_lines;
+    if (bus < NUM_BUS)
+    {
+      dev_active[bus][id] = dev_seen[bus][id] = 1;
+      dev_crc[bus][id] = sim_crc16(line + 7, strlen(line + 7));
+    }
+    /* "ACTIVE <dev>|<interval>|<description>|<unit>" */
+    if (s && *p == '|' && (p = strchr(p + 1, '|')))
+    {
+      ++strings_checked;
+      len = strlen(s->description);
+      if (strncmp(p + 1, s->description, len) || p[1 + len] != '|' ||
+          strcmp(p + 2 + len, s->unit))
+      {
+        ++string_errors;
+        if (verbose)
+          printf("string mismatch: %s\n", line);
+      }
+    }
+    if (bus < NUM_BUS && (plug_time[bus][id] || ext_slave[bus][id]) &&
+        !found_time[bus][id])
+      found_time[bus][id] = sim_now_us();
+  }
+  else if (!strncmp(line, "INACTIVE ", 9))
+  {
+    uint32_t dev = strtoul(line + 9, NULL, 10);
+
+    ++inactive_lines;
+    if ((dev >> 16) < NUM_BUS)
+    {
+      dev_active[dev >> 16][dev & 0xffff] = 0;
+      dev_seen[dev >> 16][dev & 0xffff] = 1;
+    }
+  }
+  else if (!strncmp(line, "SYNC ", 5))
+  {
+    ++other_lines;
+    if (sync_client)
+      sync_check(line);
+  }
+  else if (!strncmp(line, "REPLAY ", 7))
+  {
+    /* "REPLAY <first> <end>"; the values before first are lost. */
+    char *p;
+    uint32_t first = strtoul(line + 7, &p, 10);
+
+    replay_end = strtoul(p, NULL, 10);
+    replay_lost += first - replay_from;
+    if (first == replay_end)
+      replay_end = 0;
+  }
+  else
+    ++other_lines;
+  if (verbose)
+    printf("%10.3f  %s\n", sim_now_us() / 1e6, line);
+}
+
+
+static int
+in_outage(void)
+{
+  return replay_client && sim_now_us() >= outage_start &&
+    sim_now_us() < outage_end;
+}
+
+
+/* Check the sequence number of a frame against the one expected. */
+static void
+frame_seq(uint32_t seq)
+{
+  if (next_frame >= 0 && seq != (uint32_t)next_frame)
+    frame_gaps += (seq - next_frame) & 0xffff;
+  next_frame = (seq + 1) & 0xffff;
+}
+
+
+/* "$<seq>:<line>|<CRC>", or a plain line in text mode. */
+static void
+host_line(const char *line)
+{
+  char buf[512];
+  const char *bar;
+  char *p;
+  uint32_t seq;
+
+  if (in_outage())
+  {
+    ++outage_lines;
+    if (*line == '$')
+      ++outage_frames;
+    return;
+  }
+  if (*line != '$')
+  {
+    handle_line(line);
+    return;
+  }
+  ++text_frames;
+  seq = strtoul(line + 1, &p, 10);
+  bar = strrchr(line, '|');
+  if (*p != ':' || !bar || strlen(bar) != 5 ||
+      strtoul(bar + 1, NULL, 16) != sim_crc16(line, bar + 1 - line) ||
+      (size_t)(bar - p) > sizeof(buf))
+  {
+    ++crc_errors;
+    if (verbose)
+      printf("bad frame: %s\n", line);
+    return;
+  }
+  frame_seq(seq);
+  memcpy(buf, p + 1, bar - p - 1);
+  buf[bar - p - 1] = '\0';
+  handle_line(buf);
+}
+
+
+/*
+  A batch of POLL values, checked like POLL lines: the sequence number and
+  time stamp of the first value, then sample log records.
+*/
+static void
+host_frame(const uint8_t *frame, uint32_t len)
+{
+  static const char digits[] = SAMPLE_LOG_DIGITS;
+  const uint8_t *p = frame + 5, *end = frame + len - 2;
+  char text[SAMPLE_LOG_MAX_TEXT + 1], line[200];
+  uint32_t seq, i, n, id, low, t;
+  uint64_t stamp;
+
+  if (in_outage())
+  {
+    ++outage_frames;
+    return;
+  }
+  ++binary_frames;
+  if (sim_crc16((const char *)frame, len - 2) !=
+      (frame[len - 2] | (uint32_t)frame[len - 1] << 8) ||
+      frame[4] != 'P' || end - p < 12)
+  {
+    ++crc_errors;
+    return;
+  }
+  frame_seq(frame[2] | frame[3] << 8);
+  seq = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+  stamp = 0;
+  for (i = 0; i < 8; ++i)
+    stamp |= (uint64_t)p[4 + i] << (8*i);
+  for (p += 12; p < end; p += n, ++seq)
+  {
+    n = *p & 0x7f;
+    id = p[1] | p[2] << 8 | p[3] << 16;
+    low = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+    for (i = 8, t = 0; i < n; ++i)
+    {
+      if (*p & 0x80)
+        text[t++] = p[i];
+      else
+      {
+        text[t++] = digits[p[i] & 0xf];
+        if ((p[i] >> 4) != 15)
+          text[t++] = digits[p[i] >> 4];
+      }
+    }
+    text[t] = '\0';
+    sprintf(line, "POLL %u %s %" PRIu64 " %u", (unsigned)id, text,
+            stamp + (int32_t)(low - (uint32_t)stamp), (unsigned)seq);
+    handle_line(line);
+  }
+}
+
+
+/*
+  Give slave s a description of its own, in buf, of 11 to 44 characters,
+  and one of units[].
+*/
+static void
+slave_strings(struct sim_slave *s, char *buf, const char *const *units)
+{
+  uint32_t len = sprintf(buf, "Sensor %03u ", (unsigned)s->id);
+  uint32_t pad = (s->id * 7) % 32;
+
+  memset(buf + len, "abcdefgh"[s->id % 8], pad);
+  buf[len + pad] = '\0';
+  s->description = buf;
+  s->unit = units[s->id % 4];
+}
+
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n N    number of virtual slaves (default 8)\n"
+          "  -i S    poll interval of each slave, in seconds (default 1)\n"
+          "  -l US   slave response latency, in usec (default 1000)\n"
+          "  -j US   random extra latency, 0..US usec (default 0)\n"
+          "  -d P    probability of a slave dropping a request (default 0)\n"
+          "  -t S    virtual time to simulate, in seconds (default 300)\n"
+          "  -s N    random seed (default 1)\n"
+          "  -H BAUD speed of the host link (default 115200)\n"
+          "  -A N    plug in N more slaves at random times during the run\n"
+          "  -S US   response latency of the plugged in slaves (default -l)\n"
+          "  -B LIST bus speed divisors the slaves support, eg. 17,8,4,2\n"
+          "          (default: old firmware, legacy speed only)\n"
+          "  -C BAUD highest bus speed the cable carries (default no limit)\n"
+          "  -L      slaves support latched polling\n"
+          "  -T      slaves support latched polling with slotted read-out\n"
+          "  -m US   time for a slave to take a sample, in usec (default 0)\n"
+          "  -b      slaves support binary frames\n"
+          "  -E      slaves send extreme float and integer values\n"
+          "  -F      flood the host link and check ordering and bus stalls\n"
+          "  -D      a different description for every slave\n"
+          "  -X N    N more slaves, with extended addresses\n"
+          "  -R      client misses lines for a while, then asks for a replay\n"
+          "  -N N    number of buses, each with the slaves above (default 1)\n"
+          "  -Y      client checks the device table against SYNC lines\n"
+          "  -P MODE host protocol: text, framed or binary (default text)\n"
+          "  -v      print all lines sent to the host\n", prog);
+  exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t num = 8, interval = 1, latency = 1000, jitter = 0, seed = 1;
+  uint32_t host_baud = 115200, hotplug = 0, hotplug_latency = 0;
+  uint32_t max_baud = 0, fast_baud = 0, fast_count = 0;
+  uint32_t latch = 0, slots = 0, sample_us = 0, binary = 0, edge = 0;
+  uint64_t skew_sum = 0, skew_max = 0, skew_count = 0;
+  const char *divisors = NULL;
+  uint64_t found_sum = 0, found_max = 0, found_count = 0;
+  double late_sq_sum = 0;
+  double drop = 0, duration = 300;
+  uint64_t end_us, late_sum = 0, late_count = 0, late_max = 0;
+  uint64_t next_report_us = 0;
+  const char *description = "Simulated sensor";
+  char long_description[141];
+  static char descriptions[SIM_MAX_SLAVES][48];
+  static const char *const units[] = { "C", "%RH", "hPa", "lux" };
+  int distinct = 0;
+  uint32_t ext = 0, ext_found = 0;
+  uint64_t ext_sum = 0, ext_max = 0;
+  uint32_t nbus = 1, b;
+  /* The first slave of each bus, for the sample skew. */
+  uint32_t first[NUM_BUS];
+  const char *proto = NULL;
+  char mode_cmd[32];
+  int flood = 0, failed = 0;
+  uint32_t i, stack;
+  int opt;
+
+  while ((opt = getopt(argc, argv,
+                       "n:i:l:j:d:t:s:H:A:S:B:C:LTm:bEvFDX:N:RP:Y")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n': num = strtoul(optarg, NULL, 0); break;
+    case 'i': interval = strtoul(optarg, NULL, 0); break;
+    case 'l': latency = strtoul(optarg, NULL, 0); break;
+    case 'j': jitter = strtoul(optarg, NULL, 0); break;
+    case 'd': drop = strtod(optarg, NULL); break;
+    case 't': duration = strtod(optarg, NULL); break;
+    case 's': seed = strtoul(optarg, NULL, 0); break;
+    case 'H': host_baud = strtoul(optarg, NULL, 0); break;
+    case 'A': hotplug = strtoul(optarg, NULL, 0); break;
+    case 'S': hotplug_latency = strtoul(optarg, NULL, 0); break;
+    case 'B': divisors = optarg; break;
+    case 'C': max_baud = strtoul(optarg, NULL, 0); break;
+    case 'L': latch = 1; break;
+    case 'T': latch = slots = 1; break;
+    case 'm': sample_us = strtoul(optarg, NULL, 0); break;
+    case 'b': binary = 1; break;
+    case 'E': edge = 1; break;
+    case 'v': verbose = 1; break;
+    case 'F': flood = check_order = 1; break;
+    case 'D': distinct = 1; break;
+    case 'X': ext = strtoul(optarg, NULL, 0); break;
+    case 'N': nbus = strtoul(optarg, NULL, 0); break;
+    case 'R': replay_client = 1; break;
+    case 'P': proto = optarg; break;
+    case 'Y': sync_client = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (nbus < 1)
+    nbus = 1;
+  if (nbus > NUM_BUS)
+    nbus = NUM_BUS;
+  if (num > SIM_LEGACY_IDS)
+    num = SIM_LEGACY_IDS;
+  if (hotplug > SIM_LEGACY_IDS - num)
+    hotplug = SIM_LEGACY_IDS - num;
+  if (ext > SIM_MAX_SLAVES / nbus - num - hotplug)
+    ext = SIM_MAX_SLAVES / nbus - num - hotplug;
+  if (!hotplug_latency)
+    hotplug_latency = latency;
+
+  if (flood)
+  {
+    memset(long_description, 'x', sizeof(long_description) - 1);
+    long_description[sizeof(long_description) - 1] = '\0';
+    description = long_description;
+  }
+
+  sim_init(seed);
+  sim_set_host_baud(host_baud);
+  sim_set_bus_max_baud(max_baud);
+  sim_set_host_line_hook(host_line);
+  sim_set_host_frame_hook(host_frame);
+  srand(seed);
+  for (b = 0; b < nbus; ++b)
+  {
+    first[b] = sim_slave_count();
+    for (i = 0; i < num; ++i)
+    {
+      struct sim_slave *s = sim_add_slave(b, i, interval, description, "C");
+      if (distinct)
+        slave_strings(s, descriptions[sim_slave_count() - 1], units);
+      s->latency_us = latency;
+      s->jitter_us = jitter;
+      s->drop_rate = drop;
+      s->sequence_values = check_order;
+      s->divisors = divisors;
+      s->latch = latch;
+      s->slots = slots;
+      s->sample_us = sample_us;
+      s->binary = binary;
+      s->edge_values = edge;
+    }
+    for (i = num; i < num + hotplug; ++i)
+    {
+      struct sim_slave *s = sim_add_slave(b, i, interval, description, "C");
+      if (distinct)
+        slave_strings(s, descriptions[sim_slave_count() - 1], units);
+      s->latency_us = hotplug_latency;
+      s->jitter_us = jitter;
+      s->drop_rate = drop;
+      s->divisors = divisors;
+      s->latch = latch;
+      s->slots = slots;
+      s->sample_us = sample_us;
+      s->binary = binary;
+      s->edge_values = edge;
+      /* Plug in somewhere in the first 60% of the run, not at the start. */
+      s->plug_time =
+        (uint64_t)(duration * 1e6 * (0.1 + 0.5 * rand() / RAND_MAX));
+      plug_time[b][i] = s->plug_time;
+    }
+    for (i = num + hotplug; i < num + hotplug + ext; ++i)
+    {
+      uint32_t id;
+      struct sim_slave *s;
+
+      do
+        id = SIM_LEGACY_IDS + rand() % (0xffff - SIM_LEGACY_IDS);
+      while (ext_slave[b][id]);
+      ext_slave[b][id] = 1;
+      s = sim_add_slave(b, id, interval, description, "C");
+      if (distinct)
+        slave_strings(s, descriptions[sim_slave_count() - 1], units);
+      s->latency_us = latency;
+      s->jitter_us = jitter;
+      s->drop_rate = drop;
+      s->sequence_values = check_order;
+      s->divisors = divisors;
+      s->latch = latch;
+      s->sample_us = sample_us;
+      s->edge_values = edge;
+    }
+  }
+
+  master_init(nbus);
+  end_us = (uint64_t)(duration * 1e6);
+  outage_start = end_us * 3 / 10;
+  outage_end = end_us * 4 / 10;
+  if (proto)
+  {
+    snprintf(mode_cmd, sizeof(mode_cmd), "MODE %s\n", proto);
+    sim_host_input(mode_cmd);
+    batched = !strcmp(proto, "binary");
+    /* Not to be overwritten by the first full report request. */
+    next_report_us = 1000000;
+  }
+  while (sim_now_us() < end_us)
+  {
+    if (flood && sim_now_us() >= next_report_us)
+    {
+      if (sync_client)
+      {
+        sprintf(sync_cmd, "SYNC %u\n", (unsigned)sync_gen);
+        sim_host_input(sync_cmd);
+      }
+      else
+        sim_host_input("\n");
+      next_report_us = sim_now_us() + 1000000;
+    }
+    poll_n_discover_step();
+  }
+
+  printf("Simulated %.1f s, %u slaves, interval %u s, latency %u+%u us, "
+         "drop %.3f\n", sim_now_us() / 1e6, (unsigned)num, (unsigned)interval,
+         (unsigned)latency, (unsigned)jitter, drop);
+  if (nbus > 1)
+    printf("On each of %u buses\n", (unsigned)nbus);
+  printf("%6s %10s %10s %12s %12s %12s\n", "dev", "polls", "answered",
+         "avg late ms", "max late ms", "jitter ms");
+  for (i = 0; i < sim_slave_count(); ++i)
+  {
+    struct sim_slave *s = sim_get_slave(i);
+    double avg = s->lateness_count ?
+      s->lateness_sum_us / 1e3 / s->lateness_count : 0;
+    double var = s->lateness_count ?
+      s->lateness_sq_sum / s->lateness_count - avg*avg : 0;
+
+    /* With many extended addresses, just the first ones. */
+    if (i < SIM_LEGACY_IDS)
+      printf("%6u %10" PRIu64 " %10" PRIu64 " %12.2f %12.2f %12.2f\n",
+             (unsigned)(s->bus << 16 | s->id), s->poll_requests,
+             s->poll_answers, avg, s->lateness_max_us / 1e3,
+             var > 0 ? sqrt(var) : 0);
+    else if (i == SIM_LEGACY_IDS)
+      printf("%6s (%u more)\n", "...", (unsigned)(sim_slave_count() - i));
+    late_sum += s->lateness_sum_us;
+    late_sq_sum += s->lateness_sq_sum;
+    if (plug_time[s->bus][s->id])
+    {
+      uint64_t plug = plug_time[s->bus][s->id];
+      uint64_t t = found_time[s->bus][s->id] ?
+        found_time[s->bus][s->id] - plug : sim_now_us() - plug;
+      ++found_count;
+      found_sum += t;
+      if (t > found_max)
+        found_max = t;
+    }
+    if (ext_slave[s->bus][s->id] && found_time[s->bus][s->id])
+    {
+      uint64_t t = found_time[s->bus][s->id];
+      ++ext_found;
+      ext_sum += t;
+      if (t > ext_max)
+        ext_max = t;
+    }
+    late_count += s->lateness_count;
+    if (s->lateness_max_us > late_max)
+      late_max = s->lateness_max_us;
+    if (s->baud > fast_baud)
+    {
+      fast_baud = s->baud;
+      fast_count = 0;
+    }
+    if (s->baud == fast_baud)
+      ++fast_count;
+    /*
+      Sample skew: how far apart in the poll cycle this device and the first
+      one on its bus took their last samples.
+    */
+    if (i > first[s->bus] && s->sample_time &&
+        sim_get_slave(first[s->bus])->sample_time)
+    {
+      uint64_t period = (uint64_t)interval * 1000000;
+      uint64_t d = (s->sample_time + period -
+                    sim_get_slave(first[s->bus])->sample_time % period) %
+        period;
+      if (d > period / 2)
+        d = period - d;
+      ++skew_count;
+      skew_sum += d;
+      if (d > skew_max)
+        skew_max = d;
+    }
+  }
+
+  printf("polls/s:          %.2f (requests %.2f/s)\n",
+         poll_lines / (sim_now_us() / 1e6),
+         sim_stats.poll_requests / (sim_now_us() / 1e6));
+  if (nbus > 1)
+  {
+    printf("requests per bus:");
+    for (b = 0; b < nbus; ++b)
+      printf(" %.2f/s", sim_bus_stats[b].poll_requests / (sim_now_us() / 1e6));
+    printf("\n");
+  }
+  printf("discover sweep:   %.1f ms avg, %.1f ms max, %.1f ms first "
+         "(%" PRIu64 " sweeps)\n",
+         sim_stats.sweeps ?
+         sim_stats.sweep_sum_us / 1e3 / sim_stats.sweeps : 0,
+         sim_stats.sweep_max_us / 1e3, sim_stats.first_sweep_us / 1e3,
+         sim_stats.sweeps);
+  printf("poll lateness:    %.2f ms avg, %.2f ms max, %.2f ms jitter\n",
+         late_count ? late_sum / 1e3 / late_count : 0, late_max / 1e3,
+         late_count ? sqrt(late_sq_sum / late_count -
+                           (late_sum / 1e3 / late_count) *
+                           (late_sum / 1e3 / late_count)) : 0);
+  if (found_count)
+    printf("hot-plug found:   %.1f ms avg, %.1f ms max "
+           "(%" PRIu64 " devices)\n",
+           found_sum / 1e3 / found_count, found_max / 1e3, found_count);
+  if (ext)
+    printf("extended found:   %u of %u, %.1f s avg, %.1f s max "
+           "(%" PRIu64 " enumeration requests)\n", (unsigned)ext_found,
+           (unsigned)(ext * nbus), ext_found ? ext_sum / 1e6 / ext_found : 0,
+           ext_max / 1e6, sim_stats.enum_requests);
+  printf("sample skew:      %.2f ms avg, %.2f ms max, stamps within %.2f ms\n",
+         skew_count ? skew_sum / 1e3 / skew_count : 0, skew_max / 1e3,
+         stamp_err_max / 1e3);
+  printf("collisions:       %" PRIu64 "\n", sim_stats.collisions);
+  printf("discover rate:    %.2f requests/s\n",
+         sim_stats.discover_requests / (sim_now_us() / 1e6));
+  printf("timeouts:         %u, %.2f ms avg wait, %.2f %% of bus time\n",
+         (unsigned)timeout_stats.timeouts,
+         timeout_stats.timeouts ?
+           timeout_stats.wait_us / 1e3 / timeout_stats.timeouts : 0,
+         100.0 * timeout_stats.wait_us / sim_now_us() / nbus);
+  printf("bus speed:        %u slaves at %u baud, %u UART changes, "
+         "wire busy %.1f %%\n", (unsigned)fast_count, (unsigned)fast_baud,
+         (unsigned)sim_stats.baud_changes,
+         100.0 * sim_stats.bus_busy_us / sim_now_us() / nbus);
+  printf("master idle:      %.1f %%\n",
+         100.0 * sim_stats.idle_us / sim_now_us());
+  printf("max request gap:  %.2f ms\n", sim_stats.max_request_gap_us / 1e3);
+  printf("host tx buffer:   %u bytes max, %u lines dropped\n",
+         (unsigned)host_tx_high_water, (unsigned)host_tx_dropped);
+  for (b = 0, stack = 0; b < nbus; ++b)
+    if (hal_engine_stack_used(b) > stack)
+      stack = hal_engine_stack_used(b);
+  printf("engine stack:     %u bytes max (host build)\n", (unsigned)stack);
+  printf("bus bytes:        %" PRIu64 " out, %" PRIu64 " in, %.1f per value\n",
+         sim_stats.bus_bytes_out, sim_stats.bus_bytes_in,
+         poll_lines ? (double)(sim_stats.bus_bytes_out +
+                               sim_stats.bus_bytes_in) / poll_lines : 0);
+  printf("host lines:       %" PRIu64 " POLL, %" PRIu64 " ACTIVE, %" PRIu64
+         " INACTIVE, %" PRIu64 " other (%" PRIu64 " bytes)\n",
+         poll_lines, active_lines, inactive_lines, other_lines,
+         sim_stats.host_bytes_out);
+  if (proto)
+    printf("host frames:      %" PRIu64 " text, %" PRIu64 " binary, %"
+           PRIu64 " CRC errors, %" PRIu64 " missing, %.1f bytes per value\n",
+           text_frames, binary_frames, crc_errors, frame_gaps,
+           poll_lines ? (double)sim_stats.host_bytes_out / poll_lines : 0);
+
+  printf("ACTIVE strings:   %s (%" PRIu64 " checked, %" PRIu64 " errors)\n",
+         string_errors ? "FAIL" : "ok", strings_checked, string_errors);
+  if (!flood)
+  {
+    printf("POLL values:      %s (%" PRIu64 " checked, %" PRIu64 " errors)\n",
+           value_errors ? "FAIL" : "ok", values_checked, value_errors);
+    failed = value_errors || string_errors;
+  }
+  else
+  {
+    printf("POLL ordering:    %s (%" PRIu64 " lines, %" PRIu64 " errors)\n",
+           order_errors ? "FAIL" : "ok", poll_lines, order_errors);
+    printf("bus stalls:       %s\n",
+           late_max > STALL_LIMIT_US ? "FAIL" : "ok");
+    failed = order_errors || late_max > STALL_LIMIT_US || string_errors;
+  }
+  if (replay_client)
+  {
+    uint64_t missing = 0;
+
+    for (i = 0; i < next_seq && i < MAX_SEQ; ++i)
+      if (!seq_seen[i])
+        ++missing;
+    printf("replay:           %s (%" PRIu64 " lines missed, %" PRIu64
+           " requests, %" PRIu64 " values replayed, %" PRIu64 " lost, %"
+           PRIu64 " missing)\n", missing > replay_lost ? "FAIL" : "ok",
+           outage_lines, replay_requests, replay_lines, replay_lost, missing);
+    if (missing > replay_lost)
+      failed = 1;
+  }
+  if (sync_client)
+  {
+    int bad = sync_mismatches && !host_tx_dropped;
+
+    printf("sync:             %s (%" PRIu64 " checks, %" PRIu64
+           " mismatches)\n", bad ? "FAIL" : "ok", sync_checks,
+           sync_mismatches);
+    if (bad)
+      failed = 1;
+  }
+  if (proto)
+  {
+    int bad = crc_errors || frame_gaps > host_tx_dropped + outage_frames;
+
+    printf("host framing:     %s\n", bad ? "FAIL" : "ok");
+    if (bad)
+      failed = 1;
+  }
+
+  return failed;
+}
@@ -0,0 +1,233 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "bus_rx.h"
+
+
+#if BUS_RX_SIZE & (BUS_RX_SIZE - 1)
+#error BUS_RX_SIZE must be a power of two
+#endif
+#if BUS_RX_FRAMES & (BUS_RX_FRAMES - 1)
+#error BUS_RX_FRAMES must be a power of two
+#endif
+#if BUS_RX_MAX_FRAME > 255
+#error BUS_RX_MAX_FRAME larger than 255, frame length does not fit in uint8_t
+#endif
+
+/* Compiler barrier; a single-core Cortex-M4 needs nothing more. */
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+volatile uint32_t bus_rx_bytes[NUM_BUS];
+volatile uint32_t bus_rx_dropped[NUM_BUS];
+
+/*
+  The bytes of the frames go in ring, and a descriptor for each, with the
+  result of parsing it, in frames[]. Complete frames are those between tail
+  and head. The main loop uses the frames where they are, except one that
+  wraps around the end of ring, which it first copies to linear. The
+  indexes run freely and are masked on access.
+*/
+struct rx_bus {
+  uint8_t ring[BUS_RX_SIZE];
+  struct frame frames[BUS_RX_FRAMES];
+  /* Position in ring of each frame. */
+  uint32_t frame_pos[BUS_RX_FRAMES];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  /* Set by the main loop to make the interrupt handler drop a partial
+     frame. */
+  volatile uint32_t resync;
+
+  /* Private to the interrupt handler. */
+  /* End in ring of the last complete frame, and of the frame so far. */
+  uint32_t end;
+  uint32_t wr;
+  /* Bytes still to come of a binary frame. */
+  uint32_t bin_left;
+  struct frame_parser parser;
+  enum {
+    RX_IDLE, RX_FRAME, RX_BIN_LEN, RX_BIN, RX_DISCARD
+  } state;
+
+  /* Private to the main loop: the frame at tail was handed out. */
+  uint32_t taken;
+  uint8_t linear[BUS_RX_MAX_FRAME];
+};
+
+static struct rx_bus rx_buses[NUM_BUS];
+
+
+/*
+  Put a byte of the frame in the ring; returns 0, and drops the frame, if it
+  does not fit.
+*/
+static uint32_t
+rx_put(struct rx_bus *rx, uint32_t bus, uint32_t c)
+{
+  uint32_t head = rx->head;
+  uint32_t tail = rx->tail;
+  uint32_t start = rx->frame_pos[head & (BUS_RX_FRAMES-1)];
+  /* The oldest frame not yet released by the main loop, if any. */
+  uint32_t oldest = tail == head ? start :
+    rx->frame_pos[tail & (BUS_RX_FRAMES-1)];
+
+  if (rx->wr - start >= BUS_RX_MAX_FRAME || rx->wr - oldest >= BUS_RX_SIZE)
+  {
+    ++bus_rx_dropped[bus];
+    rx->state = RX_DISCARD;
+    return 0;
+  }
+  rx->ring[rx->wr++ & (BUS_RX_SIZE-1)] = c;
+  return 1;
+}
+
+
+/* Store and parse a byte of the frame; returns 0 if it does not fit. */
+static uint32_t
+rx_store(struct rx_bus *rx, uint32_t bus, uint32_t c)
+{
+  if (!rx_put(rx, bus, c))
+    return 0;
+  frame_parse_byte(&rx->parser, c);
+  return 1;
+}
+
+
+/* Begin a new frame, overwriting any partial one. */
+static void
+rx_start(struct rx_bus *rx, uint32_t bus, uint32_t c)
+{
+  uint32_t slot = rx->head & (BUS_RX_FRAMES-1);
+
+  if (rx->head - rx->tail >= BUS_RX_FRAMES)
+  {
+    ++bus_rx_dropped[bus];
+    rx->state = RX_DISCARD;
+    return;
+  }
+  rx->frame_pos[slot] = rx->wr = rx->end;
+  frame_parse_start(&rx->parser, &rx->frames[slot],
+                    &rx->ring[rx->end & (BUS_RX_SIZE-1)], c);
+  rx_put(rx, bus, c);
+}
+
+
+/* Publish the frame to the main loop. */
+static void
+rx_done(struct rx_bus *rx)
+{
+  frame_parse_end(&rx->parser);
+  rx->end = rx->wr;
+  barrier();
+  ++rx->head;
+  rx->state = RX_IDLE;
+}
+
+
+void
+bus_rx_byte(uint32_t bus, uint32_t c)
+{
+  struct rx_bus *rx = &rx_buses[bus];
+
+  ++bus_rx_bytes[bus];
+  if (rx->resync)
+  {
+    rx->resync = 0;
+    rx->state = RX_IDLE;
+  }
+
+  switch (rx->state)
+  {
+  case RX_IDLE:
+  case RX_DISCARD:
+    /* Wait for start-of-frame, or the end of a frame too long to keep. */
+    if (c == '!')
+    {
+      rx->state = RX_FRAME;
+      rx_start(rx, bus, c);
+    }
+    else if (c == BUS_RX_BINARY && rx->state == RX_IDLE)
+    {
+      rx->state = RX_BIN_LEN;
+      rx_start(rx, bus, c);
+    }
+    else if (c == '\n')
+      rx->state = RX_IDLE;
+    return;
+
+  case RX_FRAME:
+    /*
+      A '!' is never part of a frame, so it means the previous frame was
+      cut short, say by two slaves answering at once. Start over.
+    */
+    if (c == '!')
+      rx_start(rx, bus, c);
+    else if (c == '\n')
+      rx_done(rx);
+    else if (c != '\r' && c != '\0')
+      rx_store(rx, bus, c);
+    return;
+
+  case RX_BIN_LEN:
+    /* Start byte, length, and CRC, besides the c bytes counted. */
+    if (c + 4 > BUS_RX_MAX_FRAME)
+    {
+      ++bus_rx_dropped[bus];
+      rx->state = RX_IDLE;
+      return;
+    }
+    rx->bin_left = c + 2;
+    rx->state = RX_BIN;
+    rx_store(rx, bus, c);
+    return;
+
+  case RX_BIN:
+    if (rx_store(rx, bus, c) && !--rx->bin_left)
+      rx_done(rx);
+    return;
+  }
+}
+
+
+const struct frame *
+bus_rx_get_frame(uint32_t bus)
+{
+  struct rx_bus *rx = &rx_buses[bus];
+  uint32_t tail = rx->tail;
+  uint32_t pos, first;
+  struct frame *f;
+
+  /* Done with the frame handed out last time. */
+  if (rx->taken)
+  {
+    barrier();
+    rx->tail = ++tail;
+    rx->taken = 0;
+  }
+  if (tail == rx->head)
+    return NULL;
+  barrier();
+  rx->taken = 1;
+  f = &rx->frames[tail & (BUS_RX_FRAMES-1)];
+  pos = rx->frame_pos[tail & (BUS_RX_FRAMES-1)] & (BUS_RX_SIZE-1);
+  if (pos + f->len > BUS_RX_SIZE)
+  {
+    first = BUS_RX_SIZE - pos;
+    memcpy(rx->linear, &rx->ring[pos], first);
+    memcpy(rx->linear + first, rx->ring, f->len - first);
+    f->data = rx->linear;
+  }
+  return f;
+}
+
+
+void
+bus_rx_flush(uint32_t bus)
+{
+  struct rx_bus *rx = &rx_buses[bus];
+
+  rx->resync = 1;
+  rx->tail = rx->head;
+  rx->taken = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef BUS_RX_H
+#define BUS_RX_H
+
+#include <inttypes.h>
+
+#include "frame.h"
+#include "hal.h"
+
+/*
+  Interrupt-driven receive path for the RS485 buses.
+
+  The receive interrupt of the UART of each bus passes every byte to
+  bus_rx_byte(), which frames '!' ... '\n' responses, and binary responses
+  (BUS_RX_BINARY, a length byte, that many bytes, and two bytes of CRC),
+  into a single-producer/single-consumer ring buffer. It also parses each
+  frame as the bytes arrive (see frame.h), checking its syntax and CRC, so
+  the main loop does not have to go over the frame again. The main loop
+  picks up complete frames with bus_rx_get_frame(), and uses them in place.
+  Only the interrupt handler writes rx_head and only the main loop writes
+  rx_tail, so no locking is needed. Each bus has its own ring buffer.
+*/
+
+/* Ring buffer size, per bus, must be a power of two. */
+#define BUS_RX_SIZE 512
+/* Frames that can be waiting, must be a power of two. */
+#define BUS_RX_FRAMES 8
+/* Longer frames than this are discarded by the interrupt handler. */
+#define BUS_RX_MAX_FRAME 200
+/* First byte of a binary frame; never sent in the ASCII protocol. */
+#define BUS_RX_BINARY 0xfd
+
+/* Count of bytes received, for timeout handling in the main loop. */
+extern volatile uint32_t bus_rx_bytes[NUM_BUS];
+/* Count of frames dropped due to overrun or excessive length. */
+extern volatile uint32_t bus_rx_dropped[NUM_BUS];
+
+/* Called from the UART receive interrupt of bus (producer side). */
+extern void bus_rx_byte(uint32_t bus, uint32_t c);
+
+/*
+  Get the next complete frame from bus, parsed, or NULL if none is
+  available. The frame and its data stay in the ring buffer until the next
+  call for the bus, or bus_rx_flush(); nothing is copied.
+*/
+extern const struct frame *bus_rx_get_frame(uint32_t bus);
+/* Discard all received data, including any partially received frame. */
+extern void bus_rx_flush(uint32_t bus);
+
+#endif  /* BUS_RX_H */
@@ -1,21 +1,147 @@
 #! /usr/bin/perl
 
+# Client of the master: reads what it reports on the serial port, and
+# writes it into the database.
+#
+# Two processes do the work, so that a slow query or commit never keeps
+# the serial port from being read, which would back up the output of the
+# master until it drops lines. This one, the reader, handles the protocol
+# with the master, and queues what is to be written; a child process, the
+# writer, takes it from the queue, through a pipe, and writes it with
+# Ingest.pm. The queue holds at most MAX_QUEUE records not yet written to
+# the pipe, which itself buffers some more (64 KB on Linux, a thousand
+# records or so); should the writer fall that far behind, new values are
+# dropped, and counted, rather than stalling the reader. Changes of the
+# devices are always queued.
+#
+# Both print some figures every -m seconds: the reader the records
+# waiting in the queue, the writer the time the records it takes waited
+# (the ingest lag). On SIGINT, SIGTERM, or the end of the serial input,
+# the reader stops reading and hands the writer the rest of the queue,
+# which it writes before it exits.
+#
+#   ./client.pl -s /dev/serial/labibus -d DBI:Pg:dbname=powermeter
+
 use strict;
 use warnings;
 
 use DBI;
-use Time::HiRes;
+use FindBin;
+use Getopt::Std;
+use IO::Handle;
+use IO::Select;
+
+use lib $FindBin::Bin;
+use Ingest;
+
+use constant MAX_QUEUE => 100000;
 
 
-my @devices_active;
+my %opt;
+getopts('s:d:u:m:', \%opt) or die <<USAGE;
+Usage: $0 [options]
+  -s DEV   serial port of the master (default /dev/serial/labibus)
+  -d DSN   data source (default DBI:Pg:dbname=powermeter)
+  -u USER  database user (default powermeter with the default data source)
+  -m SEC   seconds between figures of the queue (default 60)
+USAGE
+my $serial = $opt{s} // "/dev/serial/labibus";
+my $dsn = $opt{d} // "DBI:Pg:dbname=powermeter";
+my $user = $opt{u} // ($opt{d} ? undef : "powermeter");
+my $metrics_ms = ($opt{m} // 60) * 1000;
 
+my %devices_active;
 
-my $dbh = DBI->connect("DBI:Pg:dbname=powermeter", "powermeter", undef,
-                       {RaiseError=>1, AutoCommit=>1});
+$| = 1;
 
 sub getstamp {
-  my $sec_float = Time::HiRes::time();
-  return int(0.5 + $sec_float*1000);
+  return Ingest::getstamp();
+}
+
+
+# Escape tabs and newlines for the queue, as the master does (unquote).
+sub quote {
+  my ($x) = @_;
+  $x =~ s/([\\\t\n])/sprintf("\\%02x", ord($1))/ge;
+  return $x;
+}
+
+
+# The writer: take records off the queue, until it is closed, and write
+# them into the database. Each is a line of fields separated by tabs, the
+# first the kind of record and the second the time it was queued.
+sub writer {
+  my ($queue) = @_;
+  my $dbh = DBI->connect($dsn, $user, undef,
+                         {RaiseError => 1, AutoCommit => 1});
+  # Writes to the database are batched, see Ingest.pm.
+  my $ingest = Ingest->new($dbh);
+  my $sel = IO::Select->new($queue);
+  my $buf = '';
+  my ($records, $lag_sum, $lag_max) = (0, 0, 0);
+  my $next_metrics = getstamp() + $metrics_ms;
+
+  # The reader tells us when to stop, by closing the queue.
+  $SIG{INT} = $SIG{TERM} = 'IGNORE';
+  $dbh->sqlite_busy_timeout(60000) if $dbh->{Driver}{Name} eq 'SQLite';
+  for (;;) {
+    my $timeout = $ingest->flush_timeout();
+    $timeout = $next_metrics - getstamp()
+        if !defined($timeout) || $timeout > $next_metrics - getstamp();
+    if ($sel->can_read($timeout > 0 ? $timeout / 1000 : 0)) {
+      last if !sysread($queue, $buf, 65536, length($buf));
+      while ($buf =~ s/^([^\n]*)\n//) {
+        my ($kind, $queued, @f) = split(/\t/, $1, -1);
+        my $lag = getstamp() - $queued;
+        ++$records;
+        $lag_sum += $lag;
+        $lag_max = $lag if $lag > $lag_max;
+        if ($kind eq 'V') {
+          $ingest->device_value(@f);
+        } elsif ($kind eq 'A') {
+          $ingest->device_active($f[0], $f[1], unquote($f[2]), unquote($f[3]),
+                                 $f[4]);
+        } elsif ($kind eq 'I') {
+          $ingest->device_inactive(@f);
+        }
+      }
+    }
+    $ingest->flush() if defined($ingest->flush_timeout()) &&
+        $ingest->flush_timeout() == 0;
+    if (getstamp() >= $next_metrics) {
+      printf("Writer: %d records, lag %.0f ms average, %d ms most, " .
+             "%d rows in %d commits.\n", $records,
+             $records ? $lag_sum / $records : 0, $lag_max,
+             $ingest->{rows}, $ingest->{commits});
+      ($records, $lag_sum, $lag_max) = (0, 0, 0);
+      $next_metrics = getstamp() + $metrics_ms;
+    }
+  }
+  $ingest->flush();
+  print "Writer: done, $ingest->{rows} rows in $ingest->{commits} commits.\n";
+}
+
+
+# Records waiting for the writer: whole lines, and the part of the oldest
+# not yet written to the pipe, with the number of records in that part.
+my @queue;
+my $queue_out = '';
+my $queue_out_records = 0;
+my ($queue_max, $queue_dropped) = (0, 0);
+
+sub queue_depth {
+  return @queue + $queue_out_records;
+}
+
+sub queue_record {
+  my ($kind, @fields) = @_;
+
+  if ($kind eq 'V' && queue_depth() >= MAX_QUEUE) {
+    ++$queue_dropped;
+    return;
+  }
+  push @queue, join("\t", $kind, getstamp(), @fields) . "\n";
+  $queue_max = queue_depth() if queue_depth() > $queue_max;
 }
 
 
@@ -26,79 +152,353 @@ sub unquote {
 }
 
 
+# Device ids from the master carry the bus number in the upper 16 bits;
+# name them "bus:id", or just "id" on bus 0.
+sub device_name {
+  my ($dev) = @_;
+  my ($bus, $id) = ($dev >> 16, $dev & 0xffff);
+  return $bus ? "$bus:$id" : "$id";
+}
+
+
 sub device_active {
   my ($dev, $poll_interval, $description, $unit) = @_;
-
-  my $res = $dbh->selectall_arrayref(<<SQL, undef, $dev);
-SELECT active, description, unit, poll_interval
-  FROM device_status
- WHERE id = ?
-SQL
-  # Insert a row if new status differs from existing.
-  if (!scalar(@$res) ||
-      !$res->[0][0] ||
-      $res->[0][1] ne $description ||
-      $res->[0][2] ne $unit ||
-      $res->[0][3] != $poll_interval) {
-    $dbh->do(<<SQL, undef, $dev, getstamp(), $description, $unit, $poll_interval);
-INSERT INTO device_history VALUES (?, ?, TRUE, ?, ?, ?)
-SQL
-  }
+  queue_record('A', $dev, $poll_interval, quote($description), quote($unit),
+               getstamp());
 }
 
 
 sub device_inactive {
   my ($dev) = @_;
+  queue_record('I', $dev, getstamp());
+}
+
 
-  my $res = $dbh->selectall_arrayref(<<SQL, undef, $dev);
-SELECT active, description, unit, poll_interval
-  FROM device_status
- WHERE id = ?
-SQL
-  # Insert an inactive row only if the device is currently listed active.
-  if (scalar(@$res) && $res->[0][0]) {
-    $dbh->do(<<SQL, undef, $dev, getstamp());
-INSERT INTO device_history VALUES (?, ?, FALSE, NULL, NULL, NULL)
-SQL
+# Offset from master time stamps to our clock, in milliseconds.
+my ($stamp_offset, $window_min, $window_start);
+
+# Map a time stamp from the master (milliseconds since it started) to our
+# clock. A line reaches us some time after the value was sampled, so the
+# smallest offset seen is the most accurate. It is taken over windows of a
+# minute, to follow any drift between the clocks. An offset much larger
+# than before means the master restarted.
+sub master_stamp {
+  my ($stamp) = @_;
+  my $now = getstamp();
+  my $offset = $now - $stamp;
+
+  if (!defined($stamp_offset) || $offset > $stamp_offset + 2000) {
+    $stamp_offset = $window_min = $offset;
+    $window_start = $now;
+  } else {
+    $window_min = $offset if $offset < $window_min;
+    $stamp_offset = $window_min if $window_min < $stamp_offset;
+    if ($now - $window_start >= 60000) {
+      $stamp_offset = $window_min;
+      $window_min = $offset;
+      $window_start = $now;
+    }
   }
+  return $stamp + $stamp_offset;
 }
 
 
 sub
 device_value {
-  my ($dev, $val) = @_;
-  $dbh->do(<<SQL, undef, $dev, getstamp(), $val);
-INSERT INTO device_log VALUES (?, ?, ?)
-SQL
+  my ($dev, $val, $stamp) = @_;
+  $stamp = defined($stamp) ? master_stamp($stamp) : getstamp();
+  queue_record('V', $dev, $stamp, $val);
 }
 
 
-open M, '+<', '/dev/serial/labibus'
-    or die "Failed to open master device: $!\n";
+# Sequence number of the next POLL line, and the values missed, which we
+# asked the master to replay.
+my $next_seq;
+my %missing;
+
+# A POLL line with sequence number $seq: whether to store its value. New
+# values are, and replayed ones we missed, once. On a gap, ask for a replay
+# from the oldest value still missing.
+sub poll_seq {
+  my ($seq) = @_;
+
+  return 1 if !defined($seq);
+  return defined(delete $missing{$seq})
+      if defined($next_seq) && $seq < $next_seq;
+  if (defined($next_seq) && $seq > $next_seq) {
+    print "Missed values $next_seq .. ", $seq - 1, ", asking for replay.\n";
+    $missing{$_} = 1 for ($next_seq .. $seq - 1);
+    my ($oldest) = sort { $a <=> $b } keys %missing;
+    print M "REPLAY $oldest\n";
+  }
+  $next_seq = $seq + 1;
+  return 1;
+}
+
+
+# CRC-16 of the bus protocol (polynomial 0xA001, initial value 0), which
+# the master also puts on its frames to us.
+sub crc16 {
+  my ($data) = @_;
+  my $crc = 0;
+
+  for my $c (unpack('C*', $data)) {
+    $crc ^= $c;
+    for (1 .. 8) {
+      $crc = ($crc & 1) ? ($crc >> 1) ^ 0xa001 : $crc >> 1;
+    }
+  }
+  return $crc;
+}
+
+
+sub poll_value {
+  my ($dev, $val, $stamp, $seq) = @_;
+
+  if (poll_seq($seq)) {
+    print "Device ", device_name($dev), ": value $val\n";
+    device_value($dev, $val, $stamp);
+  }
+}
 
-# Sending stuff to the master forces a full status report.
-print M "hitme!\n";
-
-while (<M>) {
-  if (/^INACTIVE ([0-9]+)$/) {
-    my $dev = $1;
-    print "Device $dev no longer active.\n"
-        if $devices_active[$dev];
-    undef $devices_active[$dev];
-    device_inactive($dev);
-  } elsif (/^ACTIVE ([0-9]+)\|([0-9]+)\|([^|]*)\|([^|]*)$/) {
-    my ($dev, $interval, $desc, $unit) = ($1, $2, unquote($3), unquote($4));
-    chomp($unit);
-    print "Device $dev active: $interval '$desc' '$unit'.\n"
-        if !$devices_active[$dev];
-    $devices_active[$dev] = 1;
+
+# Our copy of the device table, for the checksum in the SYNC lines from
+# the master: the CRC of the state reported for each active device. The
+# generation of the table we are at, and while a full report is under way,
+# the devices reported so far.
+my %device_crc;
+my $sync_gen;
+my %sync_seen = ();
+my $full_sync = 1;
+
+sub set_inactive {
+  my ($dev) = @_;
+
+  print "Device ", device_name($dev), " no longer active.\n"
+      if $devices_active{$dev};
+  delete $devices_active{$dev};
+  delete $device_crc{$dev};
+  device_inactive($dev);
+}
+
+# "SYNC <gen> <active> <checksum>": check our copy of the device table,
+# and ask for a full report if it differs.
+sub sync_check {
+  my ($gen, $active, $sum) = @_;
+
+  if ($full_sync) {
+    # Devices not in a full report are gone.
+    set_inactive($_) for (grep { !$sync_seen{$_} } keys %device_crc);
+    $full_sync = 0;
+  }
+  %sync_seen = ();
+  my $mysum = 0;
+  $mysum = ($mysum + $_) % 2**32 for (values %device_crc);
+  if ($active != keys(%device_crc) || $sum != $mysum) {
+    print "Device table out of sync, asking for a full report.\n";
+    $full_sync = 1;
+    print M "SYNC\n";
+  }
+  $sync_gen = $gen;
+}
+
+
+sub handle_line {
+  my ($line) = @_;
+
+  if ($line =~ /^INACTIVE ([0-9]+)$/) {
+    $sync_seen{$1} = 1;
+    set_inactive($1);
+  } elsif ($line =~ /^ACTIVE (([0-9]+)\|([0-9]+)\|([^|]*)\|([^|]*))$/) {
+    my ($dev, $interval, $desc, $unit) = ($2, $3, unquote($4), unquote($5));
+    print "Device ", device_name($dev), " active: $interval '$desc' '$unit'.\n"
+        if !$devices_active{$dev};
+    $devices_active{$dev} = 1;
+    $device_crc{$dev} = crc16($1);
+    $sync_seen{$dev} = 1;
     device_active($dev, $interval, $desc, $unit);
-  } elsif (/^POLL ([0-9]+) (.*)$/) {
-    my ($dev, $val) = ($1, $2);
-    print "Device $dev: value $val\n";
-    device_value($dev, $val);
+  } elsif ($line =~ /^SYNC ([0-9]+) ([0-9]+) ([0-9]+)$/) {
+    sync_check($1, $2, $3);
+  } elsif ($line =~ /^POLL ([0-9]+) (\S+)(?: ([0-9]+))?(?: ([0-9]+))?$/) {
+    poll_value($1, $2, $3, $4);
+  } elsif ($line =~ /^REPLAY ([0-9]+) ([0-9]+)$/) {
+    # Values before the first one replayed are no longer in the log.
+    my @lost = grep { $_ < $1 } keys %missing;
+    print "Lost ", scalar(@lost), " values.\n" if @lost;
+    delete @missing{@lost};
+  } elsif ($line =~ /^Master initialised/) {
+    # Sequence numbers start over, and the master is back in text mode. It
+    # sends a full report of its devices by itself.
+    undef $next_seq;
+    %missing = ();
+    $full_sync = 1;
+    %sync_seen = ();
+    print "Master said: $line\n";
+    print M "MODE binary\n";
   }
   else {
-    print "Master said: $_";
+    print "Master said: $line\n";
+  }
+}
+
+
+# A batch of POLL values (see master.c): the sequence number and time stamp
+# of the first one, then a sample log record for each (see sample_log.h).
+sub poll_batch {
+  my ($payload) = @_;
+  my @digits = split(//, "0123456789.-+eE");
+  my ($seq, $lo, $hi) = unpack('V V V', $payload);
+  my $first = $hi * 2**32 + $lo;
+  my $pos = 12;
+
+  while ($pos < length($payload)) {
+    my ($len, $id_lo, $id_hi, $low) =
+      unpack('C v C V', substr($payload, $pos));
+    my $n = $len & 0x7f;
+    last if $n < 8;
+    my $text = substr($payload, $pos + 8, $n - 8);
+    if (!($len & 0x80)) {
+      $text = join('', map { $digits[$_ & 15] . (($_ >> 4) != 15 ?
+                                                 $digits[$_ >> 4] : '') }
+                   unpack('C*', $text));
+    }
+    # The full time stamp closest to that of the first value.
+    my $diff = ($low - $lo) % 2**32;
+    $diff -= 2**32 if $diff >= 2**31;
+    poll_value($id_hi << 16 | $id_lo, $text, $first + $diff, $seq++);
+    $pos += $n;
+  }
+}
+
+
+# Frame sequence number expected next.
+my $next_frame;
+
+sub frame_seq {
+  my ($seq) = @_;
+
+  print "Missed ", ($seq - $next_frame) % 65536, " frames from the master.\n"
+      if defined($next_frame) && $seq != $next_frame;
+  $next_frame = ($seq + 1) % 65536;
+}
+
+
+# Take the next frame, binary or text, off the front of $$buf, and handle
+# it. Returns 0 if it is not all there yet.
+sub take_frame {
+  my ($buf) = @_;
+
+  if ($$buf =~ /^\xfe/) {
+    return 0 if length($$buf) < 2;
+    my $len = ord(substr($$buf, 1, 1)) + 4;
+    return 0 if length($$buf) < $len;
+    my $frame = substr($$buf, 0, $len, '');
+    my ($seq, $type) = unpack('x2 v C', $frame);
+    my $payload = substr($frame, 5, $len - 7);
+    if (unpack('v', substr($frame, -2)) != crc16(substr($frame, 0, -2))) {
+      print "CRC error in binary frame from the master.\n";
+    } else {
+      frame_seq($seq);
+      poll_batch($payload) if $type == ord('P');
+    }
+    return 1;
+  }
+
+  return 0 if $$buf !~ s/^([^\n]*)\n//;
+  my $line = $1;
+  $line =~ s/\r$//;
+  if ($line =~ /^(\$([0-9]+):(.*)\|)([0-9a-f]{4})$/) {
+    if (hex($4) != crc16($1)) {
+      print "CRC error in line from the master: $line\n";
+    } else {
+      frame_seq($2);
+      handle_line($3);
+    }
+  } else {
+    # Not framed: the master has not switched modes yet, or has restarted.
+    undef $next_frame;
+    handle_line($line);
+  }
+  return 1;
+}
+
+
+# Write as much of the queue to the writer as the pipe takes. Returns
+# false if the writer is gone.
+sub send_queue {
+  my ($pipe) = @_;
+
+  while ($queue_out ne '' || @queue) {
+    if ($queue_out eq '') {
+      my @out = splice(@queue, 0, 1000);
+      $queue_out = join('', @out);
+      $queue_out_records = @out;
+    }
+    my $n = syswrite($pipe, $queue_out);
+    if (!defined($n)) {
+      return 1 if $!{EAGAIN};
+      return 0;
+    }
+    $queue_out_records -= (substr($queue_out, 0, $n, '') =~ tr/\n//);
   }
+  return 1;
 }
+
+
+# Start the writer before opening the master, so it does not hold the
+# serial port open.
+pipe(my $queue_in, my $queue) or die "Failed to make queue: $!\n";
+my $writer = fork();
+die "Failed to start writer: $!\n" if !defined($writer);
+if (!$writer) {
+  close($queue);
+  writer($queue_in);
+  exit(0);
+}
+close($queue_in);
+$queue->blocking(0);
+$SIG{PIPE} = 'IGNORE';
+my $stop = 0;
+$SIG{INT} = $SIG{TERM} = sub { $stop = 1; };
+
+open M, '+<', $serial
+    or die "Failed to open master device: $!\n";
+binmode M;
+M->autoflush(1);
+
+# Ask for values in binary batches, framed and checked, and for a full
+# report of the devices; after that, the master sends just the changes,
+# and a checksum of its device table now and then.
+print M "MODE binary\n";
+print M "SYNC\n";
+
+# Wait for input, or for room in the pipe to the writer; and now and then,
+# say how the queue is doing.
+my $read_sel = IO::Select->new(\*M);
+my $write_sel = IO::Select->new($queue);
+my $buf = '';
+my $next_metrics = getstamp() + $metrics_ms;
+while (!$stop) {
+  my $timeout = $next_metrics - getstamp();
+  my ($r, $w) = IO::Select->select($read_sel,
+                                   queue_depth() ? $write_sel : undef, undef,
+                                   $timeout > 0 ? $timeout / 1000 : 0);
+  if ($r && @$r) {
+    last if !sysread(M, $buf, 4096, length($buf));
+    1 while take_frame(\$buf);
+  }
+  die "Database writer died.\n" if $w && @$w && !send_queue($queue);
+  if (getstamp() >= $next_metrics) {
+    print "Queue: ", queue_depth(), " records, $queue_max most, ",
+        "$queue_dropped values dropped.\n";
+    ($queue_max, $queue_dropped) = (queue_depth(), 0);
+    $next_metrics = getstamp() + $metrics_ms;
+  }
+}
+
+# Hand the writer the rest, and wait for it to write it.
+print "Stopping, ", queue_depth(), " records left for the writer.\n";
+$queue->blocking(1);
+send_queue($queue) or print "Database writer died.\n";
+close($queue);
+waitpid($writer, 0);
@@ -0,0 +1,68 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <inttypes.h>
+
+/*
+  CRC-16 (polynomial 0xA001, reflected, initial value 0) of the bus
+  protocol.
+
+  crc16() adds a single byte, cheap enough for the UART receive interrupt
+  to keep a running CRC of a frame as it arrives. crc16_update() adds a
+  buffer, processing CRC16_SLICE bytes per step with that many tables
+  (slice-by-N): 1 is the classic byte-at-a-time loop with the 512 byte
+  table, 4 and 8 take 2 and 4 KB more of tables but far fewer dependent
+  steps. All variants are built so bench_crc can check them against each
+  other and time them; the linker drops the ones not used.
+
+  The tables are const, so they stay in flash. With CRC16_TABLES_IN_RAM
+  defined, the extra slice tables are copied to SRAM at startup instead,
+  avoiding flash wait states at high clock speeds.
+*/
+
+#ifndef CRC16_SLICE
+#define CRC16_SLICE 4
+#endif
+
+#ifdef CRC16_TABLES_IN_RAM
+#define CRC16_TABLE
+#else
+#define CRC16_TABLE const
+#endif
+
+extern const uint16_t crc16_tab[256];
+
+
+static inline uint32_t
+crc16(uint32_t byte, uint32_t crc_val)
+{
+  return crc16_tab[(crc_val ^ byte) & 0xff] ^ (crc_val >> 8);
+}
+
+
+extern uint32_t crc16_update_1(const uint8_t *buf, uint32_t len,
+                               uint32_t crc_val);
+extern uint32_t crc16_update_4(const uint8_t *buf, uint32_t len,
+                               uint32_t crc_val);
+extern uint32_t crc16_update_8(const uint8_t *buf, uint32_t len,
+                               uint32_t crc_val);
+
+#if CRC16_SLICE == 1
+#define crc16_update crc16_update_1
+#elif CRC16_SLICE == 4
+#define crc16_update crc16_update_4
+#elif CRC16_SLICE == 8
+#define crc16_update crc16_update_8
+#else
+#error CRC16_SLICE must be 1, 4 or 8
+#endif
+
+
+/* CRC-16 of len bytes at buf. */
+static inline uint32_t
+crc16_buf(const uint8_t *buf, uint32_t len)
+{
+  return crc16_update(buf, len, 0);
+}
+
+#endif  /* CRC16_H */
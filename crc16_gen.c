@@ -0,0 +1,47 @@
+/*
+  Generate the slice-by-N tables for crc16.c, run on the build host:
+
+    ./crc16_gen > crc16_tables.h
+
+  Table k holds the CRC of a byte followed by k zero bytes; table 0 is
+  crc16_tab itself, which is computed here too and checked against the
+  one in crc16.c by bench_crc.
+*/
+
+#include <inttypes.h>
+#include <stdio.h>
+
+
+#define NUM_TABLES 8
+
+static uint32_t tab[NUM_TABLES][256];
+
+
+int
+main(void)
+{
+  uint32_t i, j, k, crc;
+
+  for (i = 0; i < 256; ++i)
+  {
+    crc = i;
+    for (j = 0; j < 8; ++j)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    tab[0][i] = crc;
+  }
+  for (k = 1; k < NUM_TABLES; ++k)
+    for (i = 0; i < 256; ++i)
+      tab[k][i] = (tab[k-1][i] >> 8) ^ tab[0][tab[k-1][i] & 0xff];
+
+  printf("/* Generated by crc16_gen.c, do not edit. */\n");
+  for (k = 1; k < NUM_TABLES; ++k)
+  {
+    printf("\nstatic CRC16_TABLE uint16_t crc16_tab%u[256] = {\n",
+           (unsigned)k);
+    for (i = 0; i < 256; ++i)
+      printf("%s0x%04x%s", i % 8 ? " " : "  ", (unsigned)tab[k][i],
+             i == 255 ? "\n" : (i % 8 == 7 ? ",\n" : ","));
+    printf("};\n");
+  }
+  return 0;
+}
@@ -0,0 +1,229 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "fmt.h"
+
+
+/* Significant digits of fmt_float(), the precision of "%.7g". */
+#define FLOAT_DIGITS 7
+
+/*
+  Powers of ten that are exact in a double, for scaling a float to
+  FLOAT_DIGITS integer digits with at most two rounding steps.
+*/
+static const double pow10_tab[23] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+char *
+fmt_str(char *p, const char *s)
+{
+  while ((*p = *s++))
+    ++p;
+  return p;
+}
+
+
+char *
+fmt_mem(char *p, const char *s, uint32_t len)
+{
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p + len;
+}
+
+
+char *
+fmt_uint32(char *p, uint32_t val)
+{
+  uint32_t l, d;
+
+  l = 1000000000UL;
+  while (l > val && l > 1)
+    l /= 10;
+
+  do
+  {
+    d = val / l;
+    *p++ = '0' + d;
+    val -= d*l;
+    l /= 10;
+  } while (l > 0);
+
+  *p = '\0';
+  return p;
+}
+
+
+/* Exactly n digits of val, with leading zeros. */
+static char *
+fmt_digits(char *p, uint32_t val, uint32_t n)
+{
+  char *q = p + n;
+
+  *q = '\0';
+  while (q > p)
+  {
+    *--q = '0' + val % 10;
+    val /= 10;
+  }
+  return p + n;
+}
+
+
+char *
+fmt_uint64(char *p, uint64_t val)
+{
+  /* Split in 9-digit parts, so most of the work is 32-bit. */
+  if (val <= 0xffffffffUL)
+    return fmt_uint32(p, (uint32_t)val);
+  p = fmt_uint64(p, val / 1000000000UL);
+  return fmt_digits(p, (uint32_t)(val % 1000000000UL), 9);
+}
+
+
+char *
+fmt_int32(char *p, int32_t val)
+{
+  if (val >= 0)
+    return fmt_uint32(p, (uint32_t)val);
+  *p++ = '-';
+  return fmt_uint32(p, -(uint32_t)val);
+}
+
+
+char *
+fmt_hex8(char *p, uint32_t val)
+{
+  static const char hexdig[] = "0123456789abcdef";
+
+  p[0] = hexdig[(val >> 4) & 0xf];
+  p[1] = hexdig[val & 0xf];
+  p[2] = '\0';
+  return p + 2;
+}
+
+
+/* v * 10^k, with k in -45 .. 52, the range a float needs. */
+static double
+scale10(double v, int32_t k)
+{
+  while (k > 22)
+  {
+    v *= pow10_tab[22];
+    k -= 22;
+  }
+  while (k < -22)
+  {
+    v /= pow10_tab[22];
+    k += 22;
+  }
+  return k >= 0 ? v * pow10_tab[k] : v / pow10_tab[-k];
+}
+
+
+/*
+  Like printf "%.7g": the value is rounded to 7 significant digits, half to
+  even on the exact value like glibc, and printed as fixed point if its
+  decimal exponent is -4 .. 6, else as d.dddddde+XX; trailing zeros of the
+  fraction are dropped.
+
+  The scaling is done in double, where a float times a power of ten up to
+  1e22 is within one rounding of the exact product, far closer than the
+  nearest float is to a halfway case; the exact halfway cases (like
+  1234567.5) come out exact.
+*/
+char *
+fmt_float(char *p, float val)
+{
+  uint32_t bits, n, nd, i;
+  int32_t e10;
+  double v, s, frac;
+  char d[FLOAT_DIGITS];
+
+  memcpy(&bits, &val, sizeof(bits));
+  if (bits >> 31)
+    *p++ = '-';
+  bits &= 0x7fffffff;
+  if (bits > 0x7f800000)
+    return fmt_str(p, "nan");
+  if (bits == 0x7f800000)
+    return fmt_str(p, "inf");
+  if (bits == 0)
+    return fmt_str(p, "0");
+
+  /*
+    Estimate the decimal exponent from the binary one (log10(2) is about
+    77/256), then correct it so that s holds exactly FLOAT_DIGITS integer
+    digits. Denormals start too high and take a few more steps.
+  */
+  v = val < 0 ? -(double)val : (double)val;
+  e10 = (((int32_t)(bits >> 23) - 127) * 77) >> 8;
+  for (;;)
+  {
+    s = scale10(v, FLOAT_DIGITS - 1 - e10);
+    if (s >= pow10_tab[FLOAT_DIGITS])
+      ++e10;
+    else if (s < pow10_tab[FLOAT_DIGITS - 1])
+      --e10;
+    else
+      break;
+  }
+
+  n = (uint32_t)s;
+  frac = s - n;
+  if (frac > 0.5 || (frac == 0.5 && (n & 1)))
+    ++n;
+  if (n >= 10000000UL)
+  {
+    n /= 10;
+    ++e10;
+  }
+
+  for (i = FLOAT_DIGITS; i > 0; --i)
+  {
+    d[i - 1] = '0' + n % 10;
+    n /= 10;
+  }
+  nd = FLOAT_DIGITS;
+  while (nd > 1 && d[nd - 1] == '0')
+    --nd;
+
+  if (e10 < -4 || e10 >= FLOAT_DIGITS)
+  {
+    *p++ = d[0];
+    if (nd > 1)
+    {
+      *p++ = '.';
+      for (i = 1; i < nd; ++i)
+        *p++ = d[i];
+    }
+    *p++ = 'e';
+    *p++ = e10 < 0 ? '-' : '+';
+    return fmt_digits(p, e10 < 0 ? -e10 : e10, 2);
+  }
+  if (e10 < 0)
+  {
+    *p++ = '0';
+    *p++ = '.';
+    for (i = 1; i < (uint32_t)-e10; ++i)
+      *p++ = '0';
+    for (i = 0; i < nd; ++i)
+      *p++ = d[i];
+  }
+  else
+  {
+    for (i = 0; i <= (uint32_t)e10; ++i)
+      *p++ = d[i];
+    if (nd > (uint32_t)e10 + 1)
+    {
+      *p++ = '.';
+      for (; i < nd; ++i)
+        *p++ = d[i];
+    }
+  }
+  *p = '\0';
+  return p;
+}
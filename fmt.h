@@ -0,0 +1,30 @@
+#ifndef FMT_H
+#define FMT_H
+
+#include <inttypes.h>
+
+/*
+  Formatting of protocol requests and host lines, without printf.
+
+  Each function writes its text at p, followed by a '\0', and returns a
+  pointer to that '\0', so calls can be chained to build a line in a
+  buffer the caller has sized for it. Nothing is allocated, and nothing
+  outside the buffer is touched, so this is safe to use anywhere. Newlib's
+  printf family costs thousands of cycles per call and many KB of flash.
+*/
+
+/* Longest output of fmt_float(), including the '\0'. */
+#define FMT_FLOAT_MAX 16
+
+extern char *fmt_str(char *p, const char *s);
+/* The len bytes at s, which need not be NUL-terminated. */
+extern char *fmt_mem(char *p, const char *s, uint32_t len);
+extern char *fmt_uint32(char *p, uint32_t val);
+extern char *fmt_uint64(char *p, uint64_t val);
+extern char *fmt_int32(char *p, int32_t val);
+/* Two lowercase hex digits, like "%02x" of a byte. */
+extern char *fmt_hex8(char *p, uint32_t val);
+/* Same text as printf "%.7g": at most 7 significant digits. */
+extern char *fmt_float(char *p, float val);
+
+#endif  /* FMT_H */
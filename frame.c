@@ -0,0 +1,296 @@
+#include <inttypes.h>
+
+#include "crc16.h"
+#include "frame.h"
+
+
+/*
+  States of the number syntax check of a field. A field is a number if it
+  ends in NUM_INT, NUM_FRAC or NUM_EXP.
+*/
+enum {
+  NUM_START, NUM_SIGN, NUM_INT, NUM_DOT, NUM_FRAC, NUM_E, NUM_ESIGN, NUM_EXP,
+  NUM_BAD
+};
+
+/*
+  Offset of the first field of an ASCII frame, after "!xx:<cmd>"; two more
+  for an extended id, "!xxxx:<cmd>".
+*/
+#define ASCII_HDR 5
+#define ASCII_EXT_HDR 7
+
+
+static uint32_t
+hex_value(uint32_t c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  else if (c >= 'A' && c <= 'F')
+    return c - ('A'-10);
+  else if (c >= 'a' && c <= 'f')
+    return c - ('a'-10);
+  else
+    return 16;
+}
+
+
+static uint32_t
+num_next(uint32_t state, uint32_t c)
+{
+  uint32_t digit = (c >= '0' && c <= '9');
+
+  switch (state)
+  {
+  case NUM_START:
+  case NUM_SIGN:
+    if (digit)
+      return NUM_INT;
+    if (c == '.')
+      return NUM_DOT;
+    if (state == NUM_START && (c == '-' || c == '+'))
+      return NUM_SIGN;
+    break;
+  case NUM_INT:
+    if (digit)
+      return NUM_INT;
+    if (c == '.')
+      return NUM_FRAC;
+    if (c == 'e' || c == 'E')
+      return NUM_E;
+    break;
+  case NUM_DOT:
+    if (digit)
+      return NUM_FRAC;
+    break;
+  case NUM_FRAC:
+    if (digit)
+      return NUM_FRAC;
+    if (c == 'e' || c == 'E')
+      return NUM_E;
+    break;
+  case NUM_E:
+    if (c == '-' || c == '+')
+      return NUM_ESIGN;
+    /* Fall through. */
+  case NUM_ESIGN:
+  case NUM_EXP:
+    if (digit)
+      return NUM_EXP;
+    break;
+  }
+  return NUM_BAD;
+}
+
+
+static void
+field_start(struct frame_parser *fp, uint32_t start)
+{
+  fp->field_start = start;
+  fp->num_state = NUM_START;
+  fp->uint_ok = 1;
+  fp->split = 0;
+  fp->hex = 0;
+}
+
+
+/* The field being received ends at pos, with a '|'. */
+static void
+field_end(struct frame_parser *fp, uint32_t pos)
+{
+  struct frame *f = fp->f;
+  struct frame_field *fl;
+  uint32_t number, syntax = 0;
+
+  number = fp->num_state == NUM_INT || fp->num_state == NUM_FRAC ||
+    fp->num_state == NUM_EXP;
+  if (fp->split)
+    syntax = number ? FRAME_SEQ_NUMBER : 0;
+  else
+  {
+    if (fp->uint_ok && pos > fp->field_start)
+      syntax |= FRAME_UINT;
+    if (number)
+      syntax |= FRAME_NUMBER;
+  }
+
+  if (f->num_fields < FRAME_MAX_FIELDS)
+  {
+    fl = &f->field[f->num_fields++];
+    fl->start = fp->field_start;
+    fl->split = syntax == FRAME_SEQ_NUMBER ? fp->split : 0;
+  }
+  else
+  {
+    /* Out of fields, extend the last one. */
+    fl = &f->field[FRAME_MAX_FIELDS - 1];
+    fl->split = 0;
+    syntax = 0;
+  }
+  fl->len = pos - fl->start;
+  fl->syntax = syntax;
+}
+
+
+void
+frame_parse_start(struct frame_parser *fp, struct frame *f,
+                  const uint8_t *data, uint32_t c)
+{
+  fp->f = f;
+  fp->pos = 1;
+  fp->crc = crc16(c, 0);
+  fp->crc_mark = 0;
+  fp->rcv_crc = 0;
+  fp->bad = 0;
+  fp->cmd_pos = ASCII_HDR - 1;
+  field_start(fp, ASCII_HDR);
+  f->data = data;
+  f->len = 0;
+  f->status = FRAME_BAD;
+  f->binary = (c != '!');
+  f->id = 0;
+  f->cmd = 0;
+  f->num_fields = 0;
+}
+
+
+static void
+binary_byte(struct frame_parser *fp, uint32_t c, uint32_t pos)
+{
+  struct frame *f = fp->f;
+
+  /* crc_mark is the length byte N, so the CRC is at N+2 and N+3. */
+  if (pos == 1)
+  {
+    fp->crc_mark = c;
+    if (c < 2)
+      fp->bad = 1;
+    f->num_fields = 1;
+    f->field[0].start = 4;
+    f->field[0].len = c < 2 ? 0 : c - 2;
+    f->field[0].syntax = 0;
+    f->field[0].split = 0;
+  }
+  else if (pos == 2)
+    f->id = c;
+  else if (pos == 3)
+    f->cmd = c;
+
+  if (pos < fp->crc_mark + 2)
+    fp->crc = crc16(c, fp->crc);
+  else if (pos == fp->crc_mark + 2)
+    fp->rcv_crc = c;
+  else if (pos == fp->crc_mark + 3)
+    fp->rcv_crc |= c << 8;
+  else
+    fp->bad = 1;
+}
+
+
+void
+frame_parse_byte(struct frame_parser *fp, uint32_t c)
+{
+  struct frame *f = fp->f;
+  uint32_t pos = fp->pos++;
+  uint32_t d;
+
+  if (f->binary)
+  {
+    binary_byte(fp, c, pos);
+    return;
+  }
+
+  fp->crc = crc16(c, fp->crc);
+  if (pos <= fp->cmd_pos)
+  {
+    /* "!xx:<cmd>" or "!xxxx:<cmd>" */
+    if (pos == 3 && c != ':')
+    {
+      /* A third hex digit: an extended id. */
+      fp->cmd_pos = ASCII_EXT_HDR - 1;
+      field_start(fp, ASCII_EXT_HDR);
+    }
+    if (pos == fp->cmd_pos)
+    {
+      if (c == '|')
+        fp->bad = 1;
+      f->cmd = c;
+    }
+    else if (pos == fp->cmd_pos - 1)
+    {
+      if (c != ':')
+        fp->bad = 1;
+    }
+    else
+    {
+      d = hex_value(c);
+      if (d > 15)
+        fp->bad = 1;
+      f->id = (f->id << 4) | (d & 0xf);
+    }
+    return;
+  }
+
+  if (c == '|')
+  {
+    field_end(fp, pos);
+    fp->crc_mark = fp->crc;
+    field_start(fp, pos + 1);
+    return;
+  }
+
+  if (c == ',' && !fp->split && fp->uint_ok && pos > fp->field_start)
+  {
+    /* "<uint>," so far, the number follows. */
+    fp->split = pos - fp->field_start;
+    fp->num_state = NUM_START;
+  }
+  else
+    fp->num_state = num_next(fp->num_state, c);
+  if (c < '0' || c > '9')
+    fp->uint_ok = 0;
+  d = hex_value(c);
+  if (d > 15)
+    fp->hex = ~(uint32_t)0;
+  else if (fp->hex != ~(uint32_t)0)
+    fp->hex = (fp->hex << 4) | d;
+}
+
+
+void
+frame_parse_end(struct frame_parser *fp)
+{
+  struct frame *f = fp->f;
+
+  f->len = fp->pos;
+  if (f->binary)
+  {
+    if (fp->bad || fp->pos != fp->crc_mark + 4)
+      return;
+    f->status = fp->crc == fp->rcv_crc ? FRAME_OK : FRAME_BAD_CRC;
+    return;
+  }
+
+  /* The field after the last '|' is the CRC. */
+  if (fp->bad || !f->num_fields || fp->pos - fp->field_start != 4 ||
+      fp->hex == ~(uint32_t)0)
+    return;
+  f->status = fp->crc_mark == fp->hex ? FRAME_OK : FRAME_BAD_CRC;
+}
+
+
+uint32_t
+frame_uint(const char *s, uint32_t len)
+{
+  uint32_t i, d, val = 0;
+
+  for (i = 0; i < len && s[i] >= '0' && s[i] <= '9'; ++i)
+  {
+    d = s[i] - '0';
+    if (val > (0xffffffffUL - d) / 10)
+      val = 0xffffffffUL;
+    else
+      val = val*10 + d;
+  }
+  return val;
+}
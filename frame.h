@@ -0,0 +1,117 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <inttypes.h>
+
+/*
+  Incremental parser for responses from the slaves.
+
+  The bus receive interrupt (bus_rx.c) feeds each byte of a frame to
+  frame_parse_byte() as it arrives, so by the time the frame is complete it
+  has been checked and split up, with no further pass over it:
+
+    ASCII   "!xx:<cmd><field>|<field>|...|CRC", the CRC four hex digits
+            over everything before it. A device with an extended address
+            has four hex digits for its id, "!xxxx:<cmd>...".
+    Binary  BUS_RX_BINARY, N, id, cmd, N-2 bytes of payload, and the CRC
+            over everything before it, low byte first.
+
+  The result is a struct frame with the device id, the command, and the
+  fields as slices of the frame data; for a binary frame the payload is the
+  one field. Each ASCII field is also classified by its syntax as the bytes
+  go by, so the main loop can take a value as valid without looking at it
+  again.
+
+  The parser only accepts well-formed frames. Numbers are plain decimal
+  ("-12", "0.5", "1.5e-3"), a subset of what strtof() takes.
+*/
+
+/*
+  Fields in a frame, not counting the CRC. Any further fields of an ASCII
+  frame are left together, '|' and all, in the last one, so optional
+  fields that we do not know of do not make a frame invalid.
+*/
+#define FRAME_MAX_FIELDS 6
+
+/* Frame status. */
+#define FRAME_OK 0
+/* Not a well-formed frame. */
+#define FRAME_BAD 1
+/* Well-formed, but the CRC does not match; id and cmd are valid. */
+#define FRAME_BAD_CRC 2
+
+/* Field syntax, bits in frame_field.syntax. */
+/* Unsigned decimal integer. */
+#define FRAME_UINT 0x01
+/* Decimal number, with optional sign, fraction and exponent. */
+#define FRAME_NUMBER 0x02
+/* "<uint>,<number>", as in a read-out answer; split is the ','. */
+#define FRAME_SEQ_NUMBER 0x04
+
+struct frame_field {
+  /* Offset of the field in the frame, and its length. */
+  uint8_t start;
+  uint8_t len;
+  uint8_t syntax;
+  /* Offset in the field of the ',' of a FRAME_SEQ_NUMBER. */
+  uint8_t split;
+};
+
+struct frame {
+  /* The frame, from its start byte; without the "\r\n" of an ASCII one. */
+  const uint8_t *data;
+  uint8_t len;
+  uint8_t status;
+  uint8_t binary;
+  uint8_t cmd;
+  uint8_t num_fields;
+  uint16_t id;
+  struct frame_field field[FRAME_MAX_FIELDS];
+};
+
+/* Parser state, private to the receive interrupt. */
+struct frame_parser {
+  struct frame *f;
+  uint32_t pos;
+  uint32_t crc;
+  /* ASCII: CRC up to the last '|'. Binary: payload length. */
+  uint32_t crc_mark;
+  /* ASCII: start of the field being received. */
+  uint32_t field_start;
+  /* ASCII: position of the command, after the ':' following the id. */
+  uint32_t cmd_pos;
+  /* ASCII: the field so far as a hex number, or ~0 if not all hex. */
+  uint32_t hex;
+  /* Received CRC of a binary frame. */
+  uint32_t rcv_crc;
+  uint8_t num_state;
+  uint8_t uint_ok;
+  uint8_t split;
+  uint8_t bad;
+};
+
+/*
+  Begin parsing a frame into f, with its first byte c ('!' or
+  BUS_RX_BINARY) stored at data.
+*/
+extern void frame_parse_start(struct frame_parser *fp, struct frame *f,
+                              const uint8_t *data, uint32_t c);
+/* Parse the next byte of the frame. */
+extern void frame_parse_byte(struct frame_parser *fp, uint32_t c);
+/* The frame is complete; set its length and status. */
+extern void frame_parse_end(struct frame_parser *fp);
+
+/* Field k of f as text, not NUL-terminated. */
+static inline const char *
+frame_text(const struct frame *f, uint32_t k)
+{
+  return (const char *)f->data + f->field[k].start;
+}
+
+/*
+  Value of the decimal digits at the start of s, at most len of them, like
+  strtoul() but saturating at 0xffffffff.
+*/
+extern uint32_t frame_uint(const char *s, uint32_t len);
+
+#endif  /* FRAME_H */
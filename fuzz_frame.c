@@ -0,0 +1,632 @@
+/*
+  Fuzz test of the bus receive path, run on a Linux host.
+
+  Builds a byte stream of response frames of every kind, mostly valid but
+  many of them mangled (bits flipped, framing bytes put in, bytes dropped
+  or repeated, frames cut short or run together, noise between them), and
+  feeds it a byte at a time to the receive interrupt handler (bus_rx.c),
+  which parses the frames as they arrive (frame.c). Every frame that comes
+  out is compared with what a plain, non-incremental reference makes of the
+  same bytes: the framing, and the status, id, command and fields, and the
+  syntax of each field, the latter checked with regular expressions.
+
+  Build it with the sanitizers ("make fuzz") to also catch any access
+  outside the frame or the ring buffer.
+
+  Example:
+
+    ./fuzz_frame -n 1000000 -s 7
+*/
+
+#include <inttypes.h>
+#include <regex.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bus_rx.h"
+#include "crc16.h"
+#include "frame.h"
+
+
+#define MAX_GEN 400
+
+static regex_t re_uint, re_number, re_seq_number;
+static uint32_t verbose;
+
+static uint32_t frames_out, mismatches;
+static uint32_t count_status[3];
+
+
+/* Reference model of the framing in bus_rx.c. */
+
+static enum { REF_IDLE, REF_FRAME, REF_BIN_LEN, REF_BIN, REF_DISCARD }
+  ref_state = REF_IDLE;
+static uint8_t ref_buf[BUS_RX_MAX_FRAME];
+static uint32_t ref_len, ref_bin_left, ref_dropped;
+
+
+static uint32_t
+ref_store(uint32_t c)
+{
+  if (ref_len >= BUS_RX_MAX_FRAME)
+  {
+    ++ref_dropped;
+    ref_state = REF_DISCARD;
+    return 0;
+  }
+  ref_buf[ref_len++] = c;
+  return 1;
+}
+
+
+/* Returns 1 when a frame is complete in ref_buf. */
+static uint32_t
+ref_byte(uint32_t c)
+{
+  switch (ref_state)
+  {
+  case REF_IDLE:
+  case REF_DISCARD:
+    if (c == '!' || (c == BUS_RX_BINARY && ref_state == REF_IDLE))
+    {
+      ref_state = c == '!' ? REF_FRAME : REF_BIN_LEN;
+      ref_len = 0;
+      ref_store(c);
+    }
+    else if (c == '\n')
+      ref_state = REF_IDLE;
+    return 0;
+  case REF_FRAME:
+    if (c == '!')
+    {
+      ref_len = 0;
+      ref_store(c);
+    }
+    else if (c == '\n')
+    {
+      ref_state = REF_IDLE;
+      return 1;
+    }
+    else if (c != '\r' && c != '\0')
+      ref_store(c);
+    return 0;
+  case REF_BIN_LEN:
+    if (c + 4 > BUS_RX_MAX_FRAME)
+    {
+      ++ref_dropped;
+      ref_state = REF_IDLE;
+      return 0;
+    }
+    ref_bin_left = c + 2;
+    ref_state = REF_BIN;
+    ref_store(c);
+    return 0;
+  case REF_BIN:
+    if (ref_store(c) && !--ref_bin_left)
+    {
+      ref_state = REF_IDLE;
+      return 1;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+
+/* Reference parse of a complete frame. */
+
+static uint32_t
+ref_crc16(const uint8_t *buf, uint32_t len)
+{
+  uint32_t i, j, crc = 0;
+
+  for (i = 0; i < len; ++i)
+  {
+    crc ^= buf[i];
+    for (j = 0; j < 8; ++j)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+  }
+  return crc;
+}
+
+
+static uint32_t
+is_hex(uint32_t c)
+{
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+    (c >= 'A' && c <= 'F');
+}
+
+
+static uint32_t
+matches(const regex_t *re, const uint8_t *s, uint32_t len)
+{
+  char buf[BUS_RX_MAX_FRAME + 1];
+
+  /* A NUL in the field would end the string early; no match then. */
+  if (memchr(s, '\0', len))
+    return 0;
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  return !regexec(re, buf, 0, NULL, 0);
+}
+
+
+static void
+ref_syntax(const uint8_t *s, uint32_t len, struct frame_field *fl)
+{
+  const uint8_t *comma;
+
+  fl->syntax = 0;
+  fl->split = 0;
+  if (matches(&re_uint, s, len))
+    fl->syntax |= FRAME_UINT;
+  if (matches(&re_number, s, len))
+    fl->syntax |= FRAME_NUMBER;
+  if (matches(&re_seq_number, s, len))
+  {
+    comma = memchr(s, ',', len);
+    fl->syntax = FRAME_SEQ_NUMBER;
+    fl->split = comma - s;
+  }
+}
+
+
+static void
+ref_parse(const uint8_t *p, uint32_t len, struct frame *f)
+{
+  uint32_t i, last, start, n, hdr;
+  char id[5];
+
+  memset(f, 0, sizeof(*f));
+  f->data = p;
+  f->len = len;
+  f->status = FRAME_BAD;
+
+  if (p[0] == BUS_RX_BINARY)
+  {
+    f->binary = 1;
+    if (len < 6 || p[1] < 2 || len != p[1] + 4u)
+      return;
+    f->id = p[2];
+    f->cmd = p[3];
+    f->num_fields = 1;
+    f->field[0].start = 4;
+    f->field[0].len = p[1] - 2;
+    f->status = ref_crc16(p, len - 2) == (p[len-2] | (uint32_t)p[len-1] << 8) ?
+      FRAME_OK : FRAME_BAD_CRC;
+    return;
+  }
+
+  /* "!xx:<cmd>", or "!xxxx:<cmd>" for an extended id. */
+  hdr = len > 3 && p[3] != ':' ? 7 : 5;
+  if (len < hdr || p[hdr - 2] != ':' || p[hdr - 1] == '|')
+    return;
+  for (i = 1; i < hdr - 2; ++i)
+    if (!is_hex(p[i]))
+      return;
+  for (last = len; last > hdr && p[last - 1] != '|'; --last)
+    ;
+  if (last <= hdr || len - last != 4)
+    return;
+  for (i = last; i < len; ++i)
+    if (!is_hex(p[i]))
+      return;
+  --last;
+
+  memcpy(id, p + 1, hdr - 3);
+  id[hdr - 3] = '\0';
+  f->id = strtoul(id, NULL, 16);
+  f->cmd = p[hdr - 1];
+  n = 0;
+  start = hdr;
+  for (i = hdr; i <= last; ++i)
+  {
+    if (p[i] != '|')
+      continue;
+    if (n < FRAME_MAX_FIELDS)
+    {
+      f->field[n].start = start;
+      f->field[n].len = i - start;
+      ref_syntax(p + start, i - start, &f->field[n]);
+      ++n;
+    }
+    else
+    {
+      f->field[n - 1].len = i - f->field[n - 1].start;
+      f->field[n - 1].syntax = 0;
+      f->field[n - 1].split = 0;
+    }
+    start = i + 1;
+  }
+  f->num_fields = n;
+  f->status = ref_crc16(p, last + 1) ==
+    strtoul((char []){ p[last+1], p[last+2], p[last+3], p[last+4], '\0' },
+            NULL, 16) ? FRAME_OK : FRAME_BAD_CRC;
+}
+
+
+static void
+dump(const char *what, const uint8_t *p, uint32_t len)
+{
+  uint32_t i;
+
+  printf("  %s:", what);
+  for (i = 0; i < len; ++i)
+    printf(p[i] >= ' ' && p[i] < 127 ? "%c" : "\\x%02x", p[i]);
+  printf("\n");
+}
+
+
+static uint32_t
+compare(const struct frame *got, const struct frame *want)
+{
+  uint32_t k, len;
+  char *end, buf[BUS_RX_MAX_FRAME + 1];
+  unsigned long long v;
+
+  if (got->len != want->len || memcmp(got->data, want->data, want->len))
+    return 0;
+  if (got->status != want->status || got->binary != want->binary)
+    return 0;
+  if (want->status == FRAME_BAD)
+    return 1;
+  if (got->id != want->id || got->cmd != want->cmd ||
+      got->num_fields != want->num_fields)
+    return 0;
+  for (k = 0; k < want->num_fields; ++k)
+  {
+    if (got->field[k].start != want->field[k].start ||
+        got->field[k].len != want->field[k].len)
+      return 0;
+    if (want->binary)
+      continue;
+    if (got->field[k].syntax != want->field[k].syntax ||
+        got->field[k].split != want->field[k].split)
+      return 0;
+
+    /* The values the master takes from the fields. */
+    len = got->field[k].len;
+    memcpy(buf, frame_text(got, k), len);
+    buf[len] = '\0';
+    if (got->field[k].syntax & FRAME_UINT)
+    {
+      v = strtoull(buf, NULL, 10);
+      if (frame_uint(buf, len) != (v > 0xffffffffULL ? 0xffffffffULL : v))
+        return 0;
+    }
+    if (got->field[k].syntax & FRAME_NUMBER)
+    {
+      strtod(buf, &end);
+      if (*end)
+        return 0;
+    }
+  }
+  return 1;
+}
+
+
+/* Take any frame the receive path has ready, and check it. */
+static void
+check_frames(uint32_t ref_done)
+{
+  const struct frame *f = bus_rx_get_frame(0);
+  struct frame want;
+
+  if (!f && !ref_done)
+    return;
+  ++frames_out;
+  if (f && ref_done)
+  {
+    ref_parse(ref_buf, ref_len, &want);
+    if (compare(f, &want))
+    {
+      ++count_status[f->status];
+      if (verbose > 1)
+        dump(f->status == FRAME_OK ? "ok" : "bad", f->data, f->len);
+      return;
+    }
+  }
+  if (mismatches++ < 10)
+  {
+    printf("mismatch: receive path %s, reference %s\n",
+           f ? "has a frame" : "none", ref_done ? "has a frame" : "none");
+    if (f)
+    {
+      dump("got", f->data, f->len);
+      printf("  status %u id %u cmd %u fields %u\n", f->status, f->id,
+             f->cmd, f->num_fields);
+    }
+    if (ref_done)
+    {
+      dump("want", ref_buf, ref_len);
+      printf("  status %u id %u cmd %u fields %u\n", want.status, want.id,
+             want.cmd, want.num_fields);
+    }
+  }
+}
+
+
+static void
+feed(const uint8_t *p, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+  {
+    bus_rx_byte(0, p[i]);
+    check_frames(ref_byte(p[i]));
+  }
+}
+
+
+/* Frame generation. */
+
+static const char *const odd_values[] = {
+  "", "-", "+", ".", "-.", "+.5", "1.", ".5", "1e", "1e+", "1e-5", "1E5",
+  "-0", "0x10", "inf", "nan", " 1", "1 ", "--1", "1.2.3", "1,2", "1,2,3",
+  ",1", "1,", "007", "4294967295", "4294967296", "99999999999999999999",
+  "1e99999", "-1.5e-3", "12ab", "+7"
+};
+
+
+static uint32_t
+random_value(char *out)
+{
+  switch (rand() % 6)
+  {
+  case 0:
+    return sprintf(out, "%d", rand() - RAND_MAX/2);
+  case 1:
+    return sprintf(out, "%.*f", rand() % 4, (rand() - RAND_MAX/2) / 1000.0);
+  case 2:
+    return sprintf(out, "%g", (rand() - RAND_MAX/2) * 1e-6);
+  case 3:
+    return sprintf(out, "%e", (double)rand());
+  case 4:
+    return sprintf(out, "%u", (unsigned)(rand() % 100000));
+  default:
+    return sprintf(out, "%s", odd_values[rand() % (sizeof(odd_values) /
+                                                   sizeof(odd_values[0]))]);
+  }
+}
+
+
+static uint32_t
+random_text(char *out, uint32_t max)
+{
+  uint32_t i, n = rand() % (max + 1);
+
+  for (i = 0; i < n; ++i)
+  {
+    do
+      out[i] = ' ' + rand() % 95;
+    while (out[i] == '!' || out[i] == '|');
+  }
+  out[n] = '\0';
+  return n;
+}
+
+
+/* A valid frame, with a good CRC most of the time. */
+static uint32_t
+gen_frame(uint8_t *p)
+{
+  static const char cmds[] = "PQDBRx";
+  char body[MAX_GEN], val[64];
+  uint32_t len, k, n, crc, cmd;
+
+  if (rand() % 4 == 0)
+  {
+    /* Binary: P, Q or anything, with a payload of any length. */
+    n = rand() % 8 == 0 ? rand() % 60 : 2 + (rand() % 2 ? 5 : 6);
+    p[0] = BUS_RX_BINARY;
+    p[1] = n;
+    for (k = 0; k < n; ++k)
+      p[2 + k] = rand();
+    if (n >= 2)
+    {
+      p[2] = rand() % 128;
+      p[3] = "PQx"[rand() % 3];
+    }
+    crc = ref_crc16(p, n + 2);
+    if (rand() % 10 == 0)
+      crc ^= 1 << (rand() % 16);
+    p[n + 2] = crc & 0xff;
+    p[n + 3] = crc >> 8;
+    return n + 4;
+  }
+
+  cmd = cmds[rand() % (sizeof(cmds) - 1)];
+  if (rand() % 4 == 0)
+    len = sprintf(body, rand() % 8 ? "!%04x:%c" : "!%04X:%c",
+                  (unsigned)(rand() % 65536), cmd);
+  else
+    len = sprintf(body, rand() % 8 ? "!%02x:%c" : "!%02X:%c",
+                  (unsigned)(rand() % 256), cmd);
+  switch (cmd)
+  {
+  case 'P':
+    random_value(val);
+    len += sprintf(body + len, "%s|", val);
+    break;
+  case 'Q':
+    random_value(val);
+    len += sprintf(body + len, "%u,%s|", (unsigned)(rand() % 300), val);
+    break;
+  case 'D':
+    len += sprintf(body + len, "%u|", (unsigned)(rand() % 100000));
+    len += random_text(body + len, 40);
+    body[len++] = '|';
+    len += random_text(body + len, 10);
+    body[len++] = '|';
+    n = rand() % 10;
+    for (k = 0; k < n; ++k)
+      len += sprintf(body + len, "%c%u|", "bxz"[rand() % 3],
+                     (unsigned)(rand() % 5));
+    break;
+  case 'B':
+    len += sprintf(body + len, "17,8,4,2|");
+    break;
+  default:
+    n = rand() % 5;
+    for (k = 0; k <= n; ++k)
+    {
+      len += random_text(body + len, 12);
+      body[len++] = '|';
+    }
+  }
+  crc = ref_crc16((uint8_t *)body, len);
+  if (rand() % 10 == 0)
+    crc ^= 1 << (rand() % 16);
+  len += sprintf(body + len, rand() % 8 ? "%04x" : "%04X", (unsigned)crc);
+  if (rand() % 2)
+    body[len++] = '\r';
+  body[len++] = '\n';
+  memcpy(p, body, len);
+  return len;
+}
+
+
+static const uint8_t special[] = {
+  '!', '|', '\n', '\r', '\0', ',', '.', 'e', '-', '+', ':', '0', '9', 'f',
+  BUS_RX_BINARY, 0xff
+};
+
+
+/* Mangle the len bytes at p in place, with room for MAX_GEN. */
+static uint32_t
+mutate(uint8_t *p, uint32_t len)
+{
+  uint32_t i, j, n, times = 1 + rand() % 3;
+
+  while (times--)
+  {
+    i = len ? rand() % len : 0;
+    switch (rand() % 7)
+    {
+    case 0:
+      if (len)
+        p[i] ^= 1 << (rand() % 8);
+      break;
+    case 1:
+      if (len)
+        p[i] = special[rand() % sizeof(special)];
+      break;
+    case 2:
+      if (len < MAX_GEN - 1)
+      {
+        memmove(p + i + 1, p + i, len - i);
+        p[i] = rand() % 3 ? special[rand() % sizeof(special)] : rand();
+        ++len;
+      }
+      break;
+    case 3:
+      if (len)
+      {
+        memmove(p + i, p + i + 1, len - i - 1);
+        --len;
+      }
+      break;
+    case 4:
+      len = i;
+      break;
+    case 5:
+      /* Repeat a stretch. */
+      n = rand() % 20;
+      if (i + n <= len && len + n <= MAX_GEN)
+      {
+        memmove(p + i + n, p + i, len - i);
+        len += n;
+      }
+      break;
+    default:
+      for (j = 0; j < (uint32_t)(rand() % 4) && len < MAX_GEN; ++j)
+        p[len++] = rand();
+    }
+  }
+  return len;
+}
+
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -n N    frames to generate (default 200000)\n"
+          "  -s N    random seed (default 1)\n"
+          "  -v      verbose, -vv to show every frame\n", prog);
+  exit(1);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+  uint32_t count = 200000, seed = 1;
+  uint32_t i, len, n;
+  uint8_t buf[MAX_GEN + BUS_RX_MAX_FRAME];
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:v")) != -1)
+  {
+    switch (opt)
+    {
+    case 'n': count = strtoul(optarg, NULL, 0); break;
+    case 's': seed = strtoul(optarg, NULL, 0); break;
+    case 'v': ++verbose; break;
+    default: usage(argv[0]);
+    }
+  }
+
+#define NUMBER "[+-]?([0-9]+(\\.[0-9]*)?|\\.[0-9]+)([eE][+-]?[0-9]+)?"
+  if (regcomp(&re_uint, "^[0-9]+$", REG_EXTENDED | REG_NOSUB) ||
+      regcomp(&re_number, "^" NUMBER "$", REG_EXTENDED | REG_NOSUB) ||
+      regcomp(&re_seq_number, "^[0-9]+," NUMBER "$",
+              REG_EXTENDED | REG_NOSUB))
+  {
+    fprintf(stderr, "regcomp failed\n");
+    return 1;
+  }
+
+  srand(seed);
+  for (i = 0; i < count; ++i)
+  {
+    len = gen_frame(buf);
+    if (rand() % 2)
+      len = mutate(buf, len);
+    /* Sometimes two frames run together, or noise between frames. */
+    if (rand() % 16 == 0 && len < MAX_GEN)
+    {
+      n = gen_frame(buf + len);
+      len += n;
+    }
+    if (rand() % 16 == 0)
+      for (n = rand() % 8; n > 0 && len < sizeof(buf); --n)
+        buf[len++] = rand();
+    feed(buf, len);
+    if (rand() % 64 == 0)
+    {
+      /* As the master does before each request. */
+      bus_rx_flush(0);
+      ref_state = REF_IDLE;
+    }
+  }
+
+  if (bus_rx_dropped[0] != ref_dropped)
+  {
+    printf("mismatch: %u frames dropped, reference %u\n",
+           (unsigned)bus_rx_dropped[0], (unsigned)ref_dropped);
+    ++mismatches;
+  }
+  printf("fuzz frames:   %s (%u frames, %u ok, %u bad CRC, %u bad, "
+         "%u dropped; %u mismatches)\n", mismatches ? "FAIL" : "ok",
+         (unsigned)frames_out, (unsigned)count_status[FRAME_OK],
+         (unsigned)count_status[FRAME_BAD_CRC],
+         (unsigned)count_status[FRAME_BAD], (unsigned)bus_rx_dropped[0],
+         (unsigned)mismatches);
+  return mismatches != 0;
+}
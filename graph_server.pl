@@ -0,0 +1,282 @@
+#! /usr/bin/perl
+
+# Small HTTP server of graph data, for the page of a device (schema.txt).
+#
+#   GET /graph?id=<device>&from=<ms>&to=<ms>&points=<n>
+#
+# answers with JSON of at most n points over the range, each of them
+# [stamp, min, max, average]:
+#
+#   {"id":3,"from":...,"to":...,"bucket":3600000,"points":[[...],...]}
+#
+# The points come from the rollups (Rollup.pm), the coarsest that still
+# has n buckets in the range, merged down to n by taking the minimum,
+# maximum and average of each run of buckets; bucket is the size of the
+# rollup, in milliseconds. Ranges too short even for minutes get the
+# values themselves, thinned out to n by largest triangle three buckets
+# (LTTB), which keeps the peaks; bucket is 0 then. Either way the answer
+# and the rows read for it stay about the same size however long the
+# range is.
+#
+# Recent answers are cached, the least recently used going first when
+# the cache is full. An answer is good as long as no value of the device
+# has been written since, which device_last_value keeps count of; any new
+# one, even older than the newest (as when the master replays the values
+# a stalled client missed), makes the next request read the database
+# again. GET /stats gives counts of requests and of cache hits.
+#
+# It serves one request at a time, from localhost only. A client that has
+# not sent its request within -T seconds is dropped, so one that connects
+# and stalls does not hold up the rest.
+#
+#   ./graph_server.pl -d DBI:SQLite:dbname=/tmp/bench_ingest.db -p 8080
+
+use strict;
+use warnings;
+
+use DBI;
+use FindBin;
+use Getopt::Std;
+use IO::Handle;
+use IO::Socket::INET;
+use JSON::PP;
+
+use lib $FindBin::Bin;
+use Rollup;
+
+
+my %opt;
+getopts('d:u:p:c:T:', \%opt) or die <<USAGE;
+Usage: $0 [options]
+  -d DSN   data source (default DBI:Pg:dbname=powermeter)
+  -u USER  database user (default powermeter with the default data source)
+  -p PORT  port to listen on (default 8080)
+  -c N     answers to cache (default 256, 0 for none)
+  -T SEC   seconds a client has to send its request (default 5)
+USAGE
+my $dsn = $opt{d} // "DBI:Pg:dbname=powermeter";
+my $user = $opt{u} // ($opt{d} ? undef : "powermeter");
+my $port = $opt{p} // 8080;
+my $cache_size = $opt{c} // 256;
+my $read_timeout = $opt{T} // 5;
+# Most points of an answer.
+my $max_points = 10000;
+
+my $dbh = DBI->connect($dsn, $user, undef,
+                       {RaiseError => 1, AutoCommit => 1, PrintError => 0});
+# The client writes while we read.
+$dbh->sqlite_busy_timeout(5000) if $dbh->{Driver}{Name} eq 'SQLite';
+my $json = JSON::PP->new->canonical;
+
+# key => {body, writes, used}: the answer, the count of writes of values of
+# the device then, and when it was last asked for, as a tick of the clock
+# below. %by_use gives the key of each entry by that tick; the least
+# recently used entry is the one with the lowest tick still in it, at or
+# after $oldest.
+my %cache;
+my %by_use;
+my $tick = 0;
+my $oldest = 1;
+my %stats = (requests => 0, hits => 0, stale => 0, misses => 0,
+             timeouts => 0);
+
+
+# Largest triangle three buckets: n of the points [stamp, value], the first,
+# the last, and from each of n - 2 runs of the points in between the one
+# making the largest triangle with the one taken before it and the average
+# of the next run.
+sub lttb {
+  my ($p, $n) = @_;
+  my $len = @$p;
+
+  return $p if $len <= $n;
+  return [@$p[0 .. $n - 1]] if $n < 3;
+  my @out = ($p->[0]);
+  my $every = ($len - 2) / ($n - 2);
+  my $prev = 0;
+  for my $i (0 .. $n - 3) {
+    my $start = int($i * $every) + 1;
+    my $end = int(($i + 1) * $every) + 1;
+    my $next_end = int(($i + 2) * $every) + 1;
+    $next_end = $len if $next_end > $len;
+    my ($avg_x, $avg_y) = (0, 0);
+    for my $j ($end .. $next_end - 1) {
+      $avg_x += $p->[$j][0];
+      $avg_y += $p->[$j][1];
+    }
+    if ($next_end > $end) {
+      $avg_x /= $next_end - $end;
+      $avg_y /= $next_end - $end;
+    } else {
+      ($avg_x, $avg_y) = @{$p->[$len - 1]};
+    }
+    my ($ax, $ay) = @{$p->[$prev]};
+    my ($max_area, $max_j) = (-1, $start);
+    for my $j ($start .. $end - 1) {
+      my $area = abs(($ax - $avg_x) * ($p->[$j][1] - $ay) -
+                     ($ax - $p->[$j][0]) * ($avg_y - $ay));
+      ($max_area, $max_j) = ($area, $j) if $area > $max_area;
+    }
+    push @out, $p->[$max_j];
+    $prev = $max_j;
+  }
+  push @out, $p->[$len - 1];
+  return \@out;
+}
+
+
+# Merge rows [stamp, count, min, max, average] of buckets into n points
+# [stamp, min, max, average], each over a run of buckets, at the stamp of
+# its first.
+sub min_max {
+  my ($rows, $n) = @_;
+  my $len = @$rows;
+  my @out;
+
+  $n = $len if $n > $len;
+  for my $i (0 .. $n - 1) {
+    my ($count, $min, $max, $sum) = (0);
+    for my $r (@$rows[int($i * $len / $n) .. int(($i + 1) * $len / $n) - 1]) {
+      $min = $r->[2] if !defined($min) || $r->[2] < $min;
+      $max = $r->[3] if !defined($max) || $r->[3] > $max;
+      $count += $r->[1];
+      $sum += $r->[4] * $r->[1];
+    }
+    push @out, [$rows->[int($i * $len / $n)][0] + 0, $min + 0, $max + 0,
+                $sum / $count];
+  }
+  return \@out;
+}
+
+
+sub graph {
+  my ($dev, $from, $to, $points) = @_;
+  my ($rows, $size) = Rollup::query($dbh, $dev, $from, $to, $points);
+  my $out;
+
+  if ($size) {
+    $out = min_max($rows, $points);
+  } else {
+    $out = [map { [$_->[0], $_->[1], $_->[1], $_->[1]] }
+            @{lttb([map { [$_->[0] + 0, $_->[4] + 0] } @$rows], $points)}];
+  }
+  return $json->encode({id => $dev + 0, from => $from + 0, to => $to + 0,
+                        bucket => $size, points => $out});
+}
+
+
+# Make the cache entry of key the most recently used.
+sub use_entry {
+  my ($key) = @_;
+  my $c = $cache{$key};
+
+  delete $by_use{$c->{used}} if defined($c->{used});
+  $c->{used} = ++$tick;
+  $by_use{$tick} = $key;
+}
+
+
+# The answer to a request for a graph, from the cache if still good.
+sub cached_graph {
+  my ($dev, $from, $to, $points) = @_;
+  my $key = "$dev $from $to $points";
+  my ($writes) = $dbh->selectrow_array(<<SQL, undef, $dev);
+SELECT writes FROM device_last_value WHERE id = ?
+SQL
+  my $c = $cache{$key};
+
+  $writes //= 0;
+  if ($c && $c->{writes} == $writes) {
+    ++$stats{hits};
+    use_entry($key);
+    return $c->{body};
+  }
+  ++$stats{$c ? 'stale' : 'misses'};
+  my $body = graph($dev, $from, $to, $points);
+  return $body if !$cache_size;
+  if (!$c && keys(%cache) >= $cache_size) {
+    ++$oldest while !exists($by_use{$oldest});
+    delete $cache{delete $by_use{$oldest}};
+  }
+  $cache{$key} = {body => $body, writes => $writes};
+  use_entry($key);
+  return $body;
+}
+
+
+sub respond {
+  my ($conn, $status, $body) = @_;
+
+  print $conn "HTTP/1.0 $status\r\n",
+      "Content-Type: application/json\r\n",
+      "Content-Length: ", length($body), "\r\n",
+      "Connection: close\r\n\r\n", $body;
+}
+
+
+# Read the request line, or undef if the client did not send it, and its
+# headers in time.
+sub read_request {
+  my ($conn) = @_;
+  my $request;
+
+  eval {
+    local $SIG{ALRM} = sub { die "timeout\n" };
+    alarm($read_timeout);
+    $request = <$conn>;
+    # Headers are not needed.
+    while (my $line = <$conn>) {
+      last if $line =~ /^\r?\n$/;
+    }
+    alarm(0);
+    1;
+  } and return $request;
+  alarm(0);
+  ++$stats{timeouts};
+  return undef;
+}
+
+
+sub handle {
+  my ($conn) = @_;
+  my $request = read_request($conn);
+
+  return if !defined($request);
+  ++$stats{requests};
+  if ($request =~ m{^GET /stats }) {
+    return respond($conn, "200 OK", $json->encode({
+      %stats, entries => scalar(keys %cache)}));
+  }
+  if ($request !~ m{^GET /graph\?(\S*) }) {
+    return respond($conn, "404 Not Found", '{"error":"not found"}');
+  }
+  my %q = map { my ($k, $v) = split(/=/, $_, 2); ($k, $v) } split(/&/, $1);
+  for ('id', 'from', 'to', 'points') {
+    if (!defined($q{$_}) || $q{$_} !~ /^\d+$/) {
+      return respond($conn, "400 Bad Request", "{\"error\":\"bad $_\"}");
+    }
+  }
+  if ($q{points} < 1 || $q{points} > $max_points || $q{to} <= $q{from}) {
+    return respond($conn, "400 Bad Request", '{"error":"bad range"}');
+  }
+  my $body = eval { cached_graph(@q{'id', 'from', 'to', 'points'}) };
+  if (!defined($body)) {
+    print "Graph failed: $@";
+    return respond($conn, "500 Internal Server Error",
+                   '{"error":"database"}');
+  }
+  respond($conn, "200 OK", $body);
+}
+
+
+my $server = IO::Socket::INET->new(LocalAddr => '127.0.0.1',
+                                   LocalPort => $port, Listen => 64,
+                                   ReuseAddr => 1)
+    or die "Cannot listen on port $port: $!\n";
+$SIG{PIPE} = 'IGNORE';
+print "Listening on port $port\n";
+STDOUT->flush();
+while (my $conn = $server->accept()) {
+  handle($conn);
+  close($conn);
+}
@@ -0,0 +1,119 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <inttypes.h>
+
+/*
+  Hardware abstraction for the master.
+
+  The protocol and scheduling logic in master.c only talks to the hardware
+  through these functions. test_master.c implements them for the LM4F120
+  LaunchPad using the ROM driverlib; sim_bus.c implements them on a Linux
+  host against a simulated RS485 bus with virtual slaves and a virtual clock.
+*/
+
+/*
+  Baudrate to use on the bus.
+
+  The Atmega328 and similar UARTs used on the Arduinos is quite limited in
+  their choice of serial line speed, it can only be CPU_FREQUENCY/(16*N) for
+  integer N (or CPU_FREQUENCY/(8*N) in high-speed mode).
+
+  These possible speeds do not match very well to the standard speeds
+  available eg. to Linux stty, there are some few percentage errors.
+
+  We want to run at 115200. But the closest speed the Arduino can do is
+  16e6 / (8*17) = 117647 bits per second.
+
+  So we run the master device at that same slightly-off bit rate. Then we can
+  still debug using a standard speed of 115200 (with a slight error), and we
+  get exact speed on the important intra-bus communications.
+
+  This is the legacy rate that all slaves start out at; the master can
+  negotiate a faster rate with slaves that support it (see master.c).
+*/
+#define RS485_BAUD (16000000/(8*17))
+
+
+/*
+  Number of RS485 buses, each on its own UART with its own transmit/receive
+  switching. The master runs an independent engine for each (see master.c).
+  Buses are numbered from 0 in the functions below.
+*/
+#ifndef NUM_BUS
+#define NUM_BUS 2
+#endif
+
+
+/*
+  Rate of the periodic tick (SysTick on the target) that wakes up
+  wait_for_event(). It bounds how late a timeout can be noticed.
+*/
+#define HAL_TICK_HZ 4000
+
+
+/* Time since startup, in milliseconds. */
+extern uint64_t current_time(void);
+/* Time since startup, in microseconds. */
+extern uint64_t current_time_us(void);
+extern void delay_milliseconds(uint32_t ms);
+/* Short (~10 usec) delay used around RS485 transmitter/receiver switching. */
+extern void turnaround_delay(void);
+/*
+  Sleep until the next interrupt. On the target this is WFI, with SysTick
+  making sure we wake up at least HAL_TICK_HZ times per second; on the host
+  it advances the virtual clock to the next event.
+*/
+extern void wait_for_event(void);
+
+extern void led_on(void);
+extern void led_off(void);
+
+/*
+  RS485 buses (UART1 and UART3 on the target).
+
+  None of these block, so that the engines of the other buses can run while
+  one waits for its transmitter. The waiting is done with wait_for_event(),
+  so the UART must interrupt when there is room in its transmit FIFO after
+  bus_tx_space() returned 0, and when the last byte has left after
+  bus_tx_done() returned 0.
+*/
+extern void rs485_tx_mode(uint32_t bus);
+extern void rs485_rx_mode(uint32_t bus);
+/* Whether bus_putc() has room for another byte. */
+extern uint32_t bus_tx_space(uint32_t bus);
+extern void bus_putc(uint32_t bus, uint32_t c);
+/* Whether all bytes passed to bus_putc() have left the transmitter. */
+extern uint32_t bus_tx_done(uint32_t bus);
+/* Change the bus speed. Only called while the transmitter is idle. */
+extern void bus_set_baud(uint32_t bus, uint32_t baud);
+/*
+  Received bytes are passed to bus_rx_byte() (bus_rx.h) from the UART
+  interrupt handler.
+*/
+
+/*
+  Contexts for the bus engines, each with its own stack, switched between
+  cooperatively. hal_engine_start() sets up the context of bus to call
+  fn(bus) when first resumed. hal_engine_resume() runs it until it calls
+  hal_engine_yield(), which returns to the caller of hal_engine_resume().
+  fn must never return. hal_engine_resume() checks that the engine stayed
+  within its stack, and stops everything if not. hal_engine_stack_used()
+  is the most of its stack, in bytes, the engine of bus has used so far.
+*/
+extern void hal_engine_start(uint32_t bus, void (*fn)(uint32_t bus));
+extern void hal_engine_resume(uint32_t bus);
+extern void hal_engine_yield(uint32_t bus);
+extern uint32_t hal_engine_stack_used(uint32_t bus);
+
+/*
+  Serial link to the host computer (UART0 on the target).
+
+  host_tx_start() is called after queueing output in host_tx.c; it must make
+  sure the transmitter is draining the queue with host_tx_getc().
+*/
+extern void host_tx_start(void);
+extern uint32_t host_chars_avail(void);
+extern uint32_t host_getc(void);
+
+#endif  /* HAL_H */
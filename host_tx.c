@@ -0,0 +1,245 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "crc16.h"
+#include "hal.h"
+#include "host_tx.h"
+
+
+#if HOST_TX_SIZE & (HOST_TX_SIZE - 1)
+#error HOST_TX_SIZE must be a power of two
+#endif
+
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+volatile uint32_t host_tx_dropped;
+uint32_t host_tx_high_water;
+
+/* tx_head is only written by the main loop, tx_tail only by the interrupt. */
+static uint8_t tx_ring[HOST_TX_SIZE];
+static volatile uint32_t tx_head;
+static volatile uint32_t tx_tail;
+/* Value of host_tx_dropped last time we told the host about it. */
+static uint32_t dropped_reported;
+static uint32_t tx_mode;
+/* Sequence number of the next frame. */
+static uint32_t tx_seq;
+
+/*
+  A frame to queue: its header, the line or payload, and its trailer. Lines
+  in HOST_TX_TEXT mode have neither header nor trailer.
+*/
+struct tx_frame {
+  char hdr[8];
+  uint32_t hdr_len;
+  const char *body;
+  uint32_t len;
+  char trl[8];
+  uint32_t trl_len;
+};
+
+
+static void
+ring_put(const char *buf, uint32_t len)
+{
+  uint32_t head = tx_head;
+  uint32_t idx = head & (HOST_TX_SIZE-1);
+  uint32_t first = HOST_TX_SIZE - idx;
+
+  if (first > len)
+    first = len;
+  memcpy(&tx_ring[idx], buf, first);
+  memcpy(&tx_ring[0], buf + first, len - first);
+  barrier();
+  tx_head = head + len;
+}
+
+
+/* Write n in decimal at p; returns the number of digits. */
+static uint32_t
+put_dec(char *p, uint32_t n)
+{
+  char digits[10];
+  uint32_t i = 0, len;
+
+  do
+  {
+    digits[i++] = '0' + n % 10;
+    n /= 10;
+  } while (n);
+  len = i;
+  while (i > 0)
+    *p++ = digits[--i];
+  return len;
+}
+
+
+/* Frame the line of len bytes at buf, which ends in a newline. */
+static void
+text_frame(struct tx_frame *f, const char *buf, uint32_t len)
+{
+  static const char hex[] = "0123456789abcdef";
+  uint32_t crc;
+
+  f->body = buf;
+  f->len = len;
+  f->hdr_len = f->trl_len = 0;
+  if (tx_mode == HOST_TX_TEXT)
+    return;
+
+  while (f->len && (buf[f->len - 1] == '\n' || buf[f->len - 1] == '\r'))
+    --f->len;
+  f->hdr[0] = '$';
+  f->hdr_len = 1 + put_dec(f->hdr + 1, tx_seq++ & 0xffff);
+  f->hdr[f->hdr_len++] = ':';
+  crc = crc16_update((const uint8_t *)f->hdr, f->hdr_len, 0);
+  crc = crc16('|', crc16_update((const uint8_t *)buf, f->len, crc));
+  f->trl[0] = '|';
+  f->trl[1] = hex[(crc >> 12) & 0xf];
+  f->trl[2] = hex[(crc >> 8) & 0xf];
+  f->trl[3] = hex[(crc >> 4) & 0xf];
+  f->trl[4] = hex[crc & 0xf];
+  f->trl[5] = '\n';
+  f->trl_len = 6;
+}
+
+
+static uint32_t
+frame_size(const struct tx_frame *f)
+{
+  return f->hdr_len + f->len + f->trl_len;
+}
+
+
+static void
+frame_put(const struct tx_frame *f)
+{
+  ring_put(f->hdr, f->hdr_len);
+  ring_put(f->body, f->len);
+  ring_put(f->trl, f->trl_len);
+}
+
+
+/*
+  Frame the overflow notice into *nf, at notice, if one is due; it goes out
+  before the next frame, and only together with it.
+*/
+static void
+notice_frame(struct tx_frame *nf, char *notice)
+{
+  static const char msg[] = "Host output overflow, lines dropped: ";
+  uint32_t len;
+
+  nf->hdr_len = nf->len = nf->trl_len = 0;
+  if (host_tx_dropped == dropped_reported)
+    return;
+  memcpy(notice, msg, sizeof(msg) - 1);
+  len = sizeof(msg) - 1;
+  len += put_dec(notice + len, host_tx_dropped - dropped_reported);
+  notice[len++] = '\n';
+  text_frame(nf, notice, len);
+}
+
+
+/*
+  Queue the notice nf and the frame f, or neither. A dropped frame still
+  uses up its sequence number, and only that one, so the host sees a gap
+  of one for each line dropped.
+*/
+static uint32_t
+queue_frames(const struct tx_frame *nf, const struct tx_frame *f,
+             uint32_t seq)
+{
+  uint32_t used = tx_head - tx_tail;
+  uint32_t len = frame_size(nf) + frame_size(f);
+
+  if (used + len > HOST_TX_SIZE)
+  {
+    ++host_tx_dropped;
+    if (tx_seq != seq)
+      tx_seq = seq + 1;
+    return 0;
+  }
+  if (frame_size(nf))
+  {
+    frame_put(nf);
+    dropped_reported = host_tx_dropped;
+  }
+  frame_put(f);
+
+  used += len;
+  if (used > host_tx_high_water)
+    host_tx_high_water = used;
+  host_tx_start();
+  return 1;
+}
+
+
+uint32_t
+host_tx_write(const char *buf, uint32_t len)
+{
+  char notice[48];
+  struct tx_frame nf, f;
+  uint32_t seq = tx_seq;
+
+  notice_frame(&nf, notice);
+  text_frame(&f, buf, len);
+  return queue_frames(&nf, &f, seq);
+}
+
+
+uint32_t
+host_tx_write_binary(uint32_t type, const uint8_t *payload, uint32_t len)
+{
+  char notice[48];
+  struct tx_frame nf, f;
+  uint32_t seq = tx_seq;
+  uint32_t crc;
+
+  notice_frame(&nf, notice);
+  f.hdr[0] = (char)HOST_TX_BINARY;
+  f.hdr[1] = len + 3;
+  f.hdr[2] = tx_seq;
+  f.hdr[3] = tx_seq >> 8;
+  f.hdr[4] = type;
+  f.hdr_len = 5;
+  ++tx_seq;
+  f.body = (const char *)payload;
+  f.len = len;
+  crc = crc16_update((const uint8_t *)f.hdr, f.hdr_len, 0);
+  crc = crc16_update(payload, len, crc);
+  f.trl[0] = crc;
+  f.trl[1] = crc >> 8;
+  f.trl_len = 2;
+  return queue_frames(&nf, &f, seq);
+}
+
+
+uint32_t
+host_tx_pending(void)
+{
+  return tx_head - tx_tail;
+}
+
+
+int32_t
+host_tx_getc(void)
+{
+  uint32_t tail = tx_tail;
+  uint8_t c;
+
+  if (tail == tx_head)
+    return -1;
+  barrier();
+  c = tx_ring[tail & (HOST_TX_SIZE-1)];
+  barrier();
+  tx_tail = tail + 1;
+  return c;
+}
+
+
+void
+host_tx_set_mode(uint32_t mode)
+{
+  tx_mode = mode;
+}
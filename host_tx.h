@@ -0,0 +1,68 @@
+#ifndef HOST_TX_H
+#define HOST_TX_H
+
+#include <inttypes.h>
+
+/*
+  Buffered, non-blocking output to the host.
+
+  The main loop queues complete lines with host_tx_write(); the UART0
+  transmit interrupt drains the ring buffer with host_tx_getc(). If the
+  host link cannot keep up, whole lines are dropped (never partial ones),
+  and a notice with the number of dropped lines is queued as soon as there
+  is room again. This way reporting never delays bus transactions.
+
+  In HOST_TX_TEXT mode, the default, lines go out as they are. In
+  HOST_TX_FRAMED mode, each line goes out as a frame
+
+    $<seq>:<line>|<CRC>\n
+
+  without its own line end. seq is the frame number, in decimal, counting
+  up with every frame queued or dropped, modulo 65536, so the host sees a
+  gap for each frame it missed. CRC is the CRC-16 of the bus protocol
+  (crc16.h) over the bytes from '$' to the last '|', as four hex digits,
+  as in the answers of the slaves. Binary frames can be sent as well:
+
+    <HOST_TX_BINARY> <N> <seq lo> <seq hi> <type> <payload> <CRC lo> <CRC hi>
+
+  N counts the bytes from seq to the end of the payload, and the CRC is
+  over the bytes from HOST_TX_BINARY to the end of the payload. Lines
+  never hold HOST_TX_BINARY, so the host can tell the two apart by the
+  first byte.
+*/
+
+/* Ring buffer size, must be a power of two. */
+#define HOST_TX_SIZE 2048
+
+#define HOST_TX_TEXT 0
+#define HOST_TX_FRAMED 1
+#define HOST_TX_BINARY 0xfe
+/* Longest payload of a binary frame. */
+#define HOST_TX_MAX_PAYLOAD 252
+
+/* Total lines dropped because the buffer was full. */
+extern volatile uint32_t host_tx_dropped;
+/* Highest number of bytes ever waiting in the buffer. */
+extern uint32_t host_tx_high_water;
+
+/*
+  Queue len bytes for sending to the host, all or nothing.
+  Returns 1 if queued, 0 if dropped.
+*/
+extern uint32_t host_tx_write(const char *buf, uint32_t len);
+/*
+  Queue a binary frame of type type with the len bytes at payload, at most
+  HOST_TX_MAX_PAYLOAD, all or nothing. Only in HOST_TX_FRAMED mode.
+  Returns 1 if queued, 0 if dropped.
+*/
+extern uint32_t host_tx_write_binary(uint32_t type, const uint8_t *payload,
+                                     uint32_t len);
+/* Number of bytes waiting to be sent. */
+extern uint32_t host_tx_pending(void);
+/* Set the framing, HOST_TX_TEXT or HOST_TX_FRAMED. */
+extern void host_tx_set_mode(uint32_t mode);
+
+/* Called from the UART transmit interrupt; returns -1 when empty. */
+extern int32_t host_tx_getc(void);
+
+#endif  /* HOST_TX_H */
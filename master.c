@@ -0,0 +1,2953 @@
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "bus_rx.h"
+#include "crc16.h"
+#include "fmt.h"
+#include "hal.h"
+#include "host_tx.h"
+#include "master.h"
+#include "sample_log.h"
+#include "sched.h"
+#include "strpool.h"
+
+
+#define MAX_DESCRIPTION 140
+#define MAX_UNIT 20
+#define MAX_REQ (20+MAX_DESCRIPTION+MAX_UNIT)
+
+
+/*
+  Timeouts. When waiting for a response from a slave, we have two timeouts
+  that will be taken as slave not present or not responding.
+
+  The char timeout is the maximum time without receiving any new bytes
+  (before the first byte, or between two bytes); this should quickly flag a
+  non-present device so we can move on to try a discover request on the next
+  device id. It is adapted to each device, see below; TIMEOUT_CHAR is the
+  upper limit, used for devices we know nothing about yet.
+
+  TIMEOUT_RESPONSE is to avoid an infinite loop if we somehow continue to
+  receive bytes without ever seeing a response end (\n) - though if we do,
+  it would seem to indicate an errant device that is likely to disturb any
+  further communication attempts also. It allows for twice the wire time of
+  the longest possible frame at the current bus speed.
+
+  The timeouts are in microseconds.
+*/
+#define TIMEOUT_CHAR 10000
+#define TIMEOUT_RESPONSE (TIMEOUT_CHAR + 2*BUS_RX_MAX_FRAME*eng->bus_byte_us)
+
+/*
+  Adaptive timeouts.
+
+  For every device we keep a smoothed average of the time from our request
+  to the first byte of the response, and of the longest gap between two
+  bytes in a response, each with its smoothed mean deviation, like the TCP
+  retransmit timer (RFC 6298) does. The char timeouts for the device are
+  then average + TIMEOUT_DEV_MULT*deviation + TIMEOUT_MARGIN, limited to
+  TIMEOUT_MIN .. TIMEOUT_CHAR. The mean deviation stands in for the standard
+  deviation (it is about 0.8 times that for normally distributed times) and
+  needs no square root. TIMEOUT_MARGIN covers the resolution with which we
+  notice received bytes, one tick of wait_for_event().
+
+  When an active device times out, its deviations are doubled, so that a
+  timeout set too short will quickly grow rather than make us lose the
+  device.
+
+  The same averages are kept for the bus as a whole, over all responses, and
+  are used for discover requests to ids with no known device. An empty id
+  then costs not much more than the slowest of our devices takes to answer,
+  rather than the full TIMEOUT_CHAR. To still find a new device that is
+  slower than any seen so far, every DISCOVER_LONG_PROBE'th discover request
+  to an empty id waits the full TIMEOUT_CHAR (staggered by id, so the long
+  requests are spread out evenly).
+*/
+#define TIMEOUT_DEV_MULT 4
+#define TIMEOUT_MARGIN (2*1000000/HAL_TICK_HZ)
+#define TIMEOUT_MIN 1000
+#define DISCOVER_LONG_PROBE 8
+
+
+/*
+  Bus speed negotiation.
+
+  The Arduino slaves can run their UART at BAUD_CLOCK/N for integer N (see
+  RS485_BAUD in hal.h). All slaves start out at the legacy rate, N = 17,
+  and that rate is always used for discovering new devices. Two requests
+  let the master move a slave to a faster rate:
+
+    ?xx:B|      Capabilities. Answered with !xx:B<N>,<N>,...| listing the
+                divisors N that the slave can switch to.
+    ?xx:R<N>|   Switch rate. Answered with !xx:R<N>| at the old rate, after
+                which the slave uses divisor N. If it does not get a valid
+                request at the new rate within BAUD_CONFIRM milliseconds, it
+                goes back to the old rate.
+
+  The master confirms a switch with a capabilities request at the new rate
+  right away, tried twice as the answer may be lost; if that fails, the
+  cable does not carry the new rate, which is then not tried again for
+  BAUD_HOLD milliseconds.
+
+  A slave that has not received a valid request addressed to it for 15
+  seconds goes back to the legacy rate by itself, so it cannot get lost at
+  a rate the master is no longer using. Active devices get a discover
+  request every DISCOVER_ACTIVE_INTERVAL, which keeps them at their rate.
+
+  Devices that do not answer the capabilities request BAUD_CAPS_TRIES times
+  run old firmware, and only support the legacy rate. The master moves all
+  active devices to the fastest rate in bus_divisors[] that they all
+  support, so the bus as a whole changes speed.
+
+  Likewise on an error burst, a device at a fast rate failing
+  MAX_FAIL_RESPOND/2 requests in a row, the fastest rate allowed is lowered
+  below the rate of that device for BAUD_HOLD milliseconds. While a device
+  keeps failing, requests alternate between the rate it should be at and
+  the other rate it may be at, to find it again if it went back to the
+  legacy rate by itself, or if it did switch but we missed the answer.
+*/
+#define BAUD_CLOCK (16000000/8)
+#define BAUD_CAPS_TRIES 3
+#define BAUD_CONFIRM 50
+#define BAUD_HOLD (10*60*1000)
+#define NUM_BUS_RATES (sizeof(bus_divisors)/sizeof(bus_divisors[0]))
+static const uint8_t bus_divisors[] = { 17, 8, 4, 2 };
+
+
+#if MAX_REQ > 255
+#error MAX_REQ larger than 255, does not fit in uint8_t
+#endif
+
+
+/*
+  Number of times a device is allowed to fail to respond to a poll or
+  discover request, before being considered inactive.
+*/
+#define MAX_FAIL_RESPOND 10
+
+
+/*
+  Latched polling.
+
+  Rather than polling devices one by one, each sampling its value when its
+  own request arrives, devices with the same poll interval are polled as a
+  group: a broadcast makes them all take a sample at the same instant, and
+  the samples are then read out one by one.
+
+    ?ff:L<I>,<S>|   Latch. Not answered. Every device with poll interval I
+                    takes a sample and keeps it as sample number S.
+    ?xx:Q|          Read out. Answered with !xx:Q<S>,<value>| for the last
+                    latched sample.
+
+  The sample number, counting 1 .. LATCH_SEQ_MAX, tells a read-out of the
+  current sample from a stale one, if the device missed the broadcast.
+  The read-out is shorter than a poll and needs no time for sampling, and
+  the POLL lines for the whole group carry the same time stamp.
+
+  A device that does not answer the read-out, or answers with a stale
+  sample, is polled the normal way right after. Only groups of at least
+  LATCH_MIN_GROUP devices are latched, else the broadcast is not worth it.
+
+  The active devices with the same poll interval are kept in a list, so a
+  group is found without looking at the rest of the device table. There
+  are lists for up to LATCH_GROUPS different intervals on a bus; devices
+  with an interval that gets none are polled the normal way.
+
+  Whether a device supports this is found out in spare bus time, with a
+  read-out request outside of any group, before it joins one. Devices that
+  do not answer it in LATCH_TRIES tries run old firmware, and are always
+  polled the normal way.
+
+  Devices that support it are read out in time slots, up to TDMA_MAX_SLOTS
+  devices with a single request:
+
+    ?ff:T<S>,<L>,<T>,<xxyy..>|
+                    Slotted read-out. The devices listed, two hex digits
+                    each, answer as for ?xx:Q| one after the other: the k'th
+                    device (from 0) starts its answer L + k*T microseconds
+                    after the end of the request. A device whose sample S
+                    is not ready by then does not answer.
+
+  This saves the request and the turnaround for every device but the
+  first. The lead time L is the longest first byte timeout of the devices,
+  and the slot time T is the wire time of TDMA_FRAME bytes (TDMA_BIN_FRAME
+  if all the devices use binary frames, see below) plus a guard time
+  TDMA_GUARD for the device to release the bus. The answers are told
+  apart by the device id in them; a device that does not get a valid
+  answer through, say because it answered late and collided with the next
+  slot, is read out the normal way right after. A device that misses its
+  slot LATCH_TRIES times in a row goes back to normal read-outs, and is
+  tried with slots again after LATCH_HOLD milliseconds; so a burst of
+  noise does not turn slots off for good.
+
+  Support for slots is found out like support for latching, with a slotted
+  read-out of just that device.
+*/
+#define LATCH_TRIES 3
+#define LATCH_HOLD (10*60*1000)
+#define LATCH_MIN_GROUP 2
+#define LATCH_GROUPS 8
+#define LATCH_SEQ_MAX 99
+#define LATCH_UNKNOWN 0
+#define LATCH_YES 1
+#define LATCH_NO 2
+#define LATCH_SLOTS 3
+#define TDMA_MAX_SLOTS 16
+#define TDMA_FRAME 28
+#define TDMA_BIN_FRAME 11
+#define TDMA_GUARD 500
+
+
+/*
+  Binary frames.
+
+  The ASCII value in a poll answer, with the hex CRC around it, takes about
+  three times the bytes of the value itself. Devices that support it are
+  polled and read out with length-prefixed binary frames instead:
+
+    <SOF> <N> <id> <cmd> <payload> <CRC lo> <CRC hi>
+
+  SOF is BIN_REQUEST for a request and BIN_RESPONSE for an answer, bytes
+  that never occur in the ASCII protocol. N counts the bytes from id to the
+  end of the payload, and the CRC is the usual CRC-16 over the bytes from
+  SOF to the end of the payload. A value is BIN_VALUE_LEN bytes: a type
+  byte, BIN_FLOAT or BIN_INT, and a float or a signed 32-bit integer, least
+  significant byte first. Requests P and Q have no payload; the answer to P
+  is a value, and the answer to Q the sample number as one byte, then the
+  value. The master turns the value into text and reports it in the same
+  POLL line as for an ASCII answer.
+
+  Support is negotiated in the discover request, which the master sends as
+  ?xx:Db<V>| for binary frame version BIN_VERSION. Old firmware ignores the
+  argument. A device that supports binary frames adds the version it will
+  use to its answer, !xx:D<I>|<descr>|<unit>|b<V>|; it then also answers in
+  its slot of a slotted read-out in binary. Other requests, and broadcasts,
+  are always ASCII.
+
+  A device that stops answering is asked in ASCII again from the error
+  burst on (see device_not_responding()), in case it was restarted with old
+  firmware; the next discover request agrees on binary frames again.
+*/
+#define BIN_VERSION 1
+#define BIN_REQUEST 0xfc
+#define BIN_RESPONSE BUS_RX_BINARY
+#define BIN_FLOAT 'f'
+#define BIN_INT 'i'
+#define BIN_VALUE_LEN 5
+
+
+/*
+  Extended addresses.
+
+  Legacy slaves have ids 0 .. MAX_LEGACY_ID-1, written with two hex digits
+  in requests and answers, "?xx:" and "!xx:". Slaves with an extended
+  address have ids MAX_LEGACY_ID .. MAX_EXT_ID, written with four, "?xxxx:"
+  and "!xxxx:". Legacy firmware wants the ':' right after two digits, so it
+  ignores these requests. Binary frames and slotted read-outs only have
+  room for one byte ids, so devices with extended addresses always use
+  ASCII frames, and are read out one by one.
+
+  The legacy ids are few enough to sweep with discover requests, but the
+  extended ones are not. They are found by enumeration instead, walking the
+  binary tree of id prefixes:
+
+    ?ffff:E<P>,<N>| Enumerate. Answered with !xxxx:E| by every device whose
+                    id has the same top N bits as P (four hex digits), and
+                    that has not received a request addressed to it for 15
+                    seconds.
+
+  No answer means no new devices under the prefix. A valid answer gives the
+  id of a new device, which then gets a discover request right away; as
+  there may be more, the same prefix is asked again. Anything else means
+  several devices answered at once, and the two halves of the prefix are
+  asked in turn. Finding k new devices then takes about k*log2(65536/k)
+  requests, rather than a request to every id.
+
+  So known devices must hear from us every 15 seconds, or they answer again
+  and collide with the new ones. Rediscovering each of thousands of them
+  every DISCOVER_ACTIVE_INTERVAL would take more than the bus has, so an
+  active device with an extended address gets a discover request only
+  when it has gone ENUM_REFRESH milliseconds without one or a poll. A walk
+  is started every ENUM_INTERVAL milliseconds while there is room in the
+  device table, and uses the bus time budget of discovery (see below). A
+  device with an extended address that goes inactive gives up its slot in
+  the table; if it comes back, enumeration finds it again.
+*/
+#define ENUM_INTERVAL 2000
+#define ENUM_REFRESH 12000
+#define ENUM_BITS 16
+
+/*
+  A value from an answer, as text: in the frame for an ASCII answer, or
+  formatted into buf from a binary one.
+*/
+struct value {
+  const char *str;
+  uint32_t len;
+  char buf[FMT_FLOAT_MAX];
+};
+
+
+/*
+  Discovery scheduling.
+
+  Active devices are sent a discover request every DISCOVER_ACTIVE_INTERVAL
+  milliseconds, to catch updated description/unit strings, even if the
+  device manages to update quickly enough to not miss enough polls to be
+  marked as non-active.
+
+  Ids with no device are retried after DISCOVER_EMPTY_MIN milliseconds,
+  doubling for every failed attempt up to DISCOVER_EMPTY_MAX. An id whose
+  device just went inactive starts over at the front of the queue.
+
+  Discovery may use at most DISCOVER_BUDGET permille of the bus time,
+  accumulating at most DISCOVER_BURST milliseconds of unused budget. And a
+  discover request is only sent if it is expected to complete before the
+  next poll is due. Since even an empty id may turn out to have a new device
+  answering, the expected time is the first byte timeout plus
+  DISCOVER_COST_RESPONSE microseconds: the wire time of the request and of a
+  maximum length response at the bus speed used, the 2 millisecond release
+  delay, and up to a millisecond lost to the resolution of current_time().
+
+  With many devices polled often, the gaps between polls can all be shorter
+  than a discover request, and discovery would never get to run. So once
+  discovery has been held back by polls for DISCOVER_STARVED milliseconds,
+  the next discover request may delay a poll by up to DISCOVER_POLL_SLACK
+  milliseconds, which must cover the longest discover request.
+*/
+#define DISCOVER_ACTIVE_INTERVAL 5000
+#define DISCOVER_EMPTY_MIN 1000
+#define DISCOVER_EMPTY_MAX 8000
+#define DISCOVER_BUDGET 500
+#define DISCOVER_BURST 100
+#define DISCOVER_STARVED 100
+#define DISCOVER_POLL_SLACK 35
+#define DISCOVER_COST_RESPONSE(len, byte_us) (((len)+20)*(byte_us) + 3000)
+
+
+/*
+  Response timing estimates, in microseconds, for the adaptive timeouts.
+  All zero until the first response is seen.
+*/
+struct timing {
+  uint16_t first_avg;
+  uint16_t first_dev;
+  uint16_t gap_avg;
+  uint16_t gap_dev;
+};
+
+/*
+  Char timeouts for one request, or the times measured for one response, in
+  microseconds: time until the first byte, and the longest gap between bytes.
+*/
+struct timeouts {
+  uint32_t first;
+  uint32_t gap;
+};
+
+
+/*
+  Device table. This is what the main loop looks at for every request, so
+  it is kept small, DEVDATA_SIZE bytes a device: the strings, which are only
+  needed for reports to the host, are in the string pool, and the time the
+  next poll is due is in poll_sched.
+*/
+struct devdata {
+  /* Time of last poll, or 0 if never polled yet. */
+  uint64_t last_poll_time;
+  /* Timing estimates, for the current rate. */
+  struct timing timing;
+  /*
+    Device id, the slot number for the legacy ids. For the slots of extended
+    addresses, 0 while free.
+  */
+  uint16_t id;
+  /* Poll interval, in seconds. */
+  uint16_t poll_interval;
+  /*
+    Next device in the list of devices with the same poll interval (see
+    group_join()), MAX_DEVICE for the last one, or GROUP_NONE if the device
+    is not in a list.
+  */
+  uint16_t group_next;
+  /*
+    Active flag. Zero for a non-active device. Non-zero for an active device;
+    then the value is the number of times the device is allowed to fail to
+    respond to poll or discover before being considered inactive.
+  */
+  uint8_t active_count;
+  /*
+    Description and unit, stored in quoted format (\xx), as handles in
+    dev_strings.
+  */
+  uint8_t description;
+  uint8_t unit;
+  /* Index in bus_divisors[] of the rate the device is at. */
+  uint8_t rate;
+  /*
+    Rates the device supports, bit i for bus_divisors[i], or 0 while we have
+    not asked yet; caps_tries is the number of times we asked in vain.
+  */
+  uint8_t rate_mask;
+  /*
+    Whether the device supports latched polling, LATCH_xxx; latch_tries is
+    the number of times we asked in vain, or for LATCH_SLOTS the number of
+    slots missed in a row. The two counts share a byte, they stop at
+    BAUD_CAPS_TRIES and LATCH_TRIES.
+  */
+  uint8_t latch;
+  unsigned caps_tries : 4;
+  unsigned latch_tries : 4;
+  /* Binary frame version agreed with the device, or 0 for ASCII frames. */
+  uint8_t frame;
+  /*
+    Low 16 bits of state_gen when the device was last reported changed, see
+    continue_sync().
+  */
+  uint16_t gen;
+};
+
+
+#define DEVDATA_SIZE 32
+/* Fails to compile if struct devdata grows past DEVDATA_SIZE. */
+typedef char devdata_size_check[sizeof(struct devdata) <= DEVDATA_SIZE ?
+                                1 : -1];
+
+#if BAUD_CAPS_TRIES > 15 || LATCH_TRIES > 15
+#error caps_tries and latch_tries have only four bits
+#endif
+
+/* group_next of a device that is in no list. */
+#define GROUP_NONE 0xffff
+
+/*
+  List of the active devices with poll interval interval, from head
+  through their group_next; interval 0 while the list is not in use.
+*/
+struct latch_group {
+  uint16_t interval;
+  uint16_t head;
+};
+
+/*
+  Set of devices, a bit for each, and how many there are; for the devices
+  that may still have something to be done for them, so the work is found
+  without looking at all the others.
+*/
+struct devset {
+  uint32_t bits[(MAX_DEVICE + 31)/32];
+  uint32_t count;
+};
+
+static struct strpool dev_strings;
+
+/*
+  Engine for one bus: its devices, schedules and speed. The engine of each
+  bus runs in a context of its own (see hal.h), and where the code below
+  waits for the bus, it returns to poll_n_discover_step(), which runs the
+  other engines meanwhile; so while one bus waits for an answer, the
+  others can send their requests. eng is the engine running. Only the
+  string pool, the host link and the statistics are shared.
+*/
+struct bus_engine {
+  uint32_t bus;
+  /* Set when the engine gave up the CPU with more to do, not to wait. */
+  uint32_t busy;
+  struct devdata devices[MAX_DEVICE];
+  /* Next poll of active devices. */
+  struct sched poll_sched;
+  /* Next discover request for all device ids. */
+  struct sched discover_sched;
+  /* Slots for extended addresses in use. */
+  uint32_t ext_used;
+  /*
+    Id prefixes still to ask in the current enumeration walk, a stack; the
+    number of walks started, and when the next one is due.
+  */
+  struct {
+    uint16_t prefix;
+    uint8_t bits;
+  } enum_stack[ENUM_BITS+1];
+  uint32_t enum_depth;
+  uint32_t enum_walks;
+  uint64_t next_walk;
+  /* Number of discover requests an empty id has failed to answer in a row. */
+  uint8_t discover_backoff[MAX_DEVICE];
+  /* Number of discover requests sent to each id while empty. */
+  uint8_t discover_probes[MAX_DEVICE];
+  /* Bus time budget of discovery, see discover_budget(). */
+  int64_t discover_credit;
+  uint64_t discover_credit_time;
+  /*
+    Response timing over all devices at the legacy rate, for ids with no
+    known device.
+  */
+  struct timing bus_timing;
+  /* Number of the last latch broadcast, 1 .. LATCH_SEQ_MAX. */
+  uint32_t latch_seq;
+  /* Active devices by poll interval, for latched polling. */
+  struct latch_group groups[LATCH_GROUPS];
+  /* Devices that may need a latch probe, see latch_probe_next(). */
+  struct devset latch_todo;
+  /*
+    Devices that went back to normal read-outs after missing their slots,
+    and when they are tried with slots again.
+  */
+  struct devset slots_lost;
+  uint64_t slots_hold_until;
+  /* Devices whose new strings found no room, see do_discover(). */
+  struct devset no_room;
+  /*
+    When speed changes, latch probes, discovery and enumeration were first
+    held back by a poll, or 0; see fits_before_poll().
+  */
+  uint64_t baud_blocked;
+  uint64_t latch_blocked;
+  uint64_t discover_blocked;
+  uint64_t enum_blocked;
+
+  /* Index in bus_divisors[] of the rate the UART is set to. */
+  uint32_t cur_rate;
+  /* Time on the wire of one byte at that rate, in microseconds. */
+  uint32_t bus_byte_us;
+  /* The rate we want all active devices at. */
+  uint32_t bus_rate;
+  /* Fastest rate allowed, lowered for a while after an error burst. */
+  uint32_t rate_ceiling;
+  uint64_t rate_hold_until;
+  /* No rate changes before this time, while a failed switch is undone. */
+  uint64_t rate_wait_until;
+  /* Set when anything changed that may call for a rate change. */
+  uint32_t rate_dirty;
+  /*
+    Devices that may need asking for their rates or switching to bus_rate,
+    see baud_next(). Of the active devices, the number with rate_mask not
+    known yet, and for each rate the number known not to support it.
+  */
+  struct devset baud_todo;
+  uint32_t rate_unknown;
+  uint32_t rate_lacking[NUM_BUS_RATES];
+};
+
+static struct bus_engine engines[NUM_BUS];
+static struct bus_engine *eng;
+static uint32_t num_engines;
+
+
+/*
+  Let the other engines run until there may be something new for this
+  one: a byte received or sent on its bus, or a tick gone by.
+*/
+static void
+engine_wait(void)
+{
+  eng->busy = 0;
+  hal_engine_yield(eng->bus);
+}
+
+
+static void
+engine_delay(uint32_t ms)
+{
+  uint64_t end = current_time_us() + 1000*(uint64_t)ms;
+
+  while (current_time_us() < end)
+    engine_wait();
+}
+
+
+static void
+bus_put(uint32_t c)
+{
+  while (!bus_tx_space(eng->bus))
+    engine_wait();
+  bus_putc(eng->bus, c);
+}
+
+
+/* Wait until all bytes passed to bus_put() have left the transmitter. */
+static void
+bus_wait_tx(void)
+{
+  while (!bus_tx_done(eng->bus))
+    engine_wait();
+}
+
+
+/*
+  Id of device id on the bus of the engine running, as reported to the
+  host: the bus number in the upper 16 bits, so that the ids on bus 0 are
+  the same as with a single bus.
+*/
+static uint32_t
+host_id(uint32_t id)
+{
+  return eng->bus << 16 | id;
+}
+
+
+static uint32_t
+dec2hex(uint32_t x)
+{
+  if (x <= 9)
+    return x + '0';
+  else
+    return x + ('a' - 10);
+}
+
+
+static uint32_t
+dec2hex_upper(uint32_t dig)
+{
+  return (dig >= 10 ? 'A' - 10 + dig : '0' + dig);
+}
+
+
+/*
+  Host protocol modes, chosen by the host with "MODE text|framed|binary".
+  In text mode, the default, lines go out as they are; in framed mode, each
+  with a sequence number and CRC (see host_tx.h). Binary mode is framed
+  mode with the POLL values sent in batches instead of lines: binary frames
+  of type HOST_BATCH_POLL, with a payload of
+
+    <seq of first value> <time stamp of first value> <record> ...
+
+  4 and 8 bytes little endian, then a record of the sample log (see
+  sample_log.h) for each value, their sequence numbers counting up from the
+  first. The full time stamp of a value is the one closest to that of the
+  first value with the same low 32 bits. A batch goes out when full, when
+  the next value does not follow on in sequence (as for a replay), before
+  any line, and at the latest BATCH_AGE milliseconds after its first value.
+  In bench_master, a value then takes 14 bytes of the host link, against 26
+  in text mode and 37 in framed mode.
+*/
+#define HOST_MODE_TEXT 0
+#define HOST_MODE_FRAMED 1
+#define HOST_MODE_BINARY 2
+#define HOST_BATCH_POLL 'P'
+#define BATCH_HDR 12
+#define BATCH_AGE 200
+static const char * const host_mode_names[] = { "text", "framed", "binary" };
+static uint32_t host_mode = HOST_MODE_TEXT;
+static uint8_t batch[HOST_TX_MAX_PAYLOAD];
+static uint32_t batch_len;
+/* Sequence number the next value in the batch must have. */
+static uint32_t batch_seq;
+/* When the first value went in. */
+static uint64_t batch_time;
+
+#if BATCH_HDR + SAMPLE_LOG_MAX_RECORD > HOST_TX_MAX_PAYLOAD
+#error Batch frame payload too small for a sample log record
+#endif
+
+
+static void
+batch_flush(void)
+{
+  if (!batch_len)
+    return;
+  host_tx_write_binary(HOST_BATCH_POLL, batch, batch_len);
+  batch_len = 0;
+}
+
+
+static void
+batch_add(uint32_t id, const char *str, uint32_t len, uint64_t stamp,
+          uint32_t seq)
+{
+  uint32_t i, n = sample_log_record_len(str, len);
+
+  if (batch_len && (seq != batch_seq || batch_len + n > sizeof(batch)))
+    batch_flush();
+  if (!batch_len)
+  {
+    for (i = 0; i < 4; ++i)
+      batch[i] = seq >> (8*i);
+    for (i = 0; i < 8; ++i)
+      batch[4 + i] = stamp >> (8*i);
+    batch_len = BATCH_HDR;
+    batch_time = current_time();
+  }
+  batch_len += sample_log_encode(batch + batch_len, id, stamp, str, len);
+  batch_seq = seq + 1;
+}
+
+
+/*
+  Output to the host is queued and sent from the UART0 interrupt (see
+  host_tx.c). Each call queues the string as a unit, or drops it entirely if
+  the host is not keeping up, so callers should pass complete lines.
+*/
+static void
+serial_output_str(const char *str)
+{
+  /* Keep the order of values and lines. */
+  batch_flush();
+  host_tx_write(str, strlen(str));
+}
+
+
+__attribute__((unused))
+static void
+serial_output_hexbyte(uint8_t byte)
+{
+  char buf[3];
+  buf[0] = dec2hex_upper(byte >> 4);
+  buf[1] = dec2hex_upper(byte & 0xf);
+  buf[2] = '\0';
+  serial_output_str(buf);
+}
+
+
+static void
+println_msg_uint32(const char *msg, uint32_t val)
+{
+  char buf[60];
+  uint32_t len = strlen(msg);
+  char *p;
+
+  if (len > sizeof(buf) - 13)
+    len = sizeof(buf) - 13;
+  memcpy(buf, msg, len);
+  p = fmt_uint32(buf + len, val);
+  fmt_str(p, "\r\n");
+  serial_output_str(buf);
+}
+
+
+/*
+  Generation of the device table: counts up every time a device is
+  reported with a new state, ACTIVE with other data or INACTIVE. See
+  continue_sync().
+*/
+static uint32_t state_gen;
+
+
+static void
+device_changed(uint32_t dev)
+{
+  eng->devices[dev].gen = ++state_gen;
+}
+
+
+/*
+  "<id>|<poll interval>|<description>|<unit>", the part of the ACTIVE line
+  for dev that goes into the table checksum. Returns the end.
+*/
+static char *
+active_state(char *p, uint32_t dev)
+{
+  struct devdata *d = &eng->devices[dev];
+
+  p = fmt_uint32(p, host_id(d->id));
+  p = fmt_uint32(fmt_str(p, "|"), d->poll_interval);
+  p = fmt_mem(fmt_str(p, "|"), strpool_str(&dev_strings, d->description),
+              strpool_len(&dev_strings, d->description));
+  p = fmt_mem(fmt_str(p, "|"), strpool_str(&dev_strings, d->unit),
+              strpool_len(&dev_strings, d->unit));
+  return p;
+}
+
+
+static void
+device_active(uint32_t dev)
+{
+  char buf[MAX_REQ + 50];
+
+  fmt_str(active_state(fmt_str(buf, "ACTIVE "), dev), "\n");
+  serial_output_str(buf);
+}
+
+
+static void
+device_inactive(uint32_t dev)
+{
+  char buf[20];
+
+  fmt_str(fmt_uint32(fmt_str(buf, "INACTIVE "), host_id(eng->devices[dev].id)),
+          "\n");
+  serial_output_str(buf);
+}
+
+
+/*
+  "POLL <id> <value> <stamp> <seq>": a polled value, the time it was
+  sampled, in milliseconds of current_time(), and its number in the sample
+  log (see sample_log.h). In binary mode, the value goes in a batch.
+*/
+static void
+poll_line(uint32_t id, const char *str, uint32_t len, uint64_t stamp,
+          uint32_t seq)
+{
+  char buf[BUS_RX_MAX_FRAME + 50];
+  char *p;
+
+  if (host_mode == HOST_MODE_BINARY)
+  {
+    batch_add(id, str, len, stamp, seq);
+    return;
+  }
+  p = fmt_uint32(fmt_str(buf, "POLL "), id);
+  p = fmt_mem(fmt_str(p, " "), str, len);
+  p = fmt_uint64(fmt_str(p, " "), stamp);
+  p = fmt_uint32(fmt_str(p, " "), seq);
+  fmt_str(p, "\n");
+  serial_output_str(buf);
+}
+
+
+/* Report a polled value, and keep it in the sample log for replay. */
+static void
+device_poll_result(uint32_t dev, const struct value *v, uint64_t stamp)
+{
+  uint32_t id = host_id(eng->devices[dev].id);
+
+  poll_line(id, v->str, v->len, stamp,
+            sample_log_add(id, stamp, v->str, v->len));
+}
+
+
+
+static void
+send_to_slave(const char *s)
+{
+  uint32_t crc;
+  uint32_t c;
+
+  rs485_tx_mode(eng->bus);
+turnaround_delay();
+  /*
+    Send a dummy byte of all one bits. This should ensure that the UART state
+    machine can sync up to the byte boundary, as it prevents any new start bit
+    being seen for one character's time.
+  */
+  bus_put(0xff);
+  /* The CRC is of the unquoted request, so take it all at once. */
+  crc = crc16_buf((const uint8_t *)s, strlen(s));
+  while ((c = *s++))
+  {
+#if TODO_FIX_QUOTING
+    if (c < ' ' || c >= 127 || c == '!' || c == '?' || c == '|' || c == '\\' ||
+        c == ':')
+    {
+      /* Handle escaping. */
+      bus_put('\\');
+      bus_put(dec2hex(c >> 4));
+      bus_put(dec2hex(c & 0xf));
+    }
+    else
+#endif
+      bus_put(c);
+  }
+  /* Send the CRC and the end marker. */
+  bus_put(dec2hex(crc >> 12));
+  bus_put(dec2hex((crc >> 8) & 0xf));
+  bus_put(dec2hex((crc >> 4) & 0xf));
+  bus_put(dec2hex(crc & 0xf));
+  bus_put('\r');
+  bus_put('\n');
+  bus_wait_tx();
+turnaround_delay();
+  rs485_rx_mode(eng->bus);
+}
+
+
+/* Send binary request cmd, without payload, to dev. */
+static void
+send_binary(uint32_t dev, uint32_t cmd)
+{
+  uint8_t frame[6];
+  uint32_t crc, i;
+
+  frame[0] = BIN_REQUEST;
+  frame[1] = 2;
+  frame[2] = eng->devices[dev].id;
+  frame[3] = cmd;
+  crc = crc16_buf(frame, 4);
+  frame[4] = crc & 0xff;
+  frame[5] = crc >> 8;
+
+  rs485_tx_mode(eng->bus);
+turnaround_delay();
+  /* The dummy byte, as for an ASCII request. */
+  bus_put(0xff);
+  for (i = 0; i < sizeof(frame); ++i)
+    bus_put(frame[i]);
+  bus_wait_tx();
+turnaround_delay();
+  rs485_rx_mode(eng->bus);
+}
+
+
+/*
+  Write the start "?xx:", or "?xxxx:" for an extended address, of an ASCII
+  request to dev at buf, returning the end for the command and its
+  arguments to follow.
+*/
+static char *
+request_start(char *buf, uint32_t dev)
+{
+  uint32_t id = eng->devices[dev].id;
+
+  buf[0] = '?';
+  if (id < MAX_LEGACY_ID)
+    return fmt_str(fmt_hex8(buf + 1, id), ":");
+  return fmt_str(fmt_hex8(fmt_hex8(buf + 1, id >> 8), id & 0xff), ":");
+}
+
+
+/*
+  Write the ASCII request "?xx:<cmd>|" to dev at buf, returning buf. The
+  buffer must hold 10 bytes.
+*/
+static char *
+request_cmd(char *buf, uint32_t dev, uint32_t cmd)
+{
+  char *p = request_start(buf, dev);
+
+  *p++ = cmd;
+  fmt_str(p, "|");
+  return buf;
+}
+
+
+/*
+  Send request cmd, without argument, to dev: "?xx:<cmd>|", or in binary if
+  the device agreed to binary frames.
+*/
+static void
+send_request(uint32_t dev, uint32_t cmd)
+{
+  char buf[10];
+
+  if (eng->devices[dev].frame)
+  {
+    send_binary(dev, cmd);
+    return;
+  }
+  send_to_slave(request_cmd(buf, dev, cmd));
+}
+
+
+/*
+  Try to receive a reply from a slave.
+
+  The bytes are collected and framed by the UART interrupt handler (see
+  bus_rx.c); here we just sleep until a complete frame is available or one of
+  the timeouts expires.
+
+  The times measured for the response are stored in *t, for updating the
+  timing estimates.
+
+  Returns the frame, already parsed, which stays valid until the next
+  receive. Returns NULL in case of timeout.
+*/
+static const struct frame *
+receive_from_slave(const struct timeouts *to, struct timeouts *t)
+{
+  const struct frame *f;
+  uint32_t rx_bytes, last_rx_bytes;
+  uint64_t start_time, last_char_time, now_time;
+  uint32_t got_first = 0;
+
+  /*
+    Drop any existing junk received before switching to receive mode on the
+    RS485 line.
+  */
+  bus_rx_flush(eng->bus);
+  last_rx_bytes = bus_rx_bytes[eng->bus];
+
+turnaround_delay();
+  rs485_rx_mode(eng->bus);
+turnaround_delay();
+  start_time = last_char_time = current_time_us();
+  t->first = 0;
+  t->gap = 0;
+  for (;;)
+  {
+    if ((f = bus_rx_get_frame(eng->bus)))
+      break;
+    now_time = current_time_us();
+    rx_bytes = bus_rx_bytes[eng->bus];
+    if (rx_bytes != last_rx_bytes)
+    {
+      if (!got_first)
+      {
+        t->first = now_time - start_time;
+        got_first = 1;
+      }
+      else if (now_time - last_char_time > t->gap)
+        t->gap = now_time - last_char_time;
+      last_rx_bytes = rx_bytes;
+      last_char_time = now_time;
+    }
+    else if (now_time - last_char_time >= (got_first ? to->gap : to->first))
+      goto timeout;
+    if (now_time - start_time >= TIMEOUT_RESPONSE)
+      goto timeout;
+    engine_wait();
+  }
+
+  /*
+    Give the slave device 2 milliseconds to release transmit mode on the RS485
+    line.
+  */
+  engine_delay(2);
+
+  return f;
+
+timeout:
+  ++timeout_stats.timeouts;
+  timeout_stats.wait_us += current_time_us() - start_time;
+  return NULL;
+}
+
+
+/* Fold one measurement into a smoothed average and mean deviation. */
+static void
+timing_sample(uint16_t *avg, uint16_t *dev, uint32_t val)
+{
+  int32_t err;
+
+  if (val > TIMEOUT_CHAR)
+    val = TIMEOUT_CHAR;
+  if (!*avg)
+  {
+    /* First sample. */
+    *avg = val;
+    *dev = val / 2;
+    return;
+  }
+  err = (int32_t)val - *avg;
+  *avg += err / 8;
+  if (err < 0)
+    err = -err;
+  *dev += (err - *dev) / 4;
+}
+
+
+static void
+timing_update(struct timing *p, const struct timeouts *t)
+{
+  /* A zero average means untrained, so count a zero time as 1 usec. */
+  timing_sample(&p->first_avg, &p->first_dev, t->first ? t->first : 1);
+  timing_sample(&p->gap_avg, &p->gap_dev, t->gap ? t->gap : 1);
+}
+
+
+static void
+timing_backoff(struct timing *p)
+{
+  if (!p->first_avg)
+    return;
+  p->first_dev = p->first_dev < TIMEOUT_CHAR ?
+    2*p->first_dev + TIMEOUT_MARGIN : TIMEOUT_CHAR;
+  p->gap_dev = p->gap_dev < TIMEOUT_CHAR ? 2*p->gap_dev + TIMEOUT_MARGIN :
+    TIMEOUT_CHAR;
+}
+
+
+static uint32_t
+timeout_from(uint32_t avg, uint32_t dev)
+{
+  uint32_t to;
+
+  if (!avg)
+    return TIMEOUT_CHAR;
+  to = avg + TIMEOUT_DEV_MULT*dev + TIMEOUT_MARGIN;
+  if (to < TIMEOUT_MIN)
+    to = TIMEOUT_MIN;
+  if (to > TIMEOUT_CHAR)
+    to = TIMEOUT_CHAR;
+  return to;
+}
+
+
+static void
+timeouts_from(const struct timing *p, struct timeouts *to)
+{
+  to->first = timeout_from(p->first_avg, p->first_dev);
+  to->gap = timeout_from(p->gap_avg, p->gap_dev);
+}
+
+
+/* Set the bus UART to rate index r, if it is not there already. */
+static void
+use_rate(uint32_t r)
+{
+  uint32_t div = bus_divisors[r];
+
+  if (r == eng->cur_rate && eng->bus_byte_us)
+    return;
+  bus_set_baud(eng->bus, BAUD_CLOCK / div);
+  eng->cur_rate = r;
+  eng->bus_byte_us = (10*1000000*div + BAUD_CLOCK - 1) / BAUD_CLOCK;
+}
+
+
+/*
+  Rate to use for the next request to an active device. While it is failing
+  to respond, every other request goes out at the other rate it may be at:
+  the legacy rate if it went back there by itself, or the bus rate if it did
+  switch but we missed its answer.
+*/
+static uint32_t
+device_rate(uint32_t dev)
+{
+  struct devdata *p = &eng->devices[dev];
+
+  if (p->active_count <= MAX_FAIL_RESPOND/2 && (p->active_count & 1))
+    return p->rate ? 0 : eng->bus_rate;
+  return p->rate;
+}
+
+
+/* Timeouts for a request to dev at rate r. */
+static void
+device_timeouts(uint32_t dev, uint32_t r, struct timeouts *to)
+{
+  if (r == eng->devices[dev].rate)
+    timeouts_from(&eng->devices[dev].timing, to);
+  else
+    to->first = to->gap = TIMEOUT_CHAR;
+}
+
+
+/*
+  Expected time in milliseconds for a request at rate r with first byte
+  timeout first_us and a response of at most len bytes, see
+  DISCOVER_COST_RESPONSE.
+*/
+static uint32_t
+request_cost(uint32_t r, uint32_t first_us, uint32_t len)
+{
+  uint32_t byte_us =
+    (10*1000000*bus_divisors[r] + BAUD_CLOCK - 1) / BAUD_CLOCK;
+
+  return (first_us + DISCOVER_COST_RESPONSE(len, byte_us) + 999)/1000;
+}
+
+
+/*
+  Check if a request expected to take cost milliseconds can be sent now
+  without delaying the next poll, or delaying it by at most
+  DISCOVER_POLL_SLACK if we have been held back since *blocked_since for
+  DISCOVER_STARVED milliseconds.
+*/
+static uint32_t
+fits_before_poll(uint64_t now, uint32_t cost, uint64_t *blocked_since)
+{
+  uint32_t poll_dev;
+  uint64_t deadline = sched_peek(&eng->poll_sched, &poll_dev);
+
+  if (*blocked_since && now - *blocked_since >= DISCOVER_STARVED)
+    deadline += DISCOVER_POLL_SLACK;
+  if (deadline < now + cost)
+  {
+    if (!*blocked_since)
+      *blocked_since = now;
+    return 0;
+  }
+  *blocked_since = 0;
+  return 1;
+}
+
+
+/*
+  (Re-)schedule the next poll of an active device, based on the time of its
+  last poll and its poll interval. A device that was never polled is due
+  immediately.
+*/
+static void
+schedule_poll(uint32_t dev)
+{
+  struct devdata *p = &eng->devices[dev];
+
+  if (!p->last_poll_time)
+    sched_set(&eng->poll_sched, dev, 0);
+  else
+    sched_set(&eng->poll_sched, dev,
+              p->last_poll_time + 1000*(uint64_t)p->poll_interval);
+}
+
+
+/* The list of devices with poll interval interval, or NULL if none. */
+static struct latch_group *
+group_find(uint32_t interval)
+{
+  uint32_t g;
+
+  for (g = 0; g < LATCH_GROUPS; ++g)
+    if (eng->groups[g].interval == interval)
+      return &eng->groups[g];
+  return NULL;
+}
+
+
+/*
+  Put dev, an active device in no list, in the list of the devices with its
+  poll interval, starting the list if there is none yet and one is free.
+*/
+static void
+group_join(uint32_t dev)
+{
+  struct devdata *p = &eng->devices[dev];
+  struct latch_group *g;
+
+  if (!p->poll_interval)
+    return;
+  if (!(g = group_find(p->poll_interval)))
+  {
+    if (!(g = group_find(0)))
+      return;
+    g->interval = p->poll_interval;
+    g->head = MAX_DEVICE;
+  }
+  p->group_next = g->head;
+  g->head = dev;
+}
+
+
+/*
+  Take dev out of the list of its poll interval, before the interval
+  changes or the device goes inactive.
+*/
+static void
+group_leave(uint32_t dev)
+{
+  struct devdata *p = &eng->devices[dev];
+  struct latch_group *g;
+  uint16_t *link;
+
+  if (p->group_next == GROUP_NONE)
+    return;
+  g = group_find(p->poll_interval);
+  for (link = &g->head; *link != dev; link = &eng->devices[*link].group_next)
+    ;
+  *link = p->group_next;
+  p->group_next = GROUP_NONE;
+  if (g->head == MAX_DEVICE)
+    g->interval = 0;
+}
+
+
+static void
+devset_add(struct devset *s, uint32_t dev)
+{
+  uint32_t bit = (uint32_t)1 << (dev % 32);
+
+  if (!(s->bits[dev/32] & bit))
+  {
+    s->bits[dev/32] |= bit;
+    ++s->count;
+  }
+}
+
+
+static void
+devset_remove(struct devset *s, uint32_t dev)
+{
+  uint32_t bit = (uint32_t)1 << (dev % 32);
+
+  if (s->bits[dev/32] & bit)
+  {
+    s->bits[dev/32] &= ~bit;
+    --s->count;
+  }
+}
+
+
+static uint32_t
+devset_has(const struct devset *s, uint32_t dev)
+{
+  return (s->bits[dev/32] >> (dev % 32)) & 1;
+}
+
+
+/* Put all devices in s; those with nothing to do are dropped as found. */
+static void
+devset_fill(struct devset *s)
+{
+  uint32_t dev;
+
+  for (dev = 0; dev < MAX_DEVICE; ++dev)
+    devset_add(s, dev);
+}
+
+
+/* The first device in s from dev on, or MAX_DEVICE if none. */
+static uint32_t
+devset_next(const struct devset *s, uint32_t dev)
+{
+  uint32_t w, bits;
+
+  if (!s->count || dev >= MAX_DEVICE)
+    return MAX_DEVICE;
+  w = dev/32;
+  bits = s->bits[w] & ~(((uint32_t)1 << (dev % 32)) - 1);
+  while (!bits)
+  {
+    if (++w >= (MAX_DEVICE + 31)/32)
+      return MAX_DEVICE;
+    bits = s->bits[w];
+  }
+  return w*32 + __builtin_ctz(bits);
+}
+
+
+/*
+  Count the rates of active device dev in (d = 1) or out (d = -1) of
+  rate_unknown and rate_lacking[], around a change of its rate_mask or of
+  whether it is active.
+*/
+static void
+rate_count(uint32_t dev, int32_t d)
+{
+  uint32_t mask = eng->devices[dev].rate_mask;
+  uint32_t i;
+
+  if (!mask)
+    eng->rate_unknown += d;
+  else
+    for (i = 0; i < NUM_BUS_RATES; ++i)
+      if (!(mask & (1 << i)))
+        eng->rate_lacking[i] += d;
+}
+
+
+/*
+  Slot of the device with extended address id, or MAX_DEVICE if none; with
+  id 0, the first free slot. Only needed when enumeration finds a device,
+  so a plain search will do.
+*/
+static uint32_t
+ext_find(uint32_t id)
+{
+  uint32_t dev;
+
+  for (dev = MAX_LEGACY_ID;
+       dev < MAX_DEVICE && eng->devices[dev].id != id; ++dev)
+    ;
+  return dev;
+}
+
+
+/* Give a free slot to extended address id; MAX_DEVICE if there is none. */
+static uint32_t
+ext_alloc(uint32_t id)
+{
+  uint32_t dev = ext_find(0);
+
+  if (dev < MAX_DEVICE)
+  {
+    eng->devices[dev].id = id;
+    eng->discover_backoff[dev] = 0;
+    eng->discover_probes[dev] = 0;
+    ++eng->ext_used;
+  }
+  return dev;
+}
+
+
+/* Free the slot of an extended address whose device is not active. */
+static void
+ext_free(uint32_t dev)
+{
+  sched_remove(&eng->discover_sched, dev);
+  eng->devices[dev].id = 0;
+  --eng->ext_used;
+}
+
+
+static void
+device_not_responding (uint32_t dev, uint32_t force_report)
+{
+  if (eng->devices[dev].active_count > 0)
+  {
+    --eng->devices[dev].active_count;
+    if (eng->devices[dev].active_count == 0)
+    {
+      eng->devices[dev].last_poll_time = 0;
+      group_leave(dev);
+      eng->devices[dev].poll_interval = 0;
+      strpool_release(&dev_strings, &eng->devices[dev].description);
+      strpool_release(&dev_strings, &eng->devices[dev].unit);
+      devset_remove(&eng->no_room, dev);
+      memset(&eng->devices[dev].timing, 0, sizeof(eng->devices[dev].timing));
+      rate_count(dev, -1);
+      eng->devices[dev].rate = 0;
+      eng->devices[dev].rate_mask = 0;
+      eng->devices[dev].caps_tries = 0;
+      eng->devices[dev].latch = LATCH_UNKNOWN;
+      eng->devices[dev].latch_tries = 0;
+      devset_remove(&eng->slots_lost, dev);
+      eng->devices[dev].frame = 0;
+      eng->rate_dirty = 1;
+      sched_remove(&eng->poll_sched, dev);
+      device_changed(dev);
+      device_inactive(dev);
+      if (dev >= MAX_LEGACY_ID)
+        ext_free(dev);
+      else
+      {
+        eng->discover_backoff[dev] = 0;
+        sched_set(&eng->discover_sched, dev, 0);
+      }
+    }
+    else
+    {
+      timing_backoff(&eng->devices[dev].timing);
+      if (eng->devices[dev].active_count == MAX_FAIL_RESPOND/2)
+        eng->devices[dev].frame = 0;
+      if (eng->devices[dev].active_count == MAX_FAIL_RESPOND/2 &&
+          eng->devices[dev].rate > 0 &&
+          eng->devices[dev].rate - 1 < eng->rate_ceiling)
+      {
+        /* Error burst at a fast rate. */
+        eng->rate_ceiling = eng->devices[dev].rate - 1;
+        eng->rate_hold_until = current_time() + BAUD_HOLD;
+        eng->rate_dirty = 1;
+        println_msg_uint32("Bus errors, limiting speed for device ",
+                           host_id(eng->devices[dev].id));
+      }
+    }
+  }
+  else if (force_report)
+    device_inactive(dev);
+}
+
+
+/*
+  A response was received from dev at rate r; note the rate the device is
+  at, and update the timing estimates.
+*/
+static void
+device_responded(uint32_t dev, uint32_t r, const struct timeouts *t)
+{
+  struct devdata *p = &eng->devices[dev];
+
+  if (r != p->rate)
+  {
+    p->rate = r;
+    memset(&p->timing, 0, sizeof(p->timing));
+    eng->rate_dirty = 1;
+    devset_add(&eng->baud_todo, dev);
+  }
+  timing_update(&p->timing, t);
+  if (r == 0)
+    timing_update(&eng->bus_timing, t);
+}
+
+
+/*
+  Check that the received frame f (NULL for none) is a valid response to
+  cmd, in either frame format, and return the device id in it. Returns 0
+  if not valid.
+*/
+static uint32_t
+check_response(const struct frame *f, uint32_t cmd, uint32_t *id)
+{
+  if (!f || f->status == FRAME_BAD || f->cmd != cmd)
+    return 0;
+  if (f->status == FRAME_BAD_CRC)
+  {
+    println_msg_uint32("CRC mismatch on device ", host_id(f->id));
+    return 0;
+  }
+  *id = f->id;
+  return 1;
+}
+
+
+/*
+  Send a discover request to a device id at rate r and update the device
+  table from the response, waiting for it with the timeouts in *to. Returns
+  1 if the device responded, 0 if not.
+*/
+static uint32_t
+do_discover(uint32_t dev, uint32_t force_report, uint32_t r,
+            const struct timeouts *to)
+{
+  char buf[16];
+  struct timeouts t;
+  const struct frame *f;
+  const char *descr, *unit;
+  uint32_t descr_len, unit_len;
+  uint32_t poll_interval, frame, rcv_dev, k;
+  uint32_t changed = 0;
+
+  /* Binary frames have no room for an extended address. */
+  if (eng->devices[dev].id < MAX_LEGACY_ID)
+    fmt_str(fmt_uint32(fmt_str(request_start(buf, dev), "Db"), BIN_VERSION),
+            "|");
+  else
+    fmt_str(request_start(buf, dev), "D|");
+
+  use_rate(r);
+  led_on();
+  send_to_slave(buf);
+  led_off();
+  f = receive_from_slave(to, &t);
+
+  /* "!xx:D<poll interval>|<description>|<unit>|" */
+  if (!check_response(f, 'D', &rcv_dev) || rcv_dev != eng->devices[dev].id ||
+      f->binary || f->num_fields < 3 || !(f->field[0].syntax & FRAME_UINT))
+    goto badresponse;
+  poll_interval = frame_uint(frame_text(f, 0), f->field[0].len);
+  descr = frame_text(f, 1);
+  descr_len = f->field[1].len;
+  if (descr_len > MAX_DESCRIPTION)
+    goto badresponse;
+  unit = frame_text(f, 2);
+  unit_len = f->field[2].len;
+  if (unit_len > MAX_UNIT)
+    goto badresponse;
+
+  /* Optional fields follow, "b<V>|" for binary frames. */
+  frame = 0;
+  for (k = 3; k < f->num_fields && eng->devices[dev].id < MAX_LEGACY_ID; ++k)
+    if (f->field[k].len && frame_text(f, k)[0] == 'b')
+      frame = frame_uint(frame_text(f, k) + 1, f->field[k].len - 1);
+
+  /* Ok, device responded to discover request. Save its data. */
+  device_responded(dev, r, &t);
+  if (!eng->devices[dev].active_count)
+  {
+    eng->devices[dev].last_poll_time = 0;
+    eng->rate_dirty = 1;
+    changed = 1;
+    rate_count(dev, 1);
+    devset_add(&eng->baud_todo, dev);
+    devset_add(&eng->latch_todo, dev);
+  }
+  eng->devices[dev].active_count = MAX_FAIL_RESPOND;
+  if (poll_interval != eng->devices[dev].poll_interval)
+  {
+    changed = 1;
+    group_leave(dev);
+    eng->devices[dev].poll_interval = poll_interval;
+  }
+  /* Also tried again while the lists were all taken. */
+  if (eng->devices[dev].group_next == GROUP_NONE)
+    group_join(dev);
+  if (!strpool_equal(&dev_strings, eng->devices[dev].description,
+                     descr, descr_len) ||
+      !strpool_equal(&dev_strings, eng->devices[dev].unit, unit, unit_len))
+  {
+    /*
+      If the pool is full, the device keeps the strings it had, and is
+      reported with them; we try again at the next discover request, but
+      say so only the first time.
+    */
+    if (strpool_set_pair(&dev_strings, &eng->devices[dev].description,
+                         descr, descr_len, &eng->devices[dev].unit, unit,
+                         unit_len))
+    {
+      changed = 1;
+      devset_remove(&eng->no_room, dev);
+    }
+    else if (!devset_has(&eng->no_room, dev))
+    {
+      devset_add(&eng->no_room, dev);
+      println_msg_uint32("No room for the strings of device ",
+                         host_id(eng->devices[dev].id));
+    }
+  }
+  eng->devices[dev].frame = frame < BIN_VERSION ? frame : BIN_VERSION;
+  schedule_poll(dev);
+
+  if (changed)
+    device_changed(dev);
+  if (changed || force_report)
+    device_active(dev);
+
+  return 1;
+
+badresponse:
+  device_not_responding(dev, force_report);
+  return 0;
+}
+
+
+/*
+  Write the binary value at p as text to out, which must hold
+  FMT_FLOAT_MAX bytes, the way a device would print it. Returns the length
+  of the text, or 0 for an unknown value type.
+*/
+static uint32_t
+binary_value(const uint8_t *p, char *out)
+{
+  uint32_t type = p[0];
+  uint32_t v = p[1] | ((uint32_t)p[2] << 8) | ((uint32_t)p[3] << 16) |
+    ((uint32_t)p[4] << 24);
+  float f;
+
+  if (type == BIN_INT)
+    return fmt_int32(out, (int32_t)v) - out;
+  else if (type == BIN_FLOAT)
+  {
+    memcpy(&f, &v, sizeof(f));
+    return fmt_float(out, f) - out;
+  }
+  else
+    return 0;
+}
+
+
+/*
+  Check the received frame f for a valid poll answer in either frame
+  format, and return the device id in it and the value in *v. Returns 0 if
+  not valid.
+*/
+static uint32_t
+poll_answer(const struct frame *f, uint32_t *id, struct value *v)
+{
+  if (!check_response(f, 'P', id))
+    return 0;
+  if (f->binary)
+  {
+    if (f->field[0].len != BIN_VALUE_LEN ||
+        !(v->len = binary_value((const uint8_t *)frame_text(f, 0), v->buf)))
+      return 0;
+    v->str = v->buf;
+    return 1;
+  }
+  /* The value, a number, is the only field. */
+  if (f->num_fields != 1 || !(f->field[0].syntax & FRAME_NUMBER))
+    return 0;
+  v->str = frame_text(f, 0);
+  v->len = f->field[0].len;
+  return 1;
+}
+
+
+static void
+do_poll(uint32_t dev)
+{
+  const struct frame *f;
+  struct value v;
+  uint32_t rcv_dev;
+  uint64_t start_time;
+  struct timeouts to, t;
+  uint32_t r;
+
+  start_time = current_time();
+  r = device_rate(dev);
+  device_timeouts(dev, r, &to);
+  /*
+    The timing so far is from discover requests only, or for a device in a
+    latch group from read-outs, and a poll also needs time for taking the
+    sample. Too short a timeout would also make us take its late answer
+    for the answer to the next request.
+  */
+  if (!eng->devices[dev].last_poll_time ||
+      eng->devices[dev].latch == LATCH_YES ||
+      eng->devices[dev].latch == LATCH_SLOTS)
+    to.first = TIMEOUT_CHAR;
+
+  use_rate(r);
+  led_on();
+  send_request(dev, 'P');
+  led_off();
+  f = receive_from_slave(&to, &t);
+
+  if (!f)
+  {
+    println_msg_uint32("Timeout from poll on device ",
+                       host_id(eng->devices[dev].id));
+    goto badresponse;
+  }
+
+  if (!poll_answer(f, &rcv_dev, &v) || rcv_dev != eng->devices[dev].id)
+    goto badresponse;
+
+  /* Ok, device responded to poll request. */
+  device_responded(dev, r, &t);
+  eng->devices[dev].active_count = MAX_FAIL_RESPOND;
+  device_poll_result(dev, &v, start_time);
+  eng->devices[dev].last_poll_time = start_time;
+  schedule_poll(dev);
+
+  return;
+
+badresponse:
+  /*
+    Do not reset the poll time the first few times that the device fails
+    to respond to poll; this way we will re-poll the device immediately
+    a couple of times before falling back to periodic poll (and eventually
+    to giving up and declaring the device inactive).
+  */
+  if (eng->devices[dev].active_count <= MAX_FAIL_RESPOND/2)
+  {
+    eng->devices[dev].last_poll_time = start_time;
+    schedule_poll(dev);
+  }
+  else
+  {
+    /*
+      Re-poll in the next pass of the main loop. Being due now, rather than
+      at the original due time, makes the device wait behind any others
+      already due, and makes it not due again in the current pass.
+    */
+    sched_set(&eng->poll_sched, dev, current_time());
+  }
+  device_not_responding(dev, 0);
+}
+
+
+/*
+  Send request req to dev at rate r, and check that the response is a valid
+  answer "!xx:<cmd>...|CRC" to it. Returns the response, with the argument
+  in its fields, or NULL if there was no valid response.
+*/
+static const struct frame *
+do_request(uint32_t dev, uint32_t r, const char *req, uint32_t cmd)
+{
+  struct timeouts to, t;
+  const struct frame *f;
+  uint32_t rcv_dev;
+
+  device_timeouts(dev, r, &to);
+  use_rate(r);
+  led_on();
+  send_to_slave(req);
+  led_off();
+  f = receive_from_slave(&to, &t);
+
+  if (!check_response(f, cmd, &rcv_dev) || rcv_dev != eng->devices[dev].id ||
+      f->binary)
+    return NULL;
+  device_responded(dev, r, &t);
+  return f;
+}
+
+
+/* Ask an active device which bus rates it supports. */
+static void
+do_capabilities(uint32_t dev)
+{
+  struct devdata *p = &eng->devices[dev];
+  char buf[10];
+  const struct frame *f;
+  const char *arg, *end, *q;
+  uint32_t i, div, mask;
+
+  request_cmd(buf, dev, 'B');
+  if (!(f = do_request(dev, p->rate, buf, 'B')))
+  {
+    /* Old firmware does not answer at all. */
+    if (++p->caps_tries < BAUD_CAPS_TRIES)
+      return;
+    mask = 1;
+  }
+  else
+  {
+    /* "<div>,<div>,..." */
+    mask = 1;
+    arg = frame_text(f, 0);
+    end = arg + f->field[0].len;
+    while (arg < end)
+    {
+      for (q = arg; q < end && *q >= '0' && *q <= '9'; ++q)
+        ;
+      if (q == arg)
+        break;
+      div = frame_uint(arg, q - arg);
+      for (i = 0; i < NUM_BUS_RATES; ++i)
+        if (bus_divisors[i] == div)
+          mask |= 1 << i;
+      arg = (q < end && *q == ',') ? q + 1 : q;
+    }
+  }
+  rate_count(dev, -1);
+  p->rate_mask = mask;
+  rate_count(dev, 1);
+}
+
+
+/* Move an active device to the rate bus_rate, and confirm the switch. */
+static void
+do_set_rate(uint32_t dev)
+{
+  struct devdata *p = &eng->devices[dev];
+  uint32_t old_rate = p->rate;
+  char buf[24];
+  const struct frame *f;
+  uint32_t i;
+
+  fmt_str(fmt_uint32(fmt_str(request_start(buf, dev), "R"),
+                     bus_divisors[eng->bus_rate]), "|");
+  if (!(f = do_request(dev, old_rate, buf, 'R')) ||
+      !(f->field[0].syntax & FRAME_UINT) ||
+      frame_uint(frame_text(f, 0), f->field[0].len) !=
+      bus_divisors[eng->bus_rate])
+  {
+    device_not_responding(dev, 0);
+    return;
+  }
+  p->rate = eng->bus_rate;
+  memset(&p->timing, 0, sizeof(p->timing));
+
+  /*
+    The device takes any request it hears at the new rate as confirmation,
+    even if we miss its answer; so try twice before assuming it went back.
+  */
+  for (i = 0; i < 2; ++i)
+  {
+    request_cmd(buf, dev, 'B');
+    if (do_request(dev, p->rate, buf, 'B'))
+      return;
+  }
+
+  /* The device will go back to the old rate by itself. */
+  p->rate = old_rate;
+  memset(&p->timing, 0, sizeof(p->timing));
+  devset_add(&eng->baud_todo, dev);
+  eng->rate_wait_until = current_time() + 2*BAUD_CONFIRM;
+  if (eng->bus_rate > old_rate && eng->bus_rate - 1 < eng->rate_ceiling)
+  {
+    eng->rate_ceiling = eng->bus_rate - 1;
+    eng->rate_hold_until = current_time() + BAUD_HOLD;
+    println_msg_uint32("Bus speed not confirmed by device ",
+                       host_id(eng->devices[dev].id));
+  }
+  eng->rate_dirty = 1;
+}
+
+
+/*
+  Work towards having all active devices at the fastest rate they all
+  support: ask devices for their capabilities, then switch them one by one.
+  Only sends a request if it will not delay a poll. Returns 1 if a request
+  was sent.
+*/
+static uint32_t
+baud_next(void)
+{
+  uint32_t i, mask, target, todo, waiting, cost;
+  uint64_t now = current_time();
+  struct timeouts to;
+
+  if (eng->rate_ceiling < NUM_BUS_RATES - 1 && now >= eng->rate_hold_until)
+  {
+    eng->rate_ceiling = NUM_BUS_RATES - 1;
+    eng->rate_dirty = 1;
+  }
+  if (!eng->rate_dirty || now < eng->rate_wait_until)
+    return 0;
+
+  /*
+    Find the fastest rate supported by all active devices, and the first
+    device that needs asking or switching. Devices that currently fail to
+    respond are left alone until they recover. Do not change speed until
+    we know about all devices.
+  */
+  mask = 0;
+  if (!eng->rate_unknown)
+  {
+    mask = (1 << (eng->rate_ceiling + 1)) - 1;
+    for (i = 0; i < NUM_BUS_RATES; ++i)
+      if (eng->rate_lacking[i])
+        mask &= ~(1 << i);
+  }
+  if (mask)
+  {
+    for (target = NUM_BUS_RATES - 1; !(mask & (1 << target)); --target)
+      ;
+    if (target != eng->bus_rate)
+    {
+      eng->bus_rate = target;
+      devset_fill(&eng->baud_todo);
+      println_msg_uint32("Bus speed, baud ",
+                         BAUD_CLOCK / bus_divisors[target]);
+    }
+  }
+  waiting = 0;
+  for (todo = devset_next(&eng->baud_todo, 0); todo < MAX_DEVICE;
+       todo = devset_next(&eng->baud_todo, todo + 1))
+  {
+    struct devdata *p = &eng->devices[todo];
+
+    if (!p->active_count || (p->rate_mask && p->rate == eng->bus_rate))
+      devset_remove(&eng->baud_todo, todo);
+    else if (p->active_count < MAX_FAIL_RESPOND)
+      waiting = 1;
+    else if (!p->rate_mask || mask)
+      break;
+  }
+  if (todo == MAX_DEVICE)
+  {
+    /* Nothing to do until something changes. */
+    if (!waiting)
+      eng->rate_dirty = 0;
+    return 0;
+  }
+
+  /* A switch is two short requests, the second one at the new rate. */
+  device_timeouts(todo, eng->devices[todo].rate, &to);
+  cost = request_cost(eng->devices[todo].rate, to.first, 40);
+  if (eng->devices[todo].rate_mask)
+    cost += 2*request_cost(eng->bus_rate, TIMEOUT_CHAR, 40);
+  if (!fits_before_poll(now, cost, &eng->baud_blocked))
+    return 0;
+  if (!eng->devices[todo].rate_mask)
+    do_capabilities(todo);
+  else
+    do_set_rate(todo);
+  return 1;
+}
+
+
+/*
+  Check the received frame f for a valid read-out answer in either frame
+  format, and return the device id in it. Returns 2 if it is sample number
+  seq, with the value in *v; 1 if it is a stale sample or an invalid value;
+  0 if the frame is not valid.
+*/
+static uint32_t
+latched_answer(const struct frame *f, uint32_t seq, uint32_t *id,
+               struct value *v)
+{
+  const struct frame_field *fl = &f->field[0];
+  const uint8_t *payload;
+
+  if (!check_response(f, 'Q', id))
+    return 0;
+  if (f->binary)
+  {
+    payload = (const uint8_t *)frame_text(f, 0);
+    if (fl->len != 1 + BIN_VALUE_LEN || payload[0] != seq ||
+        !(v->len = binary_value(payload + 1, v->buf)))
+      return 1;
+    v->str = v->buf;
+    return 2;
+  }
+  /* "<seq>,<value>" */
+  if (f->num_fields != 1 || !(fl->syntax & FRAME_SEQ_NUMBER) ||
+      frame_uint(frame_text(f, 0), fl->split) != seq)
+    return 1;
+  v->str = frame_text(f, 0) + fl->split + 1;
+  v->len = fl->len - fl->split - 1;
+  return 2;
+}
+
+
+static void
+latched_result(uint32_t dev, const struct value *v, uint64_t latch_time)
+{
+  device_poll_result(dev, v, latch_time);
+  eng->devices[dev].last_poll_time = latch_time;
+  schedule_poll(dev);
+}
+
+
+/*
+  Read out the sample that dev latched as number seq at time latch_time.
+  Returns 1 if done, 0 if the device did not answer with that sample; the
+  caller should then poll it the normal way.
+*/
+static uint32_t
+do_read_latched(uint32_t dev, uint32_t seq, uint64_t latch_time)
+{
+  struct devdata *p = &eng->devices[dev];
+  const struct frame *f;
+  struct value v;
+  struct timeouts to, t;
+  uint32_t rcv_dev, res;
+
+  device_timeouts(dev, p->rate, &to);
+  use_rate(p->rate);
+  led_on();
+  send_request(dev, 'Q');
+  led_off();
+  f = receive_from_slave(&to, &t);
+
+  res = latched_answer(f, seq, &rcv_dev, &v);
+  if (!res || rcv_dev != eng->devices[dev].id)
+  {
+    /*
+      The first read-out after the broadcast waits for the sample to be
+      taken, which may be longer than the device takes to answer other
+      requests; wait longer next time, as for a failed poll.
+    */
+    timing_backoff(&p->timing);
+    return 0;
+  }
+  device_responded(dev, p->rate, &t);
+
+  /* A different sample number means the device missed the broadcast. */
+  if (res != 2)
+    return 0;
+  latched_result(dev, &v, latch_time);
+  return 1;
+}
+
+
+/*
+  Get a value from dev, a member of a latch group whose sample number seq
+  was latched at time latch_time, when it was not read out yet: read it out
+  with its own request, and if that fails, poll it. The next poll is still
+  scheduled with the rest of the group, so it stays in step.
+*/
+static void
+read_or_poll(uint32_t dev, uint32_t seq, uint64_t latch_time)
+{
+  if (do_read_latched(dev, seq, latch_time))
+    return;
+  do_poll(dev);
+  if (eng->devices[dev].active_count == MAX_FAIL_RESPOND)
+  {
+    eng->devices[dev].last_poll_time = latch_time;
+    schedule_poll(dev);
+  }
+}
+
+
+/*
+  Slotted read-out of sample number seq, latched at time latch_time, from
+  the n devices in devs[], all at the bus rate.
+
+  The answers are collected until the last slot has passed, or a bit longer
+  if one is still being received then. Each valid answer with sample seq is
+  reported; done[k] is set to 2 for those, to 1 for devices that answered
+  with a stale sample, and to 0 for devices with no valid answer.
+*/
+static void
+read_slots(const uint16_t *devs, uint32_t n, uint32_t seq, uint64_t latch_time,
+           uint8_t *done)
+{
+  /* "?ff:T<seq>,<lead>,<slot>,<ids>|" */
+  char buf[40 + 2*TDMA_MAX_SLOTS];
+  char *p;
+  const struct frame *f;
+  struct value v;
+  struct timeouts to;
+  uint32_t k, lead, slot, frame_len, id, res, got;
+  uint32_t rx_bytes, last_rx_bytes;
+  uint64_t now, end_time, last_char_time;
+
+  use_rate(eng->bus_rate);
+  lead = 0;
+  frame_len = TDMA_BIN_FRAME;
+  for (k = 0; k < n; ++k)
+  {
+    device_timeouts(devs[k], eng->bus_rate, &to);
+    if (to.first > lead)
+      lead = to.first;
+    if (!eng->devices[devs[k]].frame)
+      frame_len = TDMA_FRAME;
+    done[k] = 0;
+  }
+  slot = frame_len*eng->bus_byte_us + TDMA_GUARD;
+  p = fmt_uint32(fmt_str(buf, "?ff:T"), seq);
+  p = fmt_uint32(fmt_str(p, ","), lead);
+  p = fmt_uint32(fmt_str(p, ","), slot);
+  p = fmt_str(p, ",");
+  for (k = 0; k < n; ++k)
+    p = fmt_hex8(p, eng->devices[devs[k]].id);
+  fmt_str(p, "|");
+
+  led_on();
+  send_to_slave(buf);
+  led_off();
+  bus_rx_flush(eng->bus);
+  last_rx_bytes = bus_rx_bytes[eng->bus];
+  last_char_time = current_time_us();
+  end_time = last_char_time + lead + n*slot;
+
+  got = 0;
+  for (;;)
+  {
+    while ((f = bus_rx_get_frame(eng->bus)))
+    {
+      if (!(res = latched_answer(f, seq, &id, &v)))
+        continue;
+      for (k = 0; k < n && eng->devices[devs[k]].id != id; ++k)
+        ;
+      if (k == n || done[k])
+        continue;
+      ++got;
+      done[k] = res;
+      if (res == 2)
+        latched_result(devs[k], &v, latch_time);
+    }
+    if (got == n)
+      break;
+    now = current_time_us();
+    rx_bytes = bus_rx_bytes[eng->bus];
+    if (rx_bytes != last_rx_bytes)
+    {
+      last_rx_bytes = rx_bytes;
+      last_char_time = now;
+    }
+    else if (now >= end_time && now - last_char_time >= TIMEOUT_MIN)
+      break;
+    engine_wait();
+  }
+
+  /* Give the last slave time to release transmit mode, as for a response. */
+  engine_delay(2);
+}
+
+
+/*
+  Read out a latched sample from the devices in devs[] with slots, and the
+  normal way from any that did not answer in their slot.
+*/
+static void
+poll_slots(const uint16_t *devs, uint32_t n, uint32_t seq, uint64_t latch_time)
+{
+  uint8_t done[TDMA_MAX_SLOTS];
+  uint32_t k;
+
+  read_slots(devs, n, seq, latch_time, done);
+  for (k = 0; k < n; ++k)
+  {
+    struct devdata *p = &eng->devices[devs[k]];
+
+    if (done[k] == 2)
+    {
+      p->latch_tries = 0;
+      continue;
+    }
+    if (!done[k] && ++p->latch_tries >= LATCH_TRIES)
+    {
+      p->latch = LATCH_YES;
+      devset_add(&eng->slots_lost, devs[k]);
+      eng->slots_hold_until = current_time() + LATCH_HOLD;
+    }
+    read_or_poll(devs[k], seq, latch_time);
+  }
+}
+
+
+/*
+  Check if dev can be polled in a latched group with poll interval interval
+  due before the time limit. Only devices that answer reliably at the bus
+  rate, where the broadcast goes out, are included.
+*/
+static uint32_t
+latch_member(uint32_t dev, uint32_t interval, uint64_t limit)
+{
+  struct devdata *p = &eng->devices[dev];
+
+  return p->active_count == MAX_FAIL_RESPOND &&
+    (p->latch == LATCH_YES || p->latch == LATCH_SLOTS) &&
+    p->poll_interval == interval && p->rate == eng->bus_rate &&
+    eng->poll_sched.due_time[dev] <= limit;
+}
+
+
+/*
+  Poll dev, which is due now, together with all other devices in its latch
+  group, if there are enough of them.
+
+  Devices in the group that are due within half a poll interval are polled
+  early, so that devices with the same interval end up in step with each
+  other. A device that is re-polled right after failing finds the rest of
+  its group just polled, and is polled on its own.
+
+  Only the list of devices with the same interval is looked at, once to
+  count the members and once to read them out. Reading out one member
+  does not change whether another one is a member, so both times give the
+  same group.
+*/
+static void
+poll_group(uint32_t dev)
+{
+  uint32_t interval = eng->devices[dev].poll_interval;
+  uint64_t limit = current_time() + 500*(uint64_t)interval;
+  uint64_t latch_time;
+  struct latch_group *g = NULL;
+  uint32_t i, next, f, members;
+  /* Devices for slotted read-out, with ASCII and with binary frames. */
+  uint16_t devs[2][TDMA_MAX_SLOTS];
+  uint32_t n[2];
+  /* "?ff:L<interval>,<seq>|" */
+  char buf[32];
+  char *p;
+
+  members = 0;
+  if (eng->devices[dev].group_next != GROUP_NONE &&
+      latch_member(dev, interval, limit))
+  {
+    g = group_find(interval);
+    for (i = g->head; i < MAX_DEVICE && members < LATCH_MIN_GROUP;
+         i = eng->devices[i].group_next)
+      if (latch_member(i, interval, limit))
+        ++members;
+  }
+  if (members < LATCH_MIN_GROUP)
+  {
+    do_poll(dev);
+    return;
+  }
+
+  eng->latch_seq = eng->latch_seq % LATCH_SEQ_MAX + 1;
+  p = fmt_uint32(fmt_str(buf, "?ff:L"), interval);
+  fmt_str(fmt_uint32(fmt_str(p, ","), eng->latch_seq), "|");
+  use_rate(eng->bus_rate);
+  led_on();
+  send_to_slave(buf);
+  led_off();
+  latch_time = current_time();
+
+  n[0] = n[1] = 0;
+  for (i = g->head; i < MAX_DEVICE; i = next)
+  {
+    next = eng->devices[i].group_next;
+    if (!latch_member(i, interval, limit))
+      continue;
+    if (eng->devices[i].latch != LATCH_SLOTS)
+    {
+      read_or_poll(i, eng->latch_seq, latch_time);
+      continue;
+    }
+    /* Kept apart, so binary frames get the shorter slots. */
+    f = eng->devices[i].frame != 0;
+    devs[f][n[f]++] = i;
+    if (n[f] == TDMA_MAX_SLOTS)
+    {
+      poll_slots(devs[f], n[f], eng->latch_seq, latch_time);
+      n[f] = 0;
+    }
+  }
+  for (f = 0; f < 2; ++f)
+    if (n[f])
+      poll_slots(devs[f], n[f], eng->latch_seq, latch_time);
+}
+
+
+/*
+  Probe the devices in slots_lost for slots again, as their hold is over.
+  Those that got them back, or are no longer active, are done with; the
+  others stay, to be tried again after another hold.
+*/
+static void
+slots_retry(uint64_t now)
+{
+  uint32_t dev;
+  struct devdata *p;
+
+  for (dev = devset_next(&eng->slots_lost, 0); dev < MAX_DEVICE;
+       dev = devset_next(&eng->slots_lost, dev + 1))
+  {
+    p = &eng->devices[dev];
+    if (p->latch != LATCH_YES)
+      devset_remove(&eng->slots_lost, dev);
+    else if (p->latch_tries >= LATCH_TRIES)
+    {
+      p->latch_tries = 0;
+      devset_add(&eng->latch_todo, dev);
+    }
+  }
+  eng->slots_hold_until = now + LATCH_HOLD;
+}
+
+
+/*
+  Find out if the next active device we do not know about supports latched
+  polling, with a read-out request, and then if it supports slots. Only
+  sends a request if it will not delay a poll. Returns 1 if a request was
+  sent.
+*/
+static uint32_t
+latch_probe_next(void)
+{
+  uint32_t dev, cost;
+  uint64_t now = current_time();
+  struct devdata *p;
+  struct timeouts to;
+  char buf[10];
+  uint16_t slot;
+  uint8_t done;
+
+  if (eng->slots_lost.count && now >= eng->slots_hold_until)
+    slots_retry(now);
+  for (dev = devset_next(&eng->latch_todo, 0); dev < MAX_DEVICE;
+       dev = devset_next(&eng->latch_todo, dev + 1))
+  {
+    p = &eng->devices[dev];
+    /* Nothing more to find out, until the device goes active again. */
+    if (!p->active_count ||
+        !(p->latch == LATCH_UNKNOWN ||
+          (p->latch == LATCH_YES && p->latch_tries < LATCH_TRIES &&
+           p->id < MAX_LEGACY_ID)))
+      devset_remove(&eng->latch_todo, dev);
+    else if (p->active_count == MAX_FAIL_RESPOND &&
+             (p->latch == LATCH_UNKNOWN || p->rate == eng->bus_rate))
+      break;
+  }
+  if (dev >= MAX_DEVICE)
+    return 0;
+
+  device_timeouts(dev, p->rate, &to);
+  cost = request_cost(p->rate, to.first, 40);
+  if (p->latch == LATCH_YES)
+    cost += (TDMA_FRAME*eng->bus_byte_us + TDMA_GUARD + 999)/1000;
+  if (!fits_before_poll(now, cost, &eng->latch_blocked))
+    return 0;
+
+  if (p->latch == LATCH_YES)
+  {
+    /* No broadcast uses this sample number, so nothing is reported. */
+    slot = dev;
+    read_slots(&slot, 1, LATCH_SEQ_MAX + 1, 0, &done);
+    if (done)
+    {
+      p->latch = LATCH_SLOTS;
+      p->latch_tries = 0;
+    }
+    else
+      ++p->latch_tries;
+    return 1;
+  }
+
+  request_cmd(buf, dev, 'Q');
+  if (do_request(dev, p->rate, buf, 'Q'))
+  {
+    p->latch = LATCH_YES;
+    p->latch_tries = 0;
+  }
+  else if (++p->latch_tries >= LATCH_TRIES)
+    p->latch = LATCH_NO;
+  return 1;
+}
+
+
+/*
+  Report poll scheduling lateness (time from a poll being due until it is
+  sent) since the last report, and the most stack any bus engine has used.
+*/
+static void
+report_poll_stats(void)
+{
+  char buf[80];
+  char *p;
+  uint32_t b, stack = 0;
+
+  for (b = 0; b < num_engines; ++b)
+    if (hal_engine_stack_used(b) > stack)
+      stack = hal_engine_stack_used(b);
+  p = fmt_uint32(fmt_str(buf, "Poll lateness ms: avg "), poll_stats.polls ?
+                 (uint32_t)(poll_stats.late_sum / poll_stats.polls) : 0);
+  p = fmt_uint32(fmt_str(p, " max "), (uint32_t)poll_stats.late_max);
+  p = fmt_uint32(fmt_str(p, " polls "), poll_stats.polls);
+  p = fmt_uint32(fmt_str(p, " stack "), stack);
+  fmt_str(p, "\n");
+  serial_output_str(buf);
+  poll_stats.polls = 0;
+  poll_stats.late_sum = 0;
+  poll_stats.late_max = 0;
+}
+
+
+/*
+  Bus time budget of discovery, see DISCOVER_BUDGET. It is accounted in
+  units of 1/1000 ms of bus time, so that even a single millisecond adds
+  some credit.
+*/
+
+/* Add the credit earned up to now; returns 1 if there is credit left. */
+static uint32_t
+discover_budget(uint64_t now)
+{
+  eng->discover_credit +=
+    (int64_t)(now - eng->discover_credit_time) * DISCOVER_BUDGET;
+  if (eng->discover_credit > DISCOVER_BURST*1000)
+    eng->discover_credit = DISCOVER_BURST*1000;
+  eng->discover_credit_time = now;
+  return eng->discover_credit >= 0;
+}
+
+
+/* Charge the bus time of a discovery request sent at start. */
+static void
+discover_spend(uint64_t start)
+{
+  uint64_t now = current_time();
+
+  eng->discover_credit -= (int64_t)(now - start) * 1000;
+  eng->discover_credit_time = now;
+}
+
+
+/*
+  Send the next discover request, if one is due, the budget allows it, and
+  it will not delay a poll. Returns 1 if a request was sent.
+*/
+static uint32_t
+discover_next(void)
+{
+  uint32_t dev, cost, was_active, r, interval;
+  uint64_t now, start;
+  struct timeouts to;
+
+  now = current_time();
+  if (!discover_budget(now))
+    return 0;
+
+  for (;;)
+  {
+    if (sched_peek(&eng->discover_sched, &dev) > now)
+      return 0;
+    /* Polled recently enough to keep it out of enumeration. */
+    if (dev < MAX_LEGACY_ID || !eng->devices[dev].active_count ||
+        eng->devices[dev].last_poll_time + ENUM_REFRESH <= now)
+      break;
+    sched_set(&eng->discover_sched, dev,
+              eng->devices[dev].last_poll_time + ENUM_REFRESH);
+  }
+  was_active = eng->devices[dev].active_count;
+  if (was_active)
+  {
+    r = device_rate(dev);
+    device_timeouts(dev, r, &to);
+  }
+  else
+  {
+    r = 0;
+    if ((eng->discover_probes[dev] + dev) % DISCOVER_LONG_PROBE == 0)
+      to.first = to.gap = TIMEOUT_CHAR;
+    else
+      timeouts_from(&eng->bus_timing, &to);
+  }
+  cost = request_cost(r, to.first, MAX_REQ);
+  if (!fits_before_poll(now, cost, &eng->discover_blocked))
+    return 0;
+  if (!was_active)
+    ++eng->discover_probes[dev];
+
+  start = now;
+  interval = dev < MAX_LEGACY_ID ? DISCOVER_ACTIVE_INTERVAL : ENUM_REFRESH;
+  if (do_discover(dev, 0, r, &to))
+  {
+    eng->discover_backoff[dev] = 0;
+    sched_set(&eng->discover_sched, dev, start + interval);
+  }
+  else if (eng->devices[dev].active_count)
+  {
+    /* Still counted active; the polls will tell if it is really gone. */
+    sched_set(&eng->discover_sched, dev, start + interval);
+  }
+  else if (dev >= MAX_LEGACY_ID)
+  {
+    /* Gone, or never answered; left for enumeration to find again. */
+    if (eng->devices[dev].id)
+      ext_free(dev);
+  }
+  else if (was_active)
+  {
+    /* Just went inactive; retry soon, then back off as for an empty id. */
+    sched_set(&eng->discover_sched, dev, start + DISCOVER_EMPTY_MIN);
+  }
+  else
+  {
+    uint32_t backoff = eng->discover_backoff[dev];
+    uint32_t delay = DISCOVER_EMPTY_MIN << backoff;
+    if (delay >= DISCOVER_EMPTY_MAX)
+      delay = DISCOVER_EMPTY_MAX;
+    else
+      eng->discover_backoff[dev] = backoff + 1;
+    sched_set(&eng->discover_sched, dev, start + delay);
+  }
+
+  discover_spend(start);
+  return 1;
+}
+
+
+/*
+  A device with extended address id answered enumeration: give it a slot
+  in the device table, if it has none, and a discover request right away.
+  Returns 1 if the device got a slot now, so its prefix is worth asking
+  again for others; not if it had one already, as it then answers until
+  its discover request goes out, nor if the table is full.
+*/
+static uint32_t
+enumerate_found(uint32_t id)
+{
+  uint32_t dev = ext_find(id);
+  uint32_t found = 0;
+
+  if (dev >= MAX_DEVICE)
+  {
+    if ((dev = ext_alloc(id)) >= MAX_DEVICE)
+      return 0;
+    found = 1;
+  }
+  sched_set(&eng->discover_sched, dev, 0);
+  return found;
+}
+
+
+/*
+  Stop the enumeration walk once the device table is full. A device found
+  then would get no slot, so would never be addressed, and would go on
+  answering for its prefix. Walks start again when a slot is freed.
+*/
+static uint32_t
+enumerate_full(void)
+{
+  if (eng->ext_used < MAX_DEVICE - MAX_LEGACY_ID)
+    return 0;
+  eng->enum_depth = 0;
+  println_msg_uint32("Device table full, extended addresses ",
+                     MAX_DEVICE - MAX_LEGACY_ID);
+  return 1;
+}
+
+
+/*
+  Ask the next id prefix of the enumeration walk, starting a new walk if
+  one is due, the budget allows it, and it will not delay a poll. Returns
+  1 if a request was sent.
+*/
+static uint32_t
+enumerate_next(void)
+{
+  uint32_t prefix, bits, mask, id, cost, rx_bytes;
+  uint64_t now, start;
+  struct timeouts to, t;
+  const struct frame *f;
+  char buf[24];
+  char *p;
+
+  now = current_time();
+  if (!eng->enum_depth)
+  {
+    if (now < eng->next_walk || eng->ext_used >= MAX_DEVICE - MAX_LEGACY_ID)
+      return 0;
+    eng->next_walk = now + ENUM_INTERVAL;
+    ++eng->enum_walks;
+    eng->enum_stack[0].prefix = 0;
+    eng->enum_stack[0].bits = 0;
+    eng->enum_depth = 1;
+  }
+  else if (enumerate_full())
+    return 0;
+  if (!discover_budget(now))
+    return 0;
+
+  /* Like a discover request to an empty id, see DISCOVER_LONG_PROBE. */
+  if (eng->enum_walks % DISCOVER_LONG_PROBE == 0)
+    to.first = to.gap = TIMEOUT_CHAR;
+  else
+    timeouts_from(&eng->bus_timing, &to);
+  cost = request_cost(0, to.first, 40);
+  if (!fits_before_poll(now, cost, &eng->enum_blocked))
+    return 0;
+
+  --eng->enum_depth;
+  prefix = eng->enum_stack[eng->enum_depth].prefix;
+  bits = eng->enum_stack[eng->enum_depth].bits;
+  p = fmt_hex8(fmt_hex8(fmt_str(buf, "?ffff:E"), prefix >> 8), prefix & 0xff);
+  fmt_str(fmt_uint32(fmt_str(p, ","), bits), "|");
+
+  start = now;
+  use_rate(0);
+  led_on();
+  send_to_slave(buf);
+  led_off();
+  rx_bytes = bus_rx_bytes[eng->bus];
+  f = receive_from_slave(&to, &t);
+
+  mask = (0xffff0000 >> bits) & 0xffff;
+  if (check_response(f, 'E', &id) && !f->binary && id >= MAX_LEGACY_ID &&
+      id <= MAX_EXT_ID && (id & mask) == prefix)
+  {
+    timing_update(&eng->bus_timing, &t);
+    /* Ask again, for any others under the same prefix. */
+    if (enumerate_found(id))
+      ++eng->enum_depth;
+    else
+      enumerate_full();
+  }
+  else if (bus_rx_bytes[eng->bus] != rx_bytes && bits < ENUM_BITS)
+  {
+    /* A collision; ask the two halves. */
+    eng->enum_stack[eng->enum_depth].prefix = prefix | (0x8000 >> bits);
+    eng->enum_stack[eng->enum_depth++].bits = bits + 1;
+    eng->enum_stack[eng->enum_depth].prefix = prefix;
+    eng->enum_stack[eng->enum_depth++].bits = bits + 1;
+  }
+
+  discover_spend(start);
+  return 1;
+}
+
+
+/*
+  Reports of the device table to the host. The host keeps its own copy,
+  from the ACTIVE and INACTIVE lines, and can bring it up to date with
+  "SYNC <gen>": we then report every device that changed after generation
+  gen of the table (see state_gen), and end with the line
+
+    SYNC <gen> <active> <checksum>
+
+  giving the generation the host is now at, the number of active devices,
+  and the sum, modulo 2^32, of the CRC-16 (crc16.h) of the part of the
+  ACTIVE line after "ACTIVE " for each of them. The sum does not depend on
+  the order of the devices, so the host can work it out from its copy.
+  "SYNC" alone, or a generation we cannot go back to, reports every device
+  id, as does any line the host sends that is not a command.
+
+  Devices keep only the low 16 bits of the generation they changed at, so
+  a sync can go back at most SYNC_MAX_BACK generations; a device that did
+  not change for longer than that may be reported again, but one that did
+  change is never missed.
+
+  Every SYNC_CHECK milliseconds we do the same by ourselves, from the end
+  of the last report: just the SYNC line, and any device changed since,
+  which the host has normally seen already. So a host that missed a
+  change finds out by the checksum, and can ask for a sync. Rather than
+  dumping a report all at once, which would just overflow the output
+  buffer, we send a line whenever there is room for one.
+*/
+#define SYNC_MAX_BACK 0x7fff
+#define SYNC_CHECK (5*60*1000)
+static uint64_t next_full_report_time = 0;
+/* Next device to report, counting over the buses, bus 0 first. */
+static uint32_t full_report_idx = NUM_BUS*MAX_DEVICE;
+/*
+  Report only devices changed after generation sync_since, unless sync_all;
+  and the same for the next report, and whether the host asked for it.
+*/
+static uint32_t sync_since, sync_all;
+static uint32_t next_since, next_all = 1, sync_asked;
+
+
+static void
+sync_line(void)
+{
+  char buf[MAX_REQ + 50];
+  uint32_t b, dev, active = 0, sum = 0;
+
+  for (b = 0; b < num_engines; ++b)
+  {
+    eng = &engines[b];
+    for (dev = 0; dev < MAX_DEVICE; ++dev)
+      if (eng->devices[dev].active_count)
+      {
+        ++active;
+        sum += crc16_buf((const uint8_t *)buf, active_state(buf, dev) - buf);
+      }
+  }
+  fmt_str(fmt_uint32(fmt_str(fmt_uint32(fmt_str(fmt_uint32(
+    fmt_str(buf, "SYNC "), state_gen), " "), active), " "), sum), "\n");
+  serial_output_str(buf);
+}
+
+
+/*
+  Report the devices changed after generation gen, or all if all is set,
+  once any report under way is done. A full report asked for is not
+  narrowed by a later request.
+*/
+static void
+start_sync(uint32_t gen, uint32_t all)
+{
+  if (!sync_asked)
+    next_all = 0;
+  next_since = gen;
+  next_all |= all || state_gen - gen > SYNC_MAX_BACK;
+  sync_asked = 1;
+  next_full_report_time = current_time();
+}
+
+
+static void
+continue_sync(void)
+{
+  static uint32_t initial_discover_done = 0;
+  uint32_t b, dev;
+
+  if (full_report_idx >= num_engines*MAX_DEVICE)
+  {
+    if (current_time() < next_full_report_time)
+      return;
+    /*
+      Hold the first report until every id has been tried once, so we do
+      not report INACTIVE for devices that simply were not discovered yet.
+    */
+    if (!initial_discover_done)
+    {
+      for (b = 0; b < num_engines; ++b)
+        if (sched_peek(&engines[b].discover_sched, &dev) == 0)
+          return;
+      initial_discover_done = 1;
+    }
+    full_report_idx = 0;
+    sync_since = next_since;
+    sync_all = next_all;
+    sync_asked = 0;
+  }
+
+  while (full_report_idx < num_engines*MAX_DEVICE &&
+         host_tx_pending() + MAX_REQ + 50 <= HOST_TX_SIZE)
+  {
+    eng = &engines[full_report_idx / MAX_DEVICE];
+    dev = full_report_idx++ % MAX_DEVICE;
+    /* Free slots for extended addresses are not reported. */
+    if (dev >= MAX_LEGACY_ID && !eng->devices[dev].id)
+      continue;
+    if (!sync_all &&
+        (uint16_t)(eng->devices[dev].gen - sync_since) - 1u >= SYNC_MAX_BACK)
+      continue;
+    if (eng->devices[dev].active_count)
+      device_active(dev);
+    else
+      device_inactive(dev);
+  }
+
+  if (full_report_idx >= num_engines*MAX_DEVICE)
+  {
+    sync_line();
+    /* Next, just the check, unless the host asked for more meanwhile. */
+    if (!sync_asked)
+    {
+      next_since = state_gen;
+      next_all = 0;
+      next_full_report_time = current_time() + SYNC_CHECK;
+    }
+    report_poll_stats();
+  }
+}
+
+
+/*
+  Replay of the sample log, asked for by the host with "REPLAY <seq>". We
+  answer "REPLAY <first> <end>", and then send the POLL lines of the values
+  numbered first .. end-1 again, as there is room for them, along with the
+  new ones; values before first are lost. The time stamps of the log only
+  have their low 32 bits, which we take as the latest time with those bits.
+*/
+static void
+start_replay(uint32_t seq)
+{
+  char buf[40];
+  uint32_t first, end;
+
+  first = sample_log_replay(seq, &end);
+  fmt_str(fmt_uint32(fmt_str(fmt_uint32(fmt_str(buf, "REPLAY "), first),
+                             " "), end), "\n");
+  serial_output_str(buf);
+}
+
+
+static void
+continue_replay(void)
+{
+  struct sample s;
+  uint64_t now = current_time();
+
+  /* Leave half of the buffer to new lines, so they are not dropped. */
+  while (host_tx_pending() <= HOST_TX_SIZE/2 && sample_log_replay_next(&s))
+    poll_line(s.id, s.text, s.len, now - (uint32_t)((uint32_t)now - s.stamp),
+              s.seq);
+}
+
+
+/*
+  Switch the host protocol to the mode named by the len bytes at name, and
+  answer "MODE <mode>" in the new mode; an unknown name leaves the mode as
+  it is.
+*/
+static void
+set_host_mode(const char *name, uint32_t len)
+{
+  char buf[20];
+  uint32_t m;
+
+  for (m = 0; m < sizeof(host_mode_names)/sizeof(host_mode_names[0]); ++m)
+    if (len == strlen(host_mode_names[m]) &&
+        !memcmp(name, host_mode_names[m], len))
+    {
+      batch_flush();
+      host_mode = m;
+      host_tx_set_mode(m == HOST_MODE_TEXT ? HOST_TX_TEXT : HOST_TX_FRAMED);
+    }
+  fmt_str(fmt_str(fmt_str(buf, "MODE "), host_mode_names[host_mode]), "\n");
+  serial_output_str(buf);
+}
+
+
+/*
+  A line from the host: "REPLAY <seq>" starts a replay of the sample log,
+  "MODE <mode>" sets the host protocol, "SYNC [<gen>]" asks for the
+  devices changed since a generation, anything else for a full report.
+*/
+static void
+host_command(const char *line, uint32_t len)
+{
+  static const char replay[] = "REPLAY ";
+  static const char mode[] = "MODE ";
+  static const char sync[] = "SYNC";
+
+  if (len > sizeof(replay) - 1 && !memcmp(line, replay, sizeof(replay) - 1))
+    start_replay(frame_uint(line + sizeof(replay) - 1,
+                            len - (sizeof(replay) - 1)));
+  else if (len >= sizeof(mode) - 1 && !memcmp(line, mode, sizeof(mode) - 1))
+    set_host_mode(line + sizeof(mode) - 1, len - (sizeof(mode) - 1));
+  else if (len > sizeof(sync) && !memcmp(line, sync, sizeof(sync) - 1) &&
+           line[sizeof(sync) - 1] == ' ')
+    start_sync(frame_uint(line + sizeof(sync), len - sizeof(sync)), 0);
+  else
+    start_sync(0, 1);
+}
+
+
+static void
+host_input(uint32_t c)
+{
+  static char line[24];
+  static uint32_t len;
+
+  if (c == '\n')
+  {
+    host_command(line, len);
+    len = 0;
+  }
+  else if (c != '\r' && len < sizeof(line))
+    line[len++] = c;
+}
+
+
+struct poll_stats poll_stats;
+struct timeout_stats timeout_stats;
+
+
+/*
+  One pass of the engine of a bus: poll due devices, and use any spare bus
+  time. Returns 1 if anything was done.
+*/
+static uint32_t
+engine_step(void)
+{
+  uint32_t dev;
+  uint64_t due, pass_start;
+  uint32_t busy = 0;
+
+  /*
+    First, poll every device that has reached its next poll interval, most
+    overdue first, along with the rest of its latch group. Devices that
+    become due while we are doing this wait for the next pass, so that other
+    work is not starved.
+  */
+  pass_start = current_time();
+  while ((due = sched_peek(&eng->poll_sched, &dev)) <= pass_start)
+  {
+    if (due)
+    {
+      uint64_t late = current_time() - due;
+      ++poll_stats.polls;
+      poll_stats.late_sum += late;
+      if (late > poll_stats.late_max)
+        poll_stats.late_max = late;
+    }
+    poll_group(dev);
+    busy = 1;
+  }
+
+  /* Next, switch devices to a faster bus speed if possible. */
+  if (baud_next())
+    busy = 1;
+
+  /* And find out which devices can be polled in a latch group. */
+  if (latch_probe_next())
+    busy = 1;
+
+  /* Then use any spare bus time for discovery, and enumeration. */
+  if (discover_next() || enumerate_next())
+    busy = 1;
+
+  return busy;
+}
+
+
+static void
+engine_main(uint32_t bus)
+{
+  for (;;)
+  {
+    eng->busy = engine_step();
+    hal_engine_yield(bus);
+  }
+}
+
+
+void
+master_init(uint32_t num_bus)
+{
+  uint32_t b, dev;
+
+  num_engines = num_bus;
+  for (b = 0; b < num_engines; ++b)
+  {
+    eng = &engines[b];
+    eng->bus = b;
+    eng->rate_ceiling = NUM_BUS_RATES - 1;
+    for (dev = 0; dev < MAX_DEVICE; ++dev)
+      eng->devices[dev].group_next = GROUP_NONE;
+    /*
+      Start out by trying to discover every legacy id; extended addresses
+      are found by enumeration.
+    */
+    for (dev = 0; dev < MAX_LEGACY_ID; ++dev)
+    {
+      eng->devices[dev].id = dev;
+      sched_set(&eng->discover_sched, dev, 0);
+    }
+    hal_engine_start(b, engine_main);
+  }
+}
+
+
+void
+poll_n_discover_step(void)
+{
+  uint32_t b;
+  uint32_t busy = 0;
+
+  /* Run the engine of every bus, until it has to wait for its bus. */
+  for (b = 0; b < num_engines; ++b)
+  {
+    eng = &engines[b];
+    hal_engine_resume(b);
+    busy |= eng->busy;
+  }
+
+  continue_sync();
+  continue_replay();
+  if (batch_len && current_time() - batch_time >= BATCH_AGE)
+    batch_flush();
+
+  /*
+    Server can send us a line to request full activity dump, a replay, or a
+    protocol mode.
+  */
+  if (host_chars_avail())
+  {
+    do
+      host_input(host_getc());
+    while (host_chars_avail());
+    busy = 1;
+  }
+
+  /*
+    If nothing was due, sleep until something happens. We are woken at
+    least once every tick, to check deadlines again.
+  */
+  if (!busy)
+    wait_for_event();
+}
+
+
+void
+poll_n_discover_loop(void)
+{
+  for (;;)
+    poll_n_discover_step();
+  /* NOTREACHED */
+}
@@ -0,0 +1,63 @@
+#ifndef MASTER_H
+#define MASTER_H
+
+#include <inttypes.h>
+
+/*
+  Protocol and scheduling core of the Labibus master, independent of the
+  hardware (see hal.h).
+*/
+
+/*
+  Device ids. Legacy slaves have ids below MAX_LEGACY_ID, addressed with two
+  hex digits; slaves with an extended address have ids from MAX_LEGACY_ID
+  up to MAX_EXT_ID, addressed with four (see master.c). Ids are reported to
+  the host in decimal either way, with the number of the bus in the upper
+  16 bits; so as bus*65536 + id, and just as id on bus 0.
+
+  Each bus has a device table, with a slot for each legacy id, and
+  MAX_DEVICE - MAX_LEGACY_ID more for devices with extended addresses, given
+  out as they are found. MAX_DEVICE is limited by the RAM of the target,
+  about 60 bytes a device; with two buses, the tables take about 16 KB of
+  its 32 KB. The default of 136 leaves room on the target for just 8
+  devices with extended addresses on each bus, so that the string pool
+  can hold the descriptions of a full bus (see strpool.h); enumeration
+  stops, and says the table is full, once they are taken. The host build
+  makes it larger, to simulate big installations.
+*/
+#define MAX_LEGACY_ID 128
+#define MAX_EXT_ID 0xfffe
+#ifndef MAX_DEVICE
+#define MAX_DEVICE 136
+#endif
+
+/* Poll scheduling lateness, in milliseconds, since the last report. */
+struct poll_stats {
+  uint32_t polls;
+  uint64_t late_sum;
+  uint64_t late_max;
+};
+extern struct poll_stats poll_stats;
+
+/*
+  Responses that timed out, and the total time spent waiting for them, in
+  microseconds, since startup.
+*/
+struct timeout_stats {
+  uint32_t timeouts;
+  uint64_t wait_us;
+};
+extern struct timeout_stats timeout_stats;
+
+/* Start the engines of buses 0 .. num_bus-1, at most NUM_BUS (hal.h). */
+extern void master_init(uint32_t num_bus);
+/*
+  Run one pass of the main loop: on each bus, poll due devices and send a
+  discover request if there is bus time for it, up to where the bus has to
+  be waited for; then continue any report to the host, and handle input from
+  the host. Sleeps for a while if there was nothing to do.
+*/
+extern void poll_n_discover_step(void);
+extern void poll_n_discover_loop(void) __attribute__((noreturn));
+
+#endif  /* MASTER_H */
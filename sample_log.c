@@ -0,0 +1,183 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "sample_log.h"
+
+
+#if SAMPLE_LOG_SIZE & (SAMPLE_LOG_SIZE - 1)
+#error SAMPLE_LOG_SIZE must be a power of two
+#endif
+#if SAMPLE_LOG_MAX_RECORD > 127
+#error SAMPLE_LOG_MAX_RECORD larger than 127, length does not fit in 7 bits
+#endif
+
+/* Length byte, id, and time stamp. */
+#define REC_HDR 8
+/* Top bit of the length byte: the value text is not packed. */
+#define REC_RAW 0x80
+/* Code of the end of a packed value with an odd number of characters. */
+#define PACK_END 15
+
+/* Records between log_tail and log_head; the indexes run freely. */
+static uint8_t log_buf[SAMPLE_LOG_SIZE];
+static uint32_t log_head, log_tail;
+/* Sequence number of the record at log_tail, and of the next one added. */
+static uint32_t first_seq, next_seq;
+/* Position and number of the next record to replay, and the end. */
+static uint32_t replay_pos, replay_seq, replay_end;
+
+
+static uint32_t
+log_byte(uint32_t pos)
+{
+  return log_buf[pos & (SAMPLE_LOG_SIZE-1)];
+}
+
+
+/* The 4-bit code of c, or PACK_END if it has none. */
+static uint32_t
+pack_code(uint32_t c)
+{
+  const char *p = c ? strchr(SAMPLE_LOG_DIGITS, c) : NULL;
+
+  return p ? (uint32_t)(p - SAMPLE_LOG_DIGITS) : PACK_END;
+}
+
+
+static void
+drop_oldest(void)
+{
+  uint32_t len = log_byte(log_tail) & ~REC_RAW;
+
+  /* A replay not done yet loses the record too. */
+  if (replay_seq == first_seq && replay_seq != replay_end)
+  {
+    replay_pos += len;
+    ++replay_seq;
+  }
+  log_tail += len;
+  ++first_seq;
+}
+
+
+/* Whether the value text must be kept as it is, rather than packed. */
+static uint32_t
+is_raw(const char *text, uint32_t len)
+{
+  uint32_t i;
+
+  for (i = 0; i < len; ++i)
+    if (pack_code((uint8_t)text[i]) == PACK_END)
+      return REC_RAW;
+  return 0;
+}
+
+
+uint32_t
+sample_log_record_len(const char *text, uint32_t len)
+{
+  if (len > SAMPLE_LOG_MAX_TEXT)
+    len = SAMPLE_LOG_MAX_TEXT;
+  return REC_HDR + (is_raw(text, len) ? len : (len + 1)/2);
+}
+
+
+uint32_t
+sample_log_encode(uint8_t *rec, uint32_t id, uint64_t stamp,
+                  const char *text, uint32_t len)
+{
+  uint32_t i, n = REC_HDR, raw;
+
+  if (len > SAMPLE_LOG_MAX_TEXT)
+    len = SAMPLE_LOG_MAX_TEXT;
+  raw = is_raw(text, len);
+
+  rec[1] = id;
+  rec[2] = id >> 8;
+  rec[3] = id >> 16;
+  rec[4] = stamp;
+  rec[5] = stamp >> 8;
+  rec[6] = stamp >> 16;
+  rec[7] = stamp >> 24;
+  if (raw)
+  {
+    memcpy(rec + n, text, len);
+    n += len;
+  }
+  else
+  {
+    for (i = 0; i < len; i += 2)
+      rec[n++] = pack_code((uint8_t)text[i]) |
+        (i + 1 < len ? pack_code((uint8_t)text[i + 1]) : PACK_END) << 4;
+  }
+  rec[0] = n | raw;
+  return n;
+}
+
+
+uint32_t
+sample_log_add(uint32_t id, uint64_t stamp, const char *text, uint32_t len)
+{
+  uint8_t rec[SAMPLE_LOG_MAX_RECORD];
+  uint32_t i, n = sample_log_encode(rec, id, stamp, text, len);
+
+  while (log_head - log_tail + n > SAMPLE_LOG_SIZE)
+    drop_oldest();
+  for (i = 0; i < n; ++i)
+    log_buf[(log_head + i) & (SAMPLE_LOG_SIZE-1)] = rec[i];
+  log_head += n;
+  return next_seq++;
+}
+
+
+uint32_t
+sample_log_replay(uint32_t seq, uint32_t *end)
+{
+  replay_pos = log_tail;
+  replay_seq = first_seq;
+  replay_end = next_seq;
+  /* Sequence numbers wrap around, so compare differences. */
+  if ((int32_t)(seq - next_seq) > 0)
+    seq = next_seq;
+  while ((int32_t)(seq - replay_seq) > 0)
+  {
+    replay_pos += log_byte(replay_pos) & ~REC_RAW;
+    ++replay_seq;
+  }
+  *end = replay_end;
+  return replay_seq;
+}
+
+
+uint32_t
+sample_log_replay_next(struct sample *s)
+{
+  uint32_t pos = replay_pos;
+  uint32_t hdr = log_byte(pos);
+  uint32_t n = hdr & ~REC_RAW;
+  uint32_t i, c;
+
+  if (replay_seq == replay_end)
+    return 0;
+  s->seq = replay_seq;
+  s->id = log_byte(pos + 1) | log_byte(pos + 2) << 8 |
+    log_byte(pos + 3) << 16;
+  s->stamp = log_byte(pos + 4) | log_byte(pos + 5) << 8 |
+    log_byte(pos + 6) << 16 | (uint32_t)log_byte(pos + 7) << 24;
+  s->len = 0;
+  for (i = REC_HDR; i < n; ++i)
+  {
+    c = log_byte(pos + i);
+    if (hdr & REC_RAW)
+      s->text[s->len++] = c;
+    else
+    {
+      s->text[s->len++] = SAMPLE_LOG_DIGITS[c & 0xf];
+      if ((c >> 4) != PACK_END)
+        s->text[s->len++] = SAMPLE_LOG_DIGITS[c >> 4];
+    }
+  }
+  replay_pos += n;
+  ++replay_seq;
+  return 1;
+}
@@ -0,0 +1,84 @@
+#ifndef SAMPLE_LOG_H
+#define SAMPLE_LOG_H
+
+#include <inttypes.h>
+
+/*
+  Log of the last polled values, for replay to the host.
+
+  Every value reported in a POLL line is also added here, and gets a
+  sequence number, counting up from 0 at startup, which the POLL line
+  carries. If the host misses lines, because the client stalled or the
+  link dropped them, it sees a gap in the numbers and can ask for the
+  values again, from the oldest one missing on, as long as they are still
+  in the log.
+
+  Records go back to back in a ring buffer, the oldest making room for the
+  newest: a byte with the length of the record, the device id as reported
+  to the host (3 bytes), the low 32 bits of the time stamp, in
+  milliseconds, and the value text. Values are numbers, so their text is
+  packed two characters to a byte, from the 15 characters of
+  SAMPLE_LOG_DIGITS; anything else is stored as it is, with the top bit of
+  the length set. A typical value like "-12.34" gives an 11 byte record.
+
+  SRAM is the limit. The target has 32 KB; with two buses and MAX_DEVICE
+  136 (see master.h), about 1 KB is left after the device tables, the
+  string pool, the receive rings, the host buffer and batch, and the
+  stacks. The default SAMPLE_LOG_SIZE of 512 bytes holds about 45 values,
+  enough to cover 40 seconds of 64 devices polled every minute, or a short
+  stall of the client at higher rates. The host build makes it larger.
+
+  The log is not kept in flash: erasing a page stalls the CPU for
+  milliseconds, long enough to overrun the bus receive FIFOs, and the
+  flash would wear out in days at these rates.
+*/
+
+/* Ring buffer size, must be a power of two. */
+#ifndef SAMPLE_LOG_SIZE
+#define SAMPLE_LOG_SIZE 512
+#endif
+/* Longest value text kept; longer ones are cut. */
+#define SAMPLE_LOG_MAX_TEXT 119
+/* Characters of packed values, in the order of their 4-bit codes. */
+#define SAMPLE_LOG_DIGITS "0123456789.-+eE"
+/* Longest record. */
+#define SAMPLE_LOG_MAX_RECORD (8 + SAMPLE_LOG_MAX_TEXT)
+
+struct sample {
+  uint32_t seq;
+  uint32_t id;
+  /* Low 32 bits of the time stamp, in milliseconds. */
+  uint32_t stamp;
+  uint32_t len;
+  char text[SAMPLE_LOG_MAX_TEXT];
+};
+
+/*
+  Add a value, of len bytes at text, from device id with time stamp
+  stamp. Returns its sequence number.
+*/
+extern uint32_t sample_log_add(uint32_t id, uint64_t stamp, const char *text,
+                               uint32_t len);
+/*
+  Encode a value as a record of the log into rec, which has room for it,
+  at most SAMPLE_LOG_MAX_RECORD bytes. Returns the length of the record,
+  which sample_log_record_len() gives beforehand. The host link uses the
+  same records for batches of values (see master.c).
+*/
+extern uint32_t sample_log_encode(uint8_t *rec, uint32_t id, uint64_t stamp,
+                                  const char *text, uint32_t len);
+extern uint32_t sample_log_record_len(const char *text, uint32_t len);
+/*
+  Start a replay of the values from sequence number seq on, up to the last
+  one added so far, replacing any replay not done yet. Values no longer in
+  the log are skipped. Returns the sequence number of the first value that
+  will be replayed, and sets *end to the one after the last.
+*/
+extern uint32_t sample_log_replay(uint32_t seq, uint32_t *end);
+/*
+  Get the next value of the replay into *s. Returns 0 when the replay is
+  done.
+*/
+extern uint32_t sample_log_replay_next(struct sample *s);
+
+#endif  /* SAMPLE_LOG_H */
@@ -0,0 +1,108 @@
+#include <inttypes.h>
+
+#include "sched.h"
+
+
+static void
+heap_place(struct sched *s, uint32_t i, uint32_t dev)
+{
+  s->heap[i] = dev;
+  s->heap_pos[dev] = i + 1;
+}
+
+
+static void
+sift_up(struct sched *s, uint32_t i)
+{
+  uint32_t dev = s->heap[i];
+  uint64_t t = s->due_time[dev];
+
+  while (i > 0)
+  {
+    uint32_t parent = (i - 1) / 2;
+    if (s->due_time[s->heap[parent]] <= t)
+      break;
+    heap_place(s, i, s->heap[parent]);
+    i = parent;
+  }
+  heap_place(s, i, dev);
+}
+
+
+static void
+sift_down(struct sched *s, uint32_t i)
+{
+  uint32_t dev = s->heap[i];
+  uint64_t t = s->due_time[dev];
+
+  for (;;)
+  {
+    uint32_t child = 2*i + 1;
+    if (child >= s->heap_len)
+      break;
+    if (child + 1 < s->heap_len &&
+        s->due_time[s->heap[child + 1]] < s->due_time[s->heap[child]])
+      ++child;
+    if (t <= s->due_time[s->heap[child]])
+      break;
+    heap_place(s, i, s->heap[child]);
+    i = child;
+  }
+  heap_place(s, i, dev);
+}
+
+
+void
+sched_set(struct sched *s, uint32_t dev, uint64_t due)
+{
+  uint32_t i;
+
+  if (!s->heap_pos[dev])
+  {
+    s->due_time[dev] = due;
+    heap_place(s, s->heap_len, dev);
+    sift_up(s, s->heap_len++);
+    return;
+  }
+  i = s->heap_pos[dev] - 1;
+  if (due < s->due_time[dev])
+  {
+    s->due_time[dev] = due;
+    sift_up(s, i);
+  }
+  else
+  {
+    s->due_time[dev] = due;
+    sift_down(s, i);
+  }
+}
+
+
+void
+sched_remove(struct sched *s, uint32_t dev)
+{
+  uint32_t i, last;
+
+  if (!s->heap_pos[dev])
+    return;
+  i = s->heap_pos[dev] - 1;
+  s->heap_pos[dev] = 0;
+  last = s->heap[--s->heap_len];
+  if (i == s->heap_len)
+    return;
+  heap_place(s, i, last);
+  if (i > 0 && s->due_time[last] < s->due_time[s->heap[(i - 1) / 2]])
+    sift_up(s, i);
+  else
+    sift_down(s, i);
+}
+
+
+uint64_t
+sched_peek(const struct sched *s, uint32_t *dev)
+{
+  if (!s->heap_len)
+    return SCHED_NEVER;
+  *dev = s->heap[0];
+  return s->due_time[s->heap[0]];
+}
@@ -0,0 +1,39 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <inttypes.h>
+
+#include "master.h"
+
+/*
+  Device scheduler: a binary min-heap of device ids ordered by the time
+  they are next due, so the main loop can find the most overdue device in
+  O(1) and reschedule it in O(log n) instead of scanning all devices.
+  Used both for polls and for discover requests.
+*/
+
+#if MAX_DEVICE > 65535
+#error MAX_DEVICE larger than 65535, heap indexes do not fit in uint16_t
+#endif
+
+#define SCHED_NEVER (~(uint64_t)0)
+
+struct sched {
+  uint64_t due_time[MAX_DEVICE];
+  /* The heap, holding device ids. */
+  uint16_t heap[MAX_DEVICE];
+  /* Position of each device in the heap plus one, or 0 if not scheduled. */
+  uint16_t heap_pos[MAX_DEVICE];
+  uint32_t heap_len;
+};
+
+/* Insert dev, or move it if already scheduled. Due time in milliseconds. */
+extern void sched_set(struct sched *s, uint32_t dev, uint64_t due);
+extern void sched_remove(struct sched *s, uint32_t dev);
+/*
+  Return the due time of the earliest scheduled device and store its id in
+  *dev, or return SCHED_NEVER if nothing is scheduled.
+*/
+extern uint64_t sched_peek(const struct sched *s, uint32_t *dev);
+
+#endif  /* SCHED_H */
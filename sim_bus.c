@@ -0,0 +1,1175 @@
+#include <inttypes.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "bus_rx.h"
+#include "hal.h"
+#include "host_tx.h"
+#include "sim_bus.h"
+
+
+/* Time on the wire for one byte (start + 8 data + stop bits), in usec. */
+#define BYTE_US(baud) (10*1000000/(baud))
+/* Slaves go back to the legacy rate after this long without a request. */
+#define REVERT_US 15000000
+/* A speed switch must be confirmed by a request within this time. */
+#define CONFIRM_US 50000
+/* Clock of the slave UART baud rate generators, see hal.h. */
+#define SLAVE_BAUD_CLOCK (16000000/8)
+/* Start bytes of binary requests and answers, see master.c. */
+#define BIN_REQUEST 0xfc
+#define BIN_RESPONSE BUS_RX_BINARY
+
+/* Digits of the id in a frame to or from device id. */
+#define ID_DIGITS(id) ((id) < SIM_LEGACY_IDS ? 2 : 4)
+
+#define RXQ_SIZE 1024
+/* Transmit FIFO of the master's UART, as on the target. */
+#define TXQ_SIZE 16
+#define REQ_SIZE 256
+#define HOST_LINE_SIZE 512
+/*
+  Stack of the context of each bus engine, filled with STACK_FILL to find
+  how much was used, and with a guard at the bottom, as on the target.
+*/
+#define ENGINE_STACK (256*1024)
+#define STACK_FILL 0xa5
+#define STACK_GUARD 64
+
+
+struct sim_stats sim_stats;
+struct sim_bus_stats sim_bus_stats[NUM_BUS];
+
+static uint64_t now_us;
+static uint32_t host_byte_us;
+static uint32_t bus_max_baud;
+static uint64_t rand_state;
+
+static struct sim_slave slaves[SIM_MAX_SLAVES];
+static uint32_t num_slaves;
+
+/* A bus, with the master's UART at one end and its slaves. */
+struct sim_wire {
+  uint32_t bus;
+  /* Speed of the master's UART. */
+  uint32_t baud;
+  struct sim_slave *slave_by_id[SIM_MAX_ID];
+
+  /* Bytes on their way from the slaves to the master, with arrival time. */
+  struct {
+    uint64_t time;
+    uint32_t baud;
+    uint8_t c;
+  } rxq[RXQ_SIZE];
+  uint32_t rxq_head, rxq_tail;
+  /* When the last byte queued from a slave is off the wire. */
+  uint64_t rxq_wire_end;
+
+  /* Bytes from the master still in its UART, with when they are sent. */
+  struct {
+    uint64_t start;
+    uint64_t time;
+    uint8_t c;
+  } txq[TXQ_SIZE];
+  uint32_t txq_head, txq_tail;
+  uint64_t txq_wire_end;
+
+  /* Request frame currently being sent by the master. */
+  char req_buf[REQ_SIZE];
+  /* Argument of the ASCII request, after "?xx:<cmd>" or "?xxxx:<cmd>". */
+  const char *req_arg;
+  uint32_t req_len;
+  uint64_t req_start;
+  /* Bytes still to come of a binary request, or 0 if none is being sent. */
+  uint32_t req_bin_left;
+
+  /* Discover sweep in progress, see sim_stats. */
+  uint64_t sweeps;
+  uint64_t last_sweep_start;
+  uint32_t sweep_ids_seen;
+  uint8_t sweep_seen[SIM_LEGACY_IDS];
+  uint64_t last_request_start;
+};
+
+static struct sim_wire wires[NUM_BUS];
+/* The bus of the request being served. */
+static struct sim_wire *w;
+
+/* Values for edge_values slaves: float and integer extremes. */
+static const struct {
+  double value;
+  uint32_t is_int;
+} edge_values[] = {
+  { 0, 0 },
+  { -273.15, 0 },
+  { 1e-30, 0 },
+  { 3.4028234663852886e38, 0 },
+  { -3.4028234663852886e38, 0 },
+  { 16777217, 0 },
+  { 0.1, 0 },
+  { -2147483648.0, 1 },
+  { 2147483647, 1 },
+  { -1, 1 },
+  { 0, 1 }
+};
+
+/* Byte currently on the wire to the host, and when it will have been sent. */
+static int32_t host_tx_cur = -1;
+static uint64_t host_tx_done;
+static char host_line[HOST_LINE_SIZE];
+static uint32_t host_line_len;
+static void (*host_line_hook)(const char *line);
+/* Binary frame from the master so far. */
+static uint8_t host_frame[HOST_LINE_SIZE];
+static uint32_t host_frame_len;
+static void (*host_frame_hook)(const uint8_t *frame, uint32_t len);
+
+static const char *host_in;
+
+/* Contexts of the bus engines, and of the main loop running them. */
+static ucontext_t main_context;
+static ucontext_t engine_context[NUM_BUS];
+static void (*engine_fn[NUM_BUS])(uint32_t bus);
+static char engine_stack[NUM_BUS][ENGINE_STACK];
+
+static void bus_byte_sent(uint32_t c, uint64_t start);
+
+
+static uint32_t
+sim_random(void)
+{
+  /* xorshift64*, deterministic for a given seed. */
+  rand_state ^= rand_state >> 12;
+  rand_state ^= rand_state << 25;
+  rand_state ^= rand_state >> 27;
+  return (uint32_t)((rand_state * 2685821657736338717ULL) >> 32);
+}
+
+
+static double
+sim_random_unit(void)
+{
+  return sim_random() / 4294967296.0;
+}
+
+
+static void
+host_line_char(uint32_t c)
+{
+  ++sim_stats.host_bytes_out;
+  /* Start byte, length byte, the bytes it counts, and the CRC. */
+  if (host_frame_len || (c == HOST_TX_BINARY && !host_line_len))
+  {
+    host_frame[host_frame_len++] = c;
+    if (host_frame_len > 1 && host_frame_len == host_frame[1] + 4u)
+    {
+      if (host_frame_hook)
+        host_frame_hook(host_frame, host_frame_len);
+      host_frame_len = 0;
+    }
+  }
+  else if (c == '\n')
+  {
+    host_line[host_line_len] = '\0';
+    if (host_line_hook)
+      host_line_hook(host_line);
+    host_line_len = 0;
+  }
+  else if (host_line_len < HOST_LINE_SIZE - 1)
+    host_line[host_line_len++] = c;
+}
+
+
+/*
+  Advance the virtual clock, running the simulated UART interrupts for
+  everything that happens in the meantime: bytes arriving from the slaves
+  and bytes sent to them, on each bus, and bytes finished sending to the
+  host (UART0 transmit). Slaves hear a request when its last byte is sent.
+*/
+static void
+advance_to(uint64_t t)
+{
+  struct sim_wire *rx_w, *sent_w, *x;
+  uint64_t rx_time, sent_time, tx_time;
+  uint32_t b, i;
+
+  for (;;)
+  {
+    rx_w = sent_w = NULL;
+    rx_time = sent_time = UINT64_MAX;
+    for (b = 0; b < NUM_BUS; ++b)
+    {
+      x = &wires[b];
+      if (x->rxq_tail != x->rxq_head && x->rxq[x->rxq_tail].time < rx_time)
+      {
+        rx_w = x;
+        rx_time = x->rxq[x->rxq_tail].time;
+      }
+      if (x->txq_tail != x->txq_head &&
+          x->txq[x->txq_tail % TXQ_SIZE].time < sent_time)
+      {
+        sent_w = x;
+        sent_time = x->txq[x->txq_tail % TXQ_SIZE].time;
+      }
+    }
+    tx_time = host_tx_cur >= 0 ? host_tx_done : UINT64_MAX;
+
+    if (rx_time <= tx_time && rx_time <= sent_time && rx_time <= t)
+    {
+      uint32_t baud = rx_w->rxq[rx_w->rxq_tail].baud;
+
+      if (rx_time > now_us)
+        now_us = rx_time;
+      ++sim_stats.bus_bytes_in;
+      /* At the wrong speed, the UART just sees framing errors. */
+      if (baud == rx_w->baud && (!bus_max_baud || baud <= bus_max_baud))
+        bus_rx_byte(rx_w->bus, rx_w->rxq[rx_w->rxq_tail].c);
+      rx_w->rxq_tail = (rx_w->rxq_tail + 1) % RXQ_SIZE;
+    }
+    else if (tx_time <= sent_time && tx_time <= t)
+    {
+      if (tx_time > now_us)
+        now_us = tx_time;
+      host_line_char(host_tx_cur);
+      host_tx_cur = host_tx_getc();
+      host_tx_done = now_us + host_byte_us;
+    }
+    else if (sent_time <= t)
+    {
+      if (sent_time > now_us)
+        now_us = sent_time;
+      i = sent_w->txq_tail++ % TXQ_SIZE;
+      w = sent_w;
+      bus_byte_sent(w->txq[i].c, w->txq[i].start);
+    }
+    else
+      break;
+  }
+  if (t > now_us)
+    now_us = t;
+}
+
+
+/*
+  Bit-at-a-time CRC-16 (polynomial 0xA001). Deliberately independent of the
+  table-driven implementation in the master, so the two check each other.
+*/
+uint32_t
+sim_crc16(const char *buf, uint32_t len)
+{
+  uint32_t crc = 0;
+  uint32_t i, j;
+
+  for (i = 0; i < len; ++i)
+  {
+    crc ^= (uint8_t)buf[i];
+    for (j = 0; j < 8; ++j)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+  }
+  return crc;
+}
+
+
+void
+sim_init(uint32_t seed)
+{
+  uint32_t b;
+
+  now_us = 0;
+  rand_state = 0x9e3779b97f4a7c15ULL ^ seed;
+  if (!rand_state)
+    rand_state = 1;
+  num_slaves = 0;
+  memset(wires, 0, sizeof(wires));
+  for (b = 0; b < NUM_BUS; ++b)
+  {
+    wires[b].bus = b;
+    wires[b].baud = RS485_BAUD;
+  }
+  w = &wires[0];
+  host_line_len = 0;
+  host_tx_cur = -1;
+  host_byte_us = 10*1000000/115200;
+  host_in = NULL;
+  bus_max_baud = 0;
+  memset(&sim_stats, 0, sizeof(sim_stats));
+  memset(sim_bus_stats, 0, sizeof(sim_bus_stats));
+  for (b = 0; b < NUM_BUS; ++b)
+    sim_bus_stats[b].baud = RS485_BAUD;
+}
+
+
+struct sim_slave *
+sim_add_slave(uint32_t bus, uint32_t id, uint32_t poll_interval,
+              const char *description, const char *unit)
+{
+  struct sim_slave *s;
+
+  if (num_slaves >= SIM_MAX_SLAVES || bus >= NUM_BUS || id >= SIM_MAX_ID)
+    return NULL;
+  s = &slaves[num_slaves++];
+  wires[bus].slave_by_id[id] = s;
+  memset(s, 0, sizeof(*s));
+  s->bus = bus;
+  s->id = id;
+  s->poll_interval = poll_interval;
+  s->description = description;
+  s->unit = unit;
+  s->latency_us = 1000;
+  s->baud = RS485_BAUD;
+  s->present = 1;
+  s->value = 20.0f;
+  return s;
+}
+
+
+uint32_t
+sim_slave_count(void)
+{
+  return num_slaves;
+}
+
+
+struct sim_slave *
+sim_get_slave(uint32_t idx)
+{
+  return idx < num_slaves ? &slaves[idx] : NULL;
+}
+
+
+struct sim_slave *
+sim_find_slave(uint32_t bus, uint32_t id)
+{
+  return bus < NUM_BUS && id < SIM_MAX_ID ? wires[bus].slave_by_id[id] : NULL;
+}
+
+
+uint64_t
+sim_now_us(void)
+{
+  return now_us;
+}
+
+
+void
+sim_host_input(const char *s)
+{
+  host_in = s;
+}
+
+
+void
+sim_set_bus_max_baud(uint32_t baud)
+{
+  bus_max_baud = baud;
+}
+
+
+void
+sim_set_host_baud(uint32_t baud)
+{
+  host_byte_us = 10*1000000/baud;
+}
+
+
+void
+sim_set_host_line_hook(void (*hook)(const char *line))
+{
+  host_line_hook = hook;
+}
+
+
+void
+sim_set_host_frame_hook(void (*hook)(const uint8_t *frame, uint32_t len))
+{
+  host_frame_hook = hook;
+}
+
+
+static void
+rxq_put(uint64_t time, uint32_t baud, uint8_t c)
+{
+  uint32_t next = (w->rxq_head + 1) % RXQ_SIZE;
+  if (next == w->rxq_tail)
+    return;                                     /* Overrun, byte lost. */
+  w->rxq[w->rxq_head].time = time;
+  w->rxq[w->rxq_head].baud = baud;
+  w->rxq[w->rxq_head].c = c;
+  w->rxq_head = next;
+}
+
+
+/*
+  Send the len bytes of an answer in buf, delay_us later than the normal
+  latency.
+
+  If the answer starts while another one is still on the wire, both are
+  garbled: the bytes of the earlier one from then on are corrupted, and the
+  overlapping bytes of the new one are lost.
+*/
+static void
+slave_send(struct sim_slave *s, const char *buf, uint32_t len,
+           uint64_t delay_us)
+{
+  uint32_t i;
+  uint64_t t;
+
+  t = now_us + s->latency_us + delay_us;
+  if (s->jitter_us)
+    t += sim_random() % (s->jitter_us + 1);
+  if (t < w->rxq_wire_end)
+  {
+    ++sim_stats.collisions;
+    for (i = w->rxq_tail; i != w->rxq_head; i = (i + 1) % RXQ_SIZE)
+      if (w->rxq[i].time + BYTE_US(w->rxq[i].baud) > t)
+        w->rxq[i].c = 0xfe;
+  }
+  for (i = 0; i < len; ++i)
+  {
+    if (t >= w->rxq_wire_end)
+      rxq_put(t, s->baud, buf[i]);
+    t += BYTE_US(s->baud);
+    sim_stats.bus_busy_us += BYTE_US(s->baud);
+    sim_bus_stats[w->bus].bus_busy_us += BYTE_US(s->baud);
+  }
+  if (t > w->rxq_wire_end)
+    w->rxq_wire_end = t;
+}
+
+
+/* Respond to a request with an ASCII answer, adding the CRC. */
+static void
+slave_respond(struct sim_slave *s, const char *body, uint64_t delay_us)
+{
+  char buf[REQ_SIZE];
+  uint32_t len, crc;
+
+  len = snprintf(buf, sizeof(buf) - 8, "%s", body);
+  crc = sim_crc16(buf, len);
+  len += sprintf(buf + len, "%04x\r\n", (unsigned)crc);
+  slave_send(s, buf, len, delay_us);
+}
+
+
+/* Respond to request cmd with a binary answer with the given payload. */
+static void
+slave_respond_binary(struct sim_slave *s, uint32_t cmd, const uint8_t *payload,
+                     uint32_t len, uint64_t delay_us)
+{
+  char buf[REQ_SIZE];
+  uint32_t crc;
+
+  buf[0] = (char)BIN_RESPONSE;
+  buf[1] = len + 2;
+  buf[2] = s->id;
+  buf[3] = cmd;
+  memcpy(buf + 4, payload, len);
+  crc = sim_crc16(buf, len + 4);
+  buf[len + 4] = crc & 0xff;
+  buf[len + 5] = crc >> 8;
+  slave_send(s, buf, len + 6, delay_us);
+}
+
+
+/* Print a value the way the slave firmware does. */
+static void
+format_value(char *buf, double value, uint32_t is_int)
+{
+  if (is_int)
+    sprintf(buf, "%ld", (long)value);
+  else
+    sprintf(buf, "%.2f", value);
+}
+
+
+/* Store a value in binary: type, then four bytes little endian. */
+static void
+put_value(uint8_t *p, double value, uint32_t is_int)
+{
+  uint32_t v;
+  float f;
+
+  if (is_int)
+  {
+    p[0] = 'i';
+    v = (uint32_t)(int32_t)value;
+  }
+  else
+  {
+    p[0] = 'f';
+    f = value;
+    memcpy(&v, &f, sizeof(v));
+  }
+  p[1] = v & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = (v >> 16) & 0xff;
+  p[4] = v >> 24;
+}
+
+
+/* Answer a read-out of the latched sample, delay_us later than normal. */
+static void
+respond_latched(struct sim_slave *s, uint32_t binary, uint64_t delay_us)
+{
+  char body[REQ_SIZE], val[64];
+  uint8_t payload[6];
+
+  if (binary)
+  {
+    payload[0] = s->latch_seq;
+    put_value(payload + 1, s->latch_value, s->latch_int);
+    slave_respond_binary(s, 'Q', payload, sizeof(payload), delay_us);
+    return;
+  }
+  format_value(val, s->latch_value, s->latch_int);
+  snprintf(body, sizeof(body), "!%0*x:Q%u,%s|", ID_DIGITS(s->id),
+           (unsigned)s->id, (unsigned)s->latch_seq, val);
+  slave_respond(s, body, delay_us);
+}
+
+
+static struct sim_slave *
+find_slave(uint32_t id)
+{
+  struct sim_slave *s = sim_find_slave(w->bus, id);
+
+  return s && s->present && s->plug_time <= now_us ? s : NULL;
+}
+
+
+/*
+  Check if s hears the request being handled, ie. it is at the speed of the
+  master's UART, after any reverting to an old speed.
+*/
+static uint32_t
+slave_hears(struct sim_slave *s)
+{
+  if (s->confirm_deadline && w->req_start > s->confirm_deadline)
+  {
+    s->baud = s->old_baud;
+    s->confirm_deadline = 0;
+  }
+  if (s->baud != RS485_BAUD && w->req_start - s->last_heard > REVERT_US)
+    s->baud = RS485_BAUD;
+  return s->baud == w->baud && !(bus_max_baud && w->baud > bus_max_baud);
+}
+
+
+static void
+slave_sample(struct sim_slave *s)
+{
+  uint32_t i;
+
+  if (s->edge_values)
+  {
+    i = s->poll_answers % (sizeof(edge_values)/sizeof(edge_values[0]));
+    s->cur_int = edge_values[i].is_int;
+    s->cur_value = s->cur_int ? edge_values[i].value :
+      (float)edge_values[i].value;
+  }
+  else if (s->sequence_values)
+  {
+    s->cur_value = s->poll_answers + 1;
+    s->cur_int = 1;
+  }
+  else
+  {
+    s->value += (float)(sim_random_unit() - 0.5);
+    s->cur_value = s->value;
+    s->cur_int = 0;
+  }
+}
+
+
+/* "?ff:L<interval>,<seq>|": slaves with that poll interval take a sample. */
+static void
+handle_latch(void)
+{
+  uint32_t interval, seq, i;
+  char *q;
+
+  interval = strtoul(w->req_arg, &q, 10);
+  if (*q != ',')
+    return;
+  seq = strtoul(q + 1, NULL, 10);
+  for (i = 0; i < num_slaves; ++i)
+  {
+    struct sim_slave *s = &slaves[i];
+
+    if (s->bus != w->bus || !s->present || s->plug_time > now_us ||
+        !s->latch || s->poll_interval != interval || !slave_hears(s))
+      continue;
+    if (s->drop_rate > 0 && sim_random_unit() < s->drop_rate)
+      continue;
+    slave_sample(s);
+    s->latch_seq = seq;
+    s->latch_value = s->cur_value;
+    s->latch_int = s->cur_int;
+    s->latch_time = now_us;
+    s->latch_ready = now_us + s->sample_us;
+    s->latch_fresh = 1;
+  }
+}
+
+
+/*
+  Account a poll or read-out request for the lateness statistics. The time
+  of a read-out is that of the latch broadcast, when the sample was taken.
+*/
+static void
+count_poll(struct sim_slave *s, uint64_t t)
+{
+  ++s->poll_requests;
+  if (s->last_answered_poll)
+  {
+    uint64_t due = s->last_answered_poll + (uint64_t)s->poll_interval*1000000;
+    uint64_t late = t > due ? t - due : 0;
+    ++s->lateness_count;
+    s->lateness_sum_us += late;
+    s->lateness_sq_sum += (late / 1e3) * (late / 1e3);
+    if (late > s->lateness_max_us)
+      s->lateness_max_us = late;
+  }
+}
+
+
+/*
+  "?ff:T<seq>,<lead>,<slot>,<ids>|": the k'th slave listed answers a read-out
+  at lead + k*slot usec from now, if its sample is ready by then.
+*/
+static void
+handle_slots(void)
+{
+  uint32_t lead, slot, k, id;
+  uint64_t start;
+  char *p = (char *)w->req_arg;
+  struct sim_slave *s;
+
+  strtoul(p, &p, 10);
+  if (*p++ != ',')
+    return;
+  lead = strtoul(p, &p, 10);
+  if (*p++ != ',')
+    return;
+  slot = strtoul(p, &p, 10);
+  if (*p++ != ',')
+    return;
+  for (k = 0; p[0] != '|' && p[0] && p[1]; ++k, p += 2)
+  {
+    char hex[3] = { p[0], p[1], '\0' };
+
+    id = strtoul(hex, NULL, 16);
+    ++sim_stats.poll_requests;
+    ++sim_bus_stats[w->bus].poll_requests;
+    if (!(s = find_slave(id)) || !s->latch || !s->slots || !slave_hears(s))
+      continue;
+    s->last_heard = w->req_start;
+    s->confirm_deadline = 0;
+    if (s->latch_fresh)
+      count_poll(s, s->latch_time);
+    if (s->drop_rate > 0 && sim_random_unit() < s->drop_rate)
+      continue;
+    start = now_us + lead + (uint64_t)k*slot;
+    if (s->latch_ready > start)
+      continue;
+    respond_latched(s, s->binary_on, start > now_us + s->latency_us ?
+                    start - (now_us + s->latency_us) : 0);
+    if (s->latch_fresh)
+    {
+      ++s->poll_answers;
+      s->last_answered_poll = s->latch_time;
+      s->sample_time = s->latch_time;
+      s->sample_value = s->latch_value;
+      s->latch_fresh = 0;
+    }
+  }
+}
+
+
+/*
+  "?ffff:E<prefix>,<bits>|": slaves with extended addresses that have not
+  been addressed for a while, and whose id starts with the same bits as
+  prefix, answer. Answers at the same time garble each other.
+*/
+static void
+handle_enumerate(void)
+{
+  uint32_t prefix, bits, mask, i;
+  char *q;
+  char body[16];
+
+  prefix = strtoul(w->req_arg, &q, 16);
+  if (*q != ',')
+    return;
+  bits = strtoul(q + 1, NULL, 10);
+  mask = bits ? (0xffff0000 >> bits) & 0xffff : 0;
+  ++sim_stats.enum_requests;
+  for (i = 0; i < num_slaves; ++i)
+  {
+    struct sim_slave *s = &slaves[i];
+
+    if (s->bus != w->bus || s->id < SIM_LEGACY_IDS || !s->present ||
+        s->plug_time > now_us || (s->id & mask) != (prefix & mask) ||
+        w->req_start < s->enum_quiet_until || !slave_hears(s))
+      continue;
+    if (s->drop_rate > 0 && sim_random_unit() < s->drop_rate)
+      continue;
+    snprintf(body, sizeof(body), "!%04x:E|", (unsigned)s->id);
+    slave_respond(s, body, 0);
+  }
+}
+
+
+/*
+  Serve request cmd to id, SIM_MAX_ID for a broadcast. The argument of an
+  ASCII request is at req_arg; binary requests have none, and the answer is
+  binary too.
+*/
+static void
+serve_request(uint32_t id, uint32_t cmd, uint32_t binary)
+{
+  char body[REQ_SIZE], val[64];
+  uint8_t payload[8];
+  struct sim_slave *s;
+
+  if (binary && cmd != 'P' && cmd != 'Q')
+    return;
+  ++sim_stats.requests;
+  if (w->last_request_start &&
+      w->req_start - w->last_request_start > sim_stats.max_request_gap_us)
+    sim_stats.max_request_gap_us = w->req_start - w->last_request_start;
+  w->last_request_start = w->req_start;
+  if (id == SIM_MAX_ID)
+  {
+    if (cmd == 'L')
+      handle_latch();
+    else if (cmd == 'T')
+      handle_slots();
+    else if (cmd == 'E')
+      handle_enumerate();
+    return;
+  }
+  if (cmd == 'D')
+  {
+    ++sim_stats.discover_requests;
+    if (id < SIM_LEGACY_IDS && !w->sweep_seen[id])
+    {
+      w->sweep_seen[id] = 1;
+      if (++w->sweep_ids_seen == SIM_LEGACY_IDS)
+      {
+        uint64_t d = w->req_start - w->last_sweep_start;
+        /* The first sweep is done when it is done on every bus. */
+        if (!w->sweeps++ && d > sim_stats.first_sweep_us)
+          sim_stats.first_sweep_us = d;
+        ++sim_stats.sweeps;
+        sim_stats.sweep_sum_us += d;
+        if (d > sim_stats.sweep_max_us)
+          sim_stats.sweep_max_us = d;
+        w->last_sweep_start = w->req_start;
+        w->sweep_ids_seen = 0;
+        memset(w->sweep_seen, 0, sizeof(w->sweep_seen));
+      }
+    }
+  }
+  else if (cmd == 'P' || cmd == 'Q')
+  {
+    ++sim_stats.poll_requests;
+    ++sim_bus_stats[w->bus].poll_requests;
+  }
+
+  if (!(s = find_slave(id)))
+    return;
+
+  /* Only heard by the slave if it is at the same speed. */
+  if (!slave_hears(s))
+    return;
+  s->last_heard = w->req_start;
+  s->enum_quiet_until = w->req_start + REVERT_US;
+  s->confirm_deadline = 0;
+
+  if (cmd == 'P')
+    count_poll(s, w->req_start);
+  else if (cmd == 'Q' && s->latch && s->latch_fresh)
+    count_poll(s, s->latch_time);
+  else if (cmd == 'D')
+    ++s->discover_requests;
+
+  if (s->drop_rate > 0 && sim_random_unit() < s->drop_rate)
+    return;
+
+  if (cmd == 'D')
+  {
+    /* "?xx:Db<V>|" asks for binary frames, up to version V. */
+    s->binary_on = 0;
+    if (s->binary && w->req_arg[0] == 'b')
+    {
+      s->binary_on = strtoul(w->req_arg + 1, NULL, 10);
+      if (s->binary_on > s->binary)
+        s->binary_on = s->binary;
+    }
+    if (s->binary_on)
+      snprintf(body, sizeof(body), "!%0*x:D%u|%s|%s|b%u|", ID_DIGITS(id),
+               (unsigned)id, (unsigned)s->poll_interval, s->description,
+               s->unit, (unsigned)s->binary_on);
+    else
+      snprintf(body, sizeof(body), "!%0*x:D%u|%s|%s|", ID_DIGITS(id),
+               (unsigned)id, (unsigned)s->poll_interval, s->description,
+               s->unit);
+    slave_respond(s, body, 0);
+  }
+  else if (cmd == 'P')
+  {
+    slave_sample(s);
+    if (binary)
+    {
+      put_value(payload, s->cur_value, s->cur_int);
+      slave_respond_binary(s, 'P', payload, 5, s->sample_us);
+    }
+    else
+    {
+      format_value(val, s->cur_value, s->cur_int);
+      snprintf(body, sizeof(body), "!%0*x:P%s|", ID_DIGITS(id),
+               (unsigned)id, val);
+      slave_respond(s, body, s->sample_us);
+    }
+    ++s->poll_answers;
+    s->last_answered_poll = w->req_start;
+    s->sample_time = now_us;
+    s->sample_value = s->cur_value;
+    /* A poll supersedes any latched sample not read out yet. */
+    s->latch_fresh = 0;
+  }
+  else if (cmd == 'Q' && s->latch)
+  {
+    respond_latched(s, binary, s->latch_ready > now_us ?
+                    s->latch_ready - now_us : 0);
+    if (s->latch_fresh)
+    {
+      ++s->poll_answers;
+      s->last_answered_poll = s->latch_time;
+      s->sample_time = s->latch_time;
+      s->sample_value = s->latch_value;
+      s->latch_fresh = 0;
+    }
+  }
+  else if (cmd == 'B' && s->divisors)
+  {
+    snprintf(body, sizeof(body), "!%0*x:B%s|", ID_DIGITS(id), (unsigned)id,
+             s->divisors);
+    slave_respond(s, body, 0);
+  }
+  else if (cmd == 'R' && s->divisors)
+  {
+    uint32_t div = strtoul(w->req_arg, NULL, 10);
+    const char *p = s->divisors;
+    char *q;
+
+    while (*p)
+    {
+      if (strtoul(p, &q, 10) == div && div > 0)
+      {
+        /* Answer at the old speed, then switch. */
+        snprintf(body, sizeof(body), "!%0*x:R%u|", ID_DIGITS(id),
+                 (unsigned)id, (unsigned)div);
+        slave_respond(s, body, 0);
+        s->old_baud = s->baud;
+        s->baud = SLAVE_BAUD_CLOCK / div;
+        s->confirm_deadline = now_us + CONFIRM_US;
+        break;
+      }
+      if (q == p)
+        break;
+      p = (*q == ',') ? q + 1 : q;
+    }
+  }
+}
+
+
+/*
+  "?xx:C...|" followed by 4 hex digits of CRC, or "?xxxx:C...|" for an
+  extended address. Legacy firmware wants the ':' after two digits, so
+  only slaves with extended addresses hear the latter.
+*/
+static void
+handle_request(void)
+{
+  uint32_t crc, id, digits;
+
+  digits = w->req_len > 3 && w->req_buf[3] == ':' ? 2 : 4;
+  if (w->req_len < digits + 8 || w->req_buf[digits + 1] != ':')
+    return;
+  w->req_buf[w->req_len] = '\0';
+  crc = strtoul(w->req_buf + w->req_len - 4, NULL, 16);
+  if (crc != sim_crc16(w->req_buf, w->req_len - 4))
+    return;
+  id = strtoul(w->req_buf + 1, NULL, 16);
+  w->req_arg = w->req_buf + digits + 3;
+  if (id == (digits == 2 ? 0xff : 0xffff))
+    id = SIM_MAX_ID;
+  else if (digits == 2)
+    id &= 0x7f;
+  else if (id < SIM_LEGACY_IDS)
+    return;
+  serve_request(id, w->req_buf[digits + 2], 0);
+}
+
+
+/* "<SOF> <N> <id> <cmd> <CRC lo> <CRC hi>", see master.c. */
+static void
+handle_binary_request(void)
+{
+  uint32_t crc;
+
+  if (w->req_len < 6 || (uint8_t)w->req_buf[1] + 4 != w->req_len)
+    return;
+  crc = (uint8_t)w->req_buf[w->req_len - 2] |
+    (uint8_t)w->req_buf[w->req_len - 1] << 8;
+  if (crc != sim_crc16(w->req_buf, w->req_len - 2))
+    return;
+  serve_request((uint8_t)w->req_buf[2] & 0x7f, w->req_buf[3], 1);
+}
+
+
+uint64_t
+current_time(void)
+{
+  return now_us / 1000;
+}
+
+
+uint64_t
+current_time_us(void)
+{
+  return now_us;
+}
+
+
+void
+delay_milliseconds(uint32_t ms)
+{
+  advance_to(now_us + (uint64_t)ms * 1000);
+}
+
+
+void
+turnaround_delay(void)
+{
+  advance_to(now_us + 11);
+}
+
+
+void
+wait_for_event(void)
+{
+  /*
+    Jump to the next byte received or sent on any bus, but never past the
+    next tick, so that timeouts expire at the same time as on the target.
+  */
+  uint64_t start = now_us;
+  uint64_t tick_us = 1000000 / HAL_TICK_HZ;
+  uint64_t next = (now_us / tick_us + 1) * tick_us;
+  struct sim_wire *x;
+  uint32_t b;
+
+  for (b = 0; b < NUM_BUS; ++b)
+  {
+    x = &wires[b];
+    if (x->rxq_tail != x->rxq_head && x->rxq[x->rxq_tail].time < next)
+      next = x->rxq[x->rxq_tail].time;
+    if (x->txq_tail != x->txq_head &&
+        x->txq[x->txq_tail % TXQ_SIZE].time < next)
+      next = x->txq[x->txq_tail % TXQ_SIZE].time;
+  }
+  advance_to(next);
+  sim_stats.idle_us += now_us - start;
+}
+
+
+void
+led_on(void)
+{
+}
+
+
+void
+led_off(void)
+{
+}
+
+
+void
+rs485_tx_mode(uint32_t bus)
+{
+}
+
+
+void
+rs485_rx_mode(uint32_t bus)
+{
+}
+
+
+uint32_t
+bus_tx_space(uint32_t bus)
+{
+  return wires[bus].txq_head - wires[bus].txq_tail < TXQ_SIZE;
+}
+
+
+void
+bus_putc(uint32_t bus, uint32_t c)
+{
+  struct sim_wire *x = &wires[bus];
+  uint64_t start = x->txq_wire_end > now_us ? x->txq_wire_end : now_us;
+  uint32_t i = x->txq_head++ % TXQ_SIZE;
+
+  ++sim_stats.bus_bytes_out;
+  sim_stats.bus_busy_us += BYTE_US(x->baud);
+  sim_bus_stats[bus].bus_busy_us += BYTE_US(x->baud);
+  x->txq_wire_end = start + BYTE_US(x->baud);
+  x->txq[i].start = start;
+  x->txq[i].time = x->txq_wire_end;
+  x->txq[i].c = c;
+}
+
+
+/* Byte c of a request, sent from start, is off the wire of w. */
+static void
+bus_byte_sent(uint32_t c, uint64_t start)
+{
+  if (c == '?' && !w->req_bin_left)
+  {
+    w->req_len = 0;
+    w->req_start = start;
+  }
+  else if (c == BIN_REQUEST && !w->req_bin_left)
+  {
+    w->req_len = 0;
+    w->req_start = start;
+    /* This and the length byte; then that many more and the CRC. */
+    w->req_bin_left = 2;
+  }
+  if (w->req_bin_left)
+  {
+    if (w->req_len < REQ_SIZE - 1)
+      w->req_buf[w->req_len++] = c;
+    if (w->req_len == 2)
+      w->req_bin_left += (c & 0xff) + 2;
+    if (!--w->req_bin_left)
+    {
+      handle_binary_request();
+      w->req_len = 0;
+    }
+    return;
+  }
+  if (c == '\r' || c == 0xff)
+    return;
+  if (c == '\n')
+  {
+    handle_request();
+    w->req_len = 0;
+    return;
+  }
+  if (w->req_len < REQ_SIZE - 1)
+    w->req_buf[w->req_len++] = c;
+}
+
+
+uint32_t
+bus_tx_done(uint32_t bus)
+{
+  return wires[bus].txq_head == wires[bus].txq_tail;
+}
+
+
+void
+bus_set_baud(uint32_t bus, uint32_t baud)
+{
+  if (baud != wires[bus].baud)
+    ++sim_stats.baud_changes;
+  wires[bus].baud = baud;
+  sim_bus_stats[bus].baud = baud;
+}
+
+
+void
+host_tx_start(void)
+{
+  if (host_tx_cur < 0 && (host_tx_cur = host_tx_getc()) >= 0)
+    host_tx_done = now_us + host_byte_us;
+}
+
+
+uint32_t
+host_chars_avail(void)
+{
+  return host_in && *host_in;
+}
+
+
+uint32_t
+host_getc(void)
+{
+  if (!host_in || !*host_in)
+    return 0;
+  return (uint8_t)*host_in++;
+}
+
+
+static void
+engine_entry(int bus)
+{
+  engine_fn[bus](bus);
+}
+
+
+void
+hal_engine_start(uint32_t bus, void (*fn)(uint32_t bus))
+{
+  ucontext_t *c = &engine_context[bus];
+
+  memset(engine_stack[bus], STACK_FILL, sizeof(engine_stack[bus]));
+  getcontext(c);
+  c->uc_stack.ss_sp = engine_stack[bus];
+  c->uc_stack.ss_size = sizeof(engine_stack[bus]);
+  c->uc_link = NULL;
+  engine_fn[bus] = fn;
+  makecontext(c, (void (*)(void))engine_entry, 1, (int)bus);
+}
+
+
+void
+hal_engine_resume(uint32_t bus)
+{
+  uint32_t i;
+
+  swapcontext(&main_context, &engine_context[bus]);
+  for (i = 0; i < STACK_GUARD; ++i)
+    if ((uint8_t)engine_stack[bus][i] != STACK_FILL)
+    {
+      fprintf(stderr, "Stack overflow in the engine of bus %u\n",
+              (unsigned)bus);
+      abort();
+    }
+}
+
+
+void
+hal_engine_yield(uint32_t bus)
+{
+  swapcontext(&engine_context[bus], &main_context);
+}
+
+
+uint32_t
+hal_engine_stack_used(uint32_t bus)
+{
+  uint32_t i;
+
+  for (i = 0; i < ENGINE_STACK && (uint8_t)engine_stack[bus][i] == STACK_FILL;
+       ++i)
+    ;
+  return ENGINE_STACK - i;
+}
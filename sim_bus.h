@@ -0,0 +1,193 @@
+#ifndef SIM_BUS_H
+#define SIM_BUS_H
+
+#include <inttypes.h>
+
+#include "hal.h"
+
+/*
+  Simulated RS485 bus for running the master core on a Linux host.
+
+  sim_bus.c implements the functions in hal.h against a virtual clock (in
+  microseconds) and a set of virtual slaves. Bytes sent by the master take
+  the time they would take on the wire; slaves answer after a configurable
+  latency plus random jitter, or not at all with a configurable probability.
+
+  Slaves can be given a list of bus speeds to support. A request is only
+  heard by a slave at the same speed as the master's UART, and a response
+  only received if the master is still at that speed.
+
+  Slaves can also support latched polling, taking a sample on the latch
+  broadcast and answering read-outs of it, also in time slots. Answers from
+  two slaves that overlap on the wire are garbled.
+
+  Slaves can support binary frames, agreed on in the discover request, for
+  polls and read-outs.
+
+  Slaves with an id of SIM_LEGACY_IDS or more have extended addresses, and
+  answer enumeration requests until they are addressed directly.
+
+  There are NUM_BUS buses, each with its own UART on the master and its own
+  slaves, running at the same time. Statistics in sim_stats are over all of
+  them, those in sim_bus_stats for each.
+*/
+
+#define SIM_MAX_SLAVES 4096
+/* Device ids are 0 .. SIM_MAX_ID-1; the legacy ones 0 .. SIM_LEGACY_IDS-1. */
+#define SIM_MAX_ID 0x10000
+#define SIM_LEGACY_IDS 128
+
+struct sim_slave {
+  uint32_t bus;
+  uint32_t id;
+  uint32_t poll_interval;
+  const char *description;
+  const char *unit;
+  /* Time from end of request to first response byte, in usec. */
+  uint32_t latency_us;
+  /* Uniformly distributed extra latency, 0..jitter_us. */
+  uint32_t jitter_us;
+  /* Probability of not answering a request at all. */
+  double drop_rate;
+  /* Set to zero to simulate the slave being unplugged. */
+  uint32_t present;
+  /* Slave does not answer before this time (usec), to simulate plugging in. */
+  uint64_t plug_time;
+  /* If set, poll values are 1, 2, 3, ... so the receiver can check order. */
+  uint32_t sequence_values;
+  /*
+    If set, poll values cycle through extremes of float and integer values,
+    for testing how values are passed on.
+  */
+  uint32_t edge_values;
+  /*
+    Bus speed divisors the slave supports, eg. "17,8,4,2", or NULL for old
+    firmware that only runs at the legacy rate.
+  */
+  const char *divisors;
+  /* Current bus speed, and when the slave last got a request at it. */
+  uint32_t baud;
+  uint64_t last_heard;
+  /* Extended address: does not answer enumeration before this time. */
+  uint64_t enum_quiet_until;
+  /* After a speed switch, go back to old_baud if not confirmed by then. */
+  uint64_t confirm_deadline;
+  uint32_t old_baud;
+  /* Supports the latch broadcast and latched read-out, and in slots. */
+  uint32_t latch;
+  uint32_t slots;
+  /* Time to take a sample, in usec; a poll is answered this much later. */
+  uint32_t sample_us;
+  /*
+    Binary frame version supported, or 0 for none, and the version agreed
+    in the last discover request.
+  */
+  uint32_t binary;
+  uint32_t binary_on;
+  /*
+    Last latched sample: its number, value (and whether an integer), time
+    taken, when ready, and whether it has not been read out yet.
+  */
+  uint32_t latch_seq;
+  double latch_value;
+  uint32_t latch_int;
+  uint64_t latch_time;
+  uint64_t latch_ready;
+  uint32_t latch_fresh;
+  /* When the value in the last poll or read-out answer was sampled, and it. */
+  uint64_t sample_time;
+  double sample_value;
+
+  /* Statistics collected by the simulation. */
+  uint64_t poll_requests;
+  uint64_t poll_answers;
+  uint64_t discover_requests;
+  /* Start of the last poll or read-out request that was answered, in usec. */
+  uint64_t last_answered_poll;
+  /* Lateness of poll requests relative to last answered poll + interval. */
+  uint64_t lateness_count;
+  uint64_t lateness_sum_us;
+  uint64_t lateness_max_us;
+  /* Sum of squared lateness, in ms^2, for computing the jitter. */
+  double lateness_sq_sum;
+  /* Random walk of the values, and the last sample taken. */
+  float value;
+  double cur_value;
+  uint32_t cur_int;
+};
+
+struct sim_stats {
+  uint64_t bus_bytes_out;
+  uint64_t bus_bytes_in;
+  uint64_t host_bytes_out;
+  uint64_t requests;
+  uint64_t poll_requests;
+  uint64_t discover_requests;
+  /*
+    Discover sweep time: the time taken until every legacy device id has
+    been sent at least one discover request, on one bus. The first sweep is
+    the slowest bus.
+  */
+  uint64_t sweeps;
+  uint64_t first_sweep_us;
+  uint64_t sweep_sum_us;
+  uint64_t sweep_max_us;
+  /* Enumeration requests sent. */
+  uint64_t enum_requests;
+  /* Longest time between the start of two consecutive requests. */
+  uint64_t max_request_gap_us;
+  /* Time spent in wait_for_event(), ie. where the target would sleep. */
+  uint64_t idle_us;
+  /* Time with bytes on the wire, in either direction. */
+  uint64_t bus_busy_us;
+  /* Slave answers garbled by another answer overlapping it. */
+  uint64_t collisions;
+  /* Number of times the speed of a master's bus UART changed. */
+  uint32_t baud_changes;
+};
+
+struct sim_bus_stats {
+  uint64_t poll_requests;
+  uint64_t bus_busy_us;
+  /* Speed of the master's UART. */
+  uint32_t baud;
+};
+
+extern struct sim_stats sim_stats;
+extern struct sim_bus_stats sim_bus_stats[NUM_BUS];
+
+extern void sim_init(uint32_t seed);
+extern struct sim_slave *sim_add_slave(uint32_t bus, uint32_t id,
+                                       uint32_t poll_interval,
+                                       const char *description,
+                                       const char *unit);
+extern uint32_t sim_slave_count(void);
+extern struct sim_slave *sim_get_slave(uint32_t idx);
+/* The slave with device id id on bus, or NULL. */
+extern struct sim_slave *sim_find_slave(uint32_t bus, uint32_t id);
+/* Current virtual time in microseconds. */
+extern uint64_t sim_now_us(void);
+/* Queue characters to be read by the master from the host link. */
+extern void sim_host_input(const char *s);
+/*
+  Bytes sent on the bus faster than this are lost, as on a long or poor
+  cable. Default 0, no limit.
+*/
+extern void sim_set_bus_max_baud(uint32_t baud);
+/* Speed of the host link, default 115200. */
+extern void sim_set_host_baud(uint32_t baud);
+/* Called for every complete line the master writes to the host. */
+extern void sim_set_host_line_hook(void (*hook)(const char *line));
+/*
+  Called for every binary frame the master writes to the host (see
+  host_tx.h), with all of its bytes.
+*/
+extern void sim_set_host_frame_hook(void (*hook)(const uint8_t *frame,
+                                                 uint32_t len));
+/*
+  CRC-16 of the bus protocol, computed bit by bit, independent of the
+  master's crc16.c.
+*/
+extern uint32_t sim_crc16(const char *buf, uint32_t len);
+
+#endif  /* SIM_BUS_H */
@@ -0,0 +1,121 @@
+#include <inttypes.h>
+#include <string.h>
+
+#include "strpool.h"
+
+
+uint32_t
+strpool_equal(const struct strpool *sp, uint32_t h, const char *s,
+              uint32_t len)
+{
+  return strpool_len(sp, h) == len && !memcmp(strpool_str(sp, h), s, len);
+}
+
+
+/* Slide the strings still in use down over the unused ones. */
+static void
+compact(struct strpool *sp)
+{
+  uint32_t rd = 0, wr = 0, h, n;
+
+  while (rd < sp->end)
+  {
+    n = STRPOOL_HDR + sp->data[rd];
+    h = sp->data[rd + 1];
+    if (h)
+    {
+      memmove(&sp->data[wr], &sp->data[rd], n);
+      sp->off[h] = wr + STRPOOL_HDR;
+      wr += n;
+    }
+    rd += n;
+  }
+  sp->end = wr;
+}
+
+
+/* Store a new string, returning its handle, or 0 if there is no room. */
+static uint32_t
+add(struct strpool *sp, const char *s, uint32_t len)
+{
+  uint32_t h, n = STRPOOL_HDR + len;
+
+  for (h = 1; h <= STRPOOL_ENTRIES && sp->refs[h]; ++h)
+    ;
+  if (h > STRPOOL_ENTRIES)
+    return 0;
+  if (sp->end + n > STRPOOL_SIZE)
+  {
+    compact(sp);
+    if (sp->end + n > STRPOOL_SIZE)
+      return 0;
+  }
+  sp->data[sp->end] = len;
+  sp->data[sp->end + 1] = h;
+  memcpy(&sp->data[sp->end + STRPOOL_HDR], s, len);
+  sp->off[h] = sp->end + STRPOOL_HDR;
+  sp->end += n;
+  return h;
+}
+
+
+/*
+  Take a reference to the len bytes at s, sharing an existing string if
+  there is one, and store its handle in *h. Returns 0 if there is no room.
+*/
+static uint32_t
+take(struct strpool *sp, uint8_t *h, const char *s, uint32_t len)
+{
+  uint32_t k, new_h = 0;
+
+  if (len > 255)
+    return 0;
+  if (len)
+  {
+    for (k = 1; k <= STRPOOL_ENTRIES && !new_h; ++k)
+      if (sp->refs[k] && strpool_equal(sp, k, s, len))
+        new_h = k;
+    if (!new_h && !(new_h = add(sp, s, len)))
+      return 0;
+    ++sp->refs[new_h];
+  }
+  *h = new_h;
+  return 1;
+}
+
+
+uint32_t
+strpool_set_pair(struct strpool *sp, uint8_t *h1, const char *s1,
+                 uint32_t len1, uint8_t *h2, const char *s2, uint32_t len2)
+{
+  uint8_t new1, new2;
+
+  if (!take(sp, &new1, s1, len1))
+    return 0;
+  if (!take(sp, &new2, s2, len2))
+  {
+    strpool_release(sp, &new1);
+    return 0;
+  }
+  strpool_release(sp, h1);
+  strpool_release(sp, h2);
+  *h1 = new1;
+  *h2 = new2;
+  return 1;
+}
+
+
+void
+strpool_release(struct strpool *sp, uint8_t *h)
+{
+  uint32_t k = *h;
+
+  *h = 0;
+  if (k && !--sp->refs[k])
+  {
+    /* Free the handle; the space goes at the next compaction. */
+    sp->data[sp->off[k] - 1] = 0;
+    if (sp->off[k] + strpool_len(sp, k) == sp->end)
+      sp->end = sp->off[k] - STRPOOL_HDR;
+  }
+}
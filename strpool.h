@@ -0,0 +1,78 @@
+#ifndef STRPOOL_H
+#define STRPOOL_H
+
+#include <inttypes.h>
+
+/*
+  String pool for the description and unit strings of the devices.
+
+  Most buses have many devices of a few kinds, so the strings are stored
+  once each, with a count of users, and just as long as they are, rather
+  than in a fixed size buffer for every device. A device refers to a string
+  by a one byte handle; handle 0 is the empty string, which takes no room.
+
+  Strings are laid out back to back in data[], each after a header of its
+  length and handle. A string no longer used just has the handle in its
+  header cleared, and the space is reclaimed by sliding the later strings
+  down when a new string does not fit at the end. This happens only when
+  devices come and go or change their strings, so it need not be fast.
+*/
+
+/*
+  Bytes for strings and their headers: enough for a full bus of 128 legacy
+  devices with descriptions of their own, of about 26 characters as
+  bench_master -D gives them, and a few more. Two such buses would take
+  more SRAM than the target has, and more handles than there are.
+*/
+#define STRPOOL_SIZE 3840
+/* Number of distinct non-empty strings; handles are 1 .. STRPOOL_ENTRIES. */
+#define STRPOOL_ENTRIES 255
+#define STRPOOL_HDR 2
+
+#if STRPOOL_ENTRIES > 255
+#error STRPOOL_ENTRIES larger than 255, handles do not fit in uint8_t
+#endif
+#if STRPOOL_SIZE > 65535
+#error STRPOOL_SIZE larger than 65535, offsets do not fit in uint16_t
+#endif
+
+struct strpool {
+  /* Offset in data of the text of each string, by handle. */
+  uint16_t off[STRPOOL_ENTRIES+1];
+  /* Number of users of each string, 0 for a free handle. */
+  uint16_t refs[STRPOOL_ENTRIES+1];
+  /* End of the strings in data. */
+  uint32_t end;
+  uint8_t data[STRPOOL_SIZE];
+};
+
+/* Text and length of the string with handle h, not NUL-terminated. */
+static inline const char *
+strpool_str(const struct strpool *sp, uint32_t h)
+{
+  return (const char *)sp->data + sp->off[h];
+}
+
+static inline uint32_t
+strpool_len(const struct strpool *sp, uint32_t h)
+{
+  return h ? sp->data[sp->off[h] - STRPOOL_HDR] : 0;
+}
+
+/* Whether the string with handle h is the len bytes at s. */
+extern uint32_t strpool_equal(const struct strpool *sp, uint32_t h,
+                              const char *s, uint32_t len);
+/*
+  Make *h1 refer to the len1 bytes at s1, and *h2 to the len2 bytes at s2
+  (at most 255 each), sharing existing strings where there are some, and
+  drop the strings they referred to. Returns 0, and leaves both alone, if
+  there is no room for the new strings; the old ones are dropped only
+  after, so there must be room for old and new at once.
+*/
+extern uint32_t strpool_set_pair(struct strpool *sp, uint8_t *h1,
+                                 const char *s1, uint32_t len1, uint8_t *h2,
+                                 const char *s2, uint32_t len2);
+/* Drop the string *h refers to, and set *h to the empty string. */
+extern void strpool_release(struct strpool *sp, uint8_t *h);
+
+#endif  /* STRPOOL_H */